@@ -0,0 +1,521 @@
+#ifdef __linux__
+#define _GNU_SOURCE // struct ucred
+#endif
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/prctl.h>
+#endif
+
+#include "agent.h"
+#include "database.h"
+#include "error.h"
+#include "ipc.h"
+#include "password.h"
+
+#ifndef NDEBUG
+#define AGENT_IDLE_TIMEOUT 60
+#else
+#define AGENT_IDLE_TIMEOUT 900
+#endif
+
+#define AGENT_SOCKET_SUFFIX ".sock"
+
+// a slow or stuck client must not block everybody else for long
+#define AGENT_IO_TIMEOUT 1
+
+// upper bound for any single identifier or secret sent to the agent
+#define AGENT_MAX_FIELD_LENGTH (64 * 1024)
+
+// accesses kept in memory before they are written to the journal
+#define AGENT_ACCESS_BATCH 32
+
+/**
+ * Wire format: every request is a header followed by the identifier and the
+ * secret bytes, every reply a header followed by the payload. One request is
+ * served per connection.
+ */
+typedef struct AgentRequest {
+  uint32_t op;
+  uint32_t identifier_len;
+  uint32_t secret_len;
+} AgentRequest;
+
+typedef struct AgentReply {
+  uint32_t status;
+  uint32_t payload_len;
+} AgentReply;
+
+// agent state, kept in locked memory
+static Entries entries;
+static VaultKey agent_key;
+static volatile sig_atomic_t stop_requested;
+// accesses to entries since they were last saved
+static int unsaved_accesses;
+
+static bool get_socket_address(struct sockaddr_un *address) {
+  char db_path[FS_MAX_PATH_LENGTH];
+  if (!get_db_path(db_path)) {
+    return false;
+  }
+
+  memset(address, 0, sizeof(struct sockaddr_un));
+  address->sun_family = AF_UNIX;
+
+  int length = snprintf(address->sun_path, sizeof(address->sun_path), "%s%s",
+                        db_path, AGENT_SOCKET_SUFFIX);
+  if (length < 0 || (size_t)length >= sizeof(address->sun_path)) {
+    last_error = ERR_AGENT;
+    return false;
+  }
+
+  return true;
+}
+
+static int connect_agent() {
+  struct sockaddr_un address;
+  if (!get_socket_address(&address)) {
+    return -1;
+  }
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    return -1;
+  }
+
+  if (connect(fd, (struct sockaddr *)&address, sizeof(address)) != 0) {
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+static bool read_all(int fd, void *buffer, size_t length) {
+  char *ptr = buffer;
+  while (length > 0) {
+    ssize_t res = read(fd, ptr, length);
+    if (res < 0 && errno == EINTR) {
+      continue;
+    }
+
+    if (res <= 0) {
+      return false;
+    }
+
+    ptr += res;
+    length -= res;
+  }
+
+  return true;
+}
+
+static bool write_all(int fd, const void *buffer, size_t length) {
+  const char *ptr = buffer;
+  while (length > 0) {
+    ssize_t res = write(fd, ptr, length);
+    if (res < 0 && errno == EINTR) {
+      continue;
+    }
+
+    if (res <= 0) {
+      return false;
+    }
+
+    ptr += res;
+    length -= res;
+  }
+
+  return true;
+}
+
+bool agent_available() {
+  int fd = connect_agent();
+  if (fd < 0) {
+    return false;
+  }
+
+  close(fd);
+  return true;
+}
+
+bool agent_request(AgentOp op, char *identifier, char *secret,
+                   AgentStatus *status, char **reply, size_t *reply_len) {
+  int fd = connect_agent();
+  if (fd < 0) {
+    last_error = ERR_AGENT;
+    return false;
+  }
+
+  AgentRequest request = {op, identifier ? strlen(identifier) : 0,
+                          secret ? strlen(secret) : 0};
+  AgentReply response;
+
+  bool ok = write_all(fd, &request, sizeof(request)) &&
+            write_all(fd, identifier, request.identifier_len) &&
+            write_all(fd, secret, request.secret_len) &&
+            read_all(fd, &response, sizeof(response));
+
+  char *payload = NULL;
+  if (ok) {
+    payload = malloc(response.payload_len + 1);
+    ok = payload && read_all(fd, payload, response.payload_len);
+  }
+
+  close(fd);
+
+  if (!ok) {
+    free(payload);
+    last_error = ERR_AGENT;
+    return false;
+  }
+
+  payload[response.payload_len] = '\0';
+  *status = response.status;
+
+  if (reply) {
+    *reply = payload;
+    *reply_len = response.payload_len;
+  } else {
+    memset(payload, 0, response.payload_len);
+    free(payload);
+  }
+
+  return true;
+}
+
+static void wipe_agent_state() {
+  entries_free(&entries);
+  crypto_wipe_key(&agent_key);
+}
+
+static bool store_entries() {
+  bool ok = save_database(&agent_key, &entries);
+  if (ok) {
+    unsaved_accesses = 0;
+    publish_identifiers(&entries);
+  }
+
+  return ok;
+}
+
+/**
+ * Picks up changes made to the database file by anyone else than the agent.
+ */
+static bool refresh_entries() {
+  VaultIdentity identity;
+  if (!database_identity(&identity)) {
+    return false;
+  }
+
+  if (memcmp(&identity, &entries.identity, sizeof(VaultIdentity)) == 0) {
+    return true;
+  }
+
+  // saving pending accesses applies them to the latest version
+  if (entries.change_count > 0) {
+    return store_entries();
+  }
+
+  Entries reloaded;
+  if (!read_database(&agent_key, &reloaded)) {
+    return false;
+  }
+
+  entries_free(&entries);
+  entries = reloaded;
+  publish_identifiers(&entries);
+  return true;
+}
+
+static bool peer_allowed(int fd) {
+#ifdef SO_PEERCRED
+  struct ucred credentials;
+  socklen_t length = sizeof(credentials);
+  if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &credentials, &length) != 0) {
+    return false;
+  }
+
+  return credentials.uid == getuid();
+#else
+  // the socket itself is only accessible to the owner
+  return true;
+#endif
+}
+
+static void reply(int fd, AgentStatus status, char *payload, size_t length) {
+  AgentReply response = {status, length};
+  if (write_all(fd, &response, sizeof(response))) {
+    write_all(fd, payload, length);
+  }
+}
+
+static bool is_list_op(AgentOp op) {
+  return op == AGENT_OP_LIST || op == AGENT_OP_LIST_RECENT ||
+         op == AGENT_OP_LIST_FREQUENT;
+}
+
+static void serve_list(int fd, AgentOp op) {
+  EntryOrder order = op == AGENT_OP_LIST_RECENT     ? ORDER_RECENT
+                     : op == AGENT_OP_LIST_FREQUENT ? ORDER_FREQUENT
+                                                    : ORDER_STORED;
+  char **identifiers = ordered_identifiers(&entries, order);
+
+  size_t length = 0;
+  for (int i = 0; i < entries.count; i++) {
+    length += entries.items[i].identifier_length + 1;
+  }
+
+  // identifiers, each terminated by a new line
+  char *payload = identifiers ? malloc(length + 1) : NULL;
+  if (!payload) {
+    free(identifiers);
+    reply(fd, AGENT_FAILED, NULL, 0);
+    return;
+  }
+
+  char *ptr = payload;
+  for (int i = 0; i < entries.count; i++) {
+    size_t id_length = strlen(identifiers[i]);
+    memcpy(ptr, identifiers[i], id_length);
+    ptr[id_length] = '\n';
+    ptr += id_length + 1;
+  }
+
+  reply(fd, AGENT_OK, payload, length);
+  free(payload);
+  free(identifiers);
+}
+
+static void serve_request(int fd, AgentRequest *request, char *identifier,
+                          char *secret) {
+  if (!refresh_entries()) {
+    // the database can no longer be decrypted with the agent key
+    reply(fd, AGENT_FAILED, NULL, 0);
+    stop_requested = true;
+    return;
+  }
+
+  if (is_list_op(request->op)) {
+    serve_list(fd, request->op);
+    return;
+  }
+
+  int entry_idx = find_password_entry(&entries, identifier);
+
+  switch (request->op) {
+  case AGENT_OP_FIND:
+    reply(fd, entry_idx >= 0 ? AGENT_OK : AGENT_NOT_FOUND, NULL, 0);
+    break;
+
+  case AGENT_OP_GET: {
+    if (entry_idx < 0) {
+      reply(fd, AGENT_NOT_FOUND, NULL, 0);
+      break;
+    }
+
+    if (!read_entry(&agent_key, &entries, entry_idx)) {
+      reply(fd, AGENT_FAILED, NULL, 0);
+      break;
+    }
+
+    char *password = entries.items[entry_idx].password;
+    reply(fd, AGENT_OK, password, strlen(password));
+
+    // accesses are written in batches, and when the agent exits
+    if (touch_entry(&entries, entry_idx, (uint32_t)time(NULL), 1) &&
+        ++unsaved_accesses >= AGENT_ACCESS_BATCH) {
+      store_entries();
+    }
+    break;
+  }
+
+  case AGENT_OP_PUT:
+    if (create_entry(&entries, entry_idx, identifier, secret) < 0) {
+      reply(fd, AGENT_FAILED, NULL, 0);
+      break;
+    }
+
+    reply(fd, store_entries() ? AGENT_OK : AGENT_FAILED, NULL, 0);
+    break;
+
+  case AGENT_OP_DEL:
+    if (entry_idx < 0) {
+      reply(fd, AGENT_NOT_FOUND, NULL, 0);
+      break;
+    }
+
+    bool deleted = delete_entry(&entries, entry_idx) && store_entries();
+    reply(fd, deleted ? AGENT_OK : AGENT_FAILED, NULL, 0);
+    break;
+
+  default:
+    reply(fd, AGENT_FAILED, NULL, 0);
+  }
+}
+
+static void serve_client(int fd) {
+  struct timeval timeout = {AGENT_IO_TIMEOUT, 0};
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+  AgentRequest request;
+  if (!peer_allowed(fd) || !read_all(fd, &request, sizeof(request))) {
+    return;
+  }
+
+  if (request.identifier_len > AGENT_MAX_FIELD_LENGTH ||
+      request.secret_len > AGENT_MAX_FIELD_LENGTH) {
+    reply(fd, AGENT_FAILED, NULL, 0);
+    return;
+  }
+
+  char *identifier = calloc(1, request.identifier_len + 1);
+  char *secret = calloc(1, request.secret_len + 1);
+
+  if (identifier && secret &&
+      read_all(fd, identifier, request.identifier_len) &&
+      read_all(fd, secret, request.secret_len)) {
+    if (is_list_op(request.op) || check_password_identifier(identifier)) {
+      serve_request(fd, &request, identifier, secret);
+    } else {
+      reply(fd, AGENT_FAILED, NULL, 0);
+    }
+  }
+
+  if (secret) {
+    memset(secret, 0, request.secret_len);
+  }
+
+  free(identifier);
+  free(secret);
+}
+
+static void handle_stop_signal(int signal) {
+  (void)signal;
+  stop_requested = true;
+}
+
+static void serve_forever(int listen_fd) {
+  signal(SIGPIPE, SIG_IGN);
+  signal(SIGTERM, handle_stop_signal);
+  signal(SIGINT, handle_stop_signal);
+
+  while (!stop_requested) {
+    struct pollfd pending = {listen_fd, POLLIN, 0};
+    int ready = poll(&pending, 1, AGENT_IDLE_TIMEOUT * 1000);
+
+    if (ready < 0 && errno == EINTR) {
+      continue;
+    }
+
+    // idle for too long, or broken socket
+    if (ready <= 0) {
+      break;
+    }
+
+    int client = accept(listen_fd, NULL, NULL);
+    if (client >= 0) {
+      serve_client(client);
+      close(client);
+    }
+  }
+}
+
+/**
+ * The agent runs as a standalone process, which keeps the decrypted database
+ * in locked memory and serves requests from other pass processes over a Unix
+ * domain socket next to the database file. It exits and wipes all state after
+ * being idle for a while.
+ */
+bool run_agent(VaultKey *key) {
+  struct sockaddr_un address;
+  if (!get_socket_address(&address)) {
+    return false;
+  }
+
+  memcpy(&agent_key, key, sizeof(VaultKey));
+  entries_init(&entries);
+  if (!read_database(&agent_key, &entries)) {
+    wipe_agent_state();
+    return false;
+  }
+
+  int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listen_fd < 0) {
+    wipe_agent_state();
+    last_error = ERR_AGENT;
+    return false;
+  }
+
+  // only the owner may connect; a left-over socket belongs to a dead agent
+  unlink(address.sun_path);
+  mode_t mask = umask(0177);
+  bool bound =
+      bind(listen_fd, (struct sockaddr *)&address, sizeof(address)) == 0 &&
+      listen(listen_fd, SOMAXCONN) == 0;
+  umask(mask);
+
+  if (!bound) {
+    close(listen_fd);
+    wipe_agent_state();
+    last_error = ERR_AGENT;
+    return false;
+  }
+
+  // parent
+  pid_t pid = fork();
+  if (pid != 0) {
+    close(listen_fd);
+    wipe_agent_state();
+
+    if (pid < 0) {
+      unlink(address.sun_path);
+      last_error = ERR_AGENT;
+      return false;
+    }
+
+    return true;
+  }
+
+  // child from here on
+  if (setsid() < 0) {
+    exit(EXIT_FAILURE);
+  }
+
+  close(STDIN_FILENO);
+  close(STDOUT_FILENO);
+  close(STDERR_FILENO);
+
+  // keep secrets out of swap and core dumps
+  mlockall(MCL_CURRENT | MCL_FUTURE);
+#ifdef __linux__
+  prctl(PR_SET_DUMPABLE, 0);
+#endif
+
+  serve_forever(listen_fd);
+
+  // accesses which have not been written yet
+  if (entries.change_count > 0) {
+    save_database(&agent_key, &entries);
+  }
+
+  close(listen_fd);
+  unlink(address.sun_path);
+  wipe_agent_state();
+  clear_identifiers();
+  exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,15 @@
+#include "agent.h"
+#include "error.h"
+
+bool agent_available() { return false; }
+
+bool run_agent(VaultKey *key) {
+  last_error = ERR_AGENT;
+  return false;
+}
+
+bool agent_request(AgentOp op, char *identifier, char *secret,
+                   AgentStatus *status, char **reply, size_t *reply_len) {
+  last_error = ERR_AGENT;
+  return false;
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "crypto.h"
+
+typedef enum AgentOp {
+  AGENT_OP_FIND,
+  AGENT_OP_GET,
+  AGENT_OP_LIST,
+  AGENT_OP_PUT,
+  AGENT_OP_DEL,
+  // lists ordered by usage
+  AGENT_OP_LIST_RECENT,
+  AGENT_OP_LIST_FREQUENT,
+} AgentOp;
+
+typedef enum AgentStatus {
+  AGENT_OK,
+  AGENT_NOT_FOUND,
+  AGENT_FAILED,
+} AgentStatus;
+
+bool agent_available();
+bool run_agent(VaultKey *key);
+bool agent_request(AgentOp op, char *identifier, char *secret,
+                   AgentStatus *status, char **reply, size_t *reply_len);
@@ -0,0 +1,246 @@
+#include <openssl/crypto.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include "arena.h"
+#include "error.h"
+
+#define ARENA_BLOCK_SIZE (64 * 1024)
+#define ARENA_ALIGNMENT 16
+// released blocks kept for reuse
+#define ARENA_SPARE_BLOCKS 16
+
+struct ArenaBlock {
+  ArenaBlock *next;
+  size_t size;
+  size_t used;
+  size_t mapped;
+  _Alignas(ARENA_ALIGNMENT) unsigned char data[];
+};
+
+/**
+ * Arenas are filled on several threads at once, e.g. while shards are loaded,
+ * so the page size is cached atomically; threads racing to look it up store
+ * the same value.
+ */
+static size_t page_size() {
+  static atomic_size_t cached;
+  size_t page = atomic_load_explicit(&cached, memory_order_relaxed);
+  if (!page) {
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    page = info.dwPageSize;
+#else
+    long size = sysconf(_SC_PAGESIZE);
+    page = size > 0 ? (size_t)size : 4096;
+#endif
+    atomic_store_explicit(&cached, page, memory_order_relaxed);
+  }
+
+  return page;
+}
+
+/**
+ * Blocks hold decrypted secrets, so each one is mapped on pages of its own
+ * between two inaccessible guard pages, which turn overruns into crashes
+ * rather than reads of neighbouring memory. The pages are locked into memory
+ * where the limits allow it, so they are never swapped out, and left out of
+ * core dumps.
+ */
+static ArenaBlock *map_block(size_t size) {
+  size_t page = page_size();
+  size_t length = (sizeof(ArenaBlock) + size + page - 1) / page * page;
+  unsigned char *region;
+
+#ifdef _WIN32
+  region = VirtualAlloc(NULL, length + 2 * page, MEM_RESERVE | MEM_COMMIT,
+                        PAGE_READWRITE);
+  DWORD previous;
+  if (region &&
+      (!VirtualProtect(region, page, PAGE_NOACCESS, &previous) ||
+       !VirtualProtect(region + page + length, page, PAGE_NOACCESS,
+                       &previous))) {
+    VirtualFree(region, 0, MEM_RELEASE);
+    region = NULL;
+  }
+
+  if (!region) {
+    last_error = ERR_OUT_OF_MEMORY;
+    return NULL;
+  }
+
+  // best effort, the working set may be too small to lock it
+  VirtualLock(region + page, length);
+#else
+  region = mmap(NULL, length + 2 * page, PROT_NONE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (region == MAP_FAILED) {
+    last_error = ERR_OUT_OF_MEMORY;
+    return NULL;
+  }
+
+  if (mprotect(region + page, length, PROT_READ | PROT_WRITE) != 0) {
+    munmap(region, length + 2 * page);
+    last_error = ERR_OUT_OF_MEMORY;
+    return NULL;
+  }
+
+  // best effort, RLIMIT_MEMLOCK may not allow to lock it
+  mlock(region + page, length);
+#ifdef MADV_DONTDUMP
+  madvise(region + page, length, MADV_DONTDUMP);
+#endif
+#endif
+
+  ArenaBlock *block = (ArenaBlock *)(region + page);
+  block->size = length - sizeof(ArenaBlock);
+  block->used = 0;
+  block->mapped = length;
+  return block;
+}
+
+static void unmap_block(ArenaBlock *block) {
+  size_t page = page_size();
+  size_t length = block->mapped;
+  unsigned char *region = (unsigned char *)block - page;
+
+#ifdef _WIN32
+  VirtualUnlock(region + page, length);
+  VirtualFree(region, 0, MEM_RELEASE);
+#else
+  munmap(region, length + 2 * page);
+#endif
+}
+
+/**
+ * Mapping and locking pages costs several system calls and a fault for every
+ * page, so wiped blocks are kept around for the next arena, much like
+ * OpenSSL's secure heap. Arenas are filled from several threads when shards
+ * are read.
+ */
+static ArenaBlock *spare_blocks;
+static int spare_count;
+static atomic_flag spare_busy = ATOMIC_FLAG_INIT;
+
+static void lock_spare_blocks() {
+  while (atomic_flag_test_and_set_explicit(&spare_busy, memory_order_acquire))
+    ;
+}
+
+static void unlock_spare_blocks() {
+  atomic_flag_clear_explicit(&spare_busy, memory_order_release);
+}
+
+// smallest spare block with room for size bytes
+static ArenaBlock *take_spare_block(size_t size) {
+  lock_spare_blocks();
+
+  ArenaBlock **best = NULL;
+  for (ArenaBlock **link = &spare_blocks; *link; link = &(*link)->next) {
+    if ((*link)->size >= size && (!best || (*link)->size < (*best)->size)) {
+      best = link;
+    }
+  }
+
+  ArenaBlock *block = best ? *best : NULL;
+  if (block) {
+    *best = block->next;
+    spare_count--;
+  }
+
+  unlock_spare_blocks();
+  return block;
+}
+
+static void release_block(ArenaBlock *block) {
+  OPENSSL_cleanse(block->data, block->used);
+  block->used = 0;
+
+  lock_spare_blocks();
+
+  bool kept = spare_count < ARENA_SPARE_BLOCKS;
+  if (kept) {
+    block->next = spare_blocks;
+    spare_blocks = block;
+    spare_count++;
+  }
+
+  unlock_spare_blocks();
+
+  if (!kept) {
+    unmap_block(block);
+  }
+}
+
+void arena_init(Arena *arena) { arena->blocks = NULL; }
+
+void *arena_alloc(Arena *arena, size_t size) {
+  size = (size + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+
+  ArenaBlock *block = arena->blocks;
+  if (!block || block->size - block->used < size) {
+    // oversized allocations get a block of their own
+    size_t block_size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+    block = take_spare_block(block_size);
+    block = block ? block : map_block(block_size);
+    if (!block) {
+      return NULL;
+    }
+
+    // keep filling the current block if the new one is a one-off
+    if (arena->blocks && size > ARENA_BLOCK_SIZE) {
+      block->next = arena->blocks->next;
+      arena->blocks->next = block;
+    } else {
+      block->next = arena->blocks;
+      arena->blocks = block;
+    }
+  }
+
+  void *result = block->data + block->used;
+  block->used += size;
+  return result;
+}
+
+char *arena_strndup(Arena *arena, const char *string, size_t length) {
+  char *result = arena_alloc(arena, length + 1);
+  if (result) {
+    memcpy(result, string, length);
+    result[length] = '\0';
+  }
+
+  return result;
+}
+
+bool arena_contains(Arena *arena, const void *pointer) {
+  uintptr_t address = (uintptr_t)pointer;
+  for (ArenaBlock *block = arena->blocks; block; block = block->next) {
+    uintptr_t start = (uintptr_t)block->data;
+    if (address >= start && address < start + block->used) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+void arena_free(Arena *arena) {
+  ArenaBlock *block = arena->blocks;
+  while (block) {
+    ArenaBlock *next = block->next;
+    release_block(block);
+    block = next;
+  }
+
+  arena->blocks = NULL;
+}
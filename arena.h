@@ -0,0 +1,21 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct ArenaBlock ArenaBlock;
+
+// bump allocator for secrets; blocks are locked, kept out of core dumps and
+// fenced by guard pages, and everything allocated from an arena is wiped and
+// released at once
+typedef struct Arena {
+  ArenaBlock *blocks;
+} Arena;
+
+void arena_init(Arena *arena);
+void *arena_alloc(Arena *arena, size_t size);
+char *arena_strndup(Arena *arena, const char *string, size_t length);
+// tells whether memory was allocated from the arena, so that strings which
+// already live there are not copied again
+bool arena_contains(Arena *arena, const void *pointer);
+void arena_free(Arena *arena);
@@ -0,0 +1,375 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/prctl.h>
+#endif
+
+#ifdef PASS_X11
+#include <X11/Xatom.h>
+#include <X11/Xlib.h>
+#endif
+
+#include "clipboard.h"
+#include "error.h"
+#include "trace.h"
+
+// seconds until a copied password is taken off the clipboard again, unless
+// PASS_CLIPBOARD_TIMEOUT says otherwise; 0 leaves it there
+#define CLIPBOARD_DEFAULT_TIMEOUT 45
+#define CLIPBOARD_MAX_TIMEOUT 86400
+
+// a helper still running this long after it got the password is taken to
+// own the clipboard
+#define CLIPBOARD_HELPER_GRACE_MS 100
+
+/**
+ * The clipboard is served by an owner process, which hands the password to
+ * applications pasting it until the timeout runs out or something else is
+ * copied. Under X11 it owns the CLIPBOARD selection itself; otherwise it runs
+ * wl-copy or xclip in the foreground and stops it on timeout, which takes the
+ * selection away with it. On macOS pbcopy is used as before.
+ */
+typedef bool (*ClipboardOwner)(const void *backend, char *string, int ready,
+                               int timeout);
+
+// helpers serving the clipboard in the foreground until replaced or stopped
+static char *const WL_COPY[] = {"wl-copy", "--foreground", "--type",
+                                "text/plain", NULL};
+static char *const XCLIP[] = {"xclip", "-quiet", "-selection", "clipboard",
+                              NULL};
+
+static int clipboard_timeout() {
+  char *value = getenv("PASS_CLIPBOARD_TIMEOUT");
+  if (!value) {
+    return CLIPBOARD_DEFAULT_TIMEOUT;
+  }
+
+  char *end;
+  long timeout = strtol(value, &end, 10);
+  if (*value == '\0' || *end != '\0' || timeout < 0 ||
+      timeout > CLIPBOARD_MAX_TIMEOUT) {
+    return CLIPBOARD_DEFAULT_TIMEOUT;
+  }
+
+  return timeout;
+}
+
+static uint64_t monotonic_ms() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static void report_ready(int ready, bool owned) {
+  char status = owned;
+  while (write(ready, &status, 1) < 0 && errno == EINTR)
+    ;
+  close(ready);
+}
+
+static void quiet_output() {
+  int null = open("/dev/null", O_RDWR);
+  if (null >= 0) {
+    dup2(null, STDIN_FILENO);
+    dup2(null, STDOUT_FILENO);
+    dup2(null, STDERR_FILENO);
+    close(null);
+  }
+}
+
+#ifdef PASS_X11
+static int ignore_x11_error(Display *display, XErrorEvent *event) {
+  // requestors may be gone by the time they are answered
+  (void)display;
+  (void)event;
+  return 0;
+}
+
+static void answer_x11_request(Display *display, XSelectionRequestEvent *request,
+                               char *string) {
+  Atom targets = XInternAtom(display, "TARGETS", False);
+  Atom utf8 = XInternAtom(display, "UTF8_STRING", False);
+  Atom text = XInternAtom(display, "TEXT", False);
+
+  XSelectionEvent reply;
+  memset(&reply, 0, sizeof(reply));
+  reply.type = SelectionNotify;
+  reply.requestor = request->requestor;
+  reply.selection = request->selection;
+  reply.target = request->target;
+  reply.property = None;
+  reply.time = request->time;
+
+  // obsolete clients leave the property to the owner
+  Atom property =
+      request->property != None ? request->property : request->target;
+
+  if (request->target == targets) {
+    Atom supported[] = {targets, utf8, XA_STRING, text};
+    XChangeProperty(display, request->requestor, property, XA_ATOM, 32,
+                    PropModeReplace, (unsigned char *)supported, 4);
+    reply.property = property;
+  } else if (request->target == utf8 || request->target == XA_STRING ||
+             request->target == text) {
+    XChangeProperty(display, request->requestor, property,
+                    request->target == text ? utf8 : request->target, 8,
+                    PropModeReplace, (unsigned char *)string, strlen(string));
+    reply.property = property;
+  }
+
+  XSendEvent(display, request->requestor, False, NoEventMask,
+             (XEvent *)&reply);
+  XFlush(display);
+}
+
+/**
+ * Owns the CLIPBOARD selection of the X display, answering requests for the
+ * password as text until another client takes the selection over or the
+ * timeout runs out.
+ */
+static bool own_x11_selection(const void *backend, char *string, int ready,
+                              int timeout) {
+  (void)backend;
+  Display *display = XOpenDisplay(NULL);
+  if (!display) {
+    return false;
+  }
+
+  XSetErrorHandler(ignore_x11_error);
+  Atom clipboard = XInternAtom(display, "CLIPBOARD", False);
+  Window window = XCreateSimpleWindow(display, DefaultRootWindow(display), 0,
+                                      0, 1, 1, 0, 0, 0);
+
+  // selections are owned as of a server timestamp, which a property change
+  // on the window provides
+  XEvent event;
+  XSelectInput(display, window, PropertyChangeMask);
+  XChangeProperty(display, window, XA_WM_NAME, XA_STRING, 8, PropModeAppend,
+                  NULL, 0);
+  XWindowEvent(display, window, PropertyChangeMask, &event);
+  Time owned_at = event.xproperty.time;
+
+  XSetSelectionOwner(display, clipboard, window, owned_at);
+  bool owned = XGetSelectionOwner(display, clipboard) == window;
+  report_ready(ready, owned);
+
+  uint64_t deadline = monotonic_ms() + (uint64_t)timeout * 1000;
+  bool replaced = false;
+  while (owned && !replaced) {
+    while (XPending(display) > 0) {
+      XNextEvent(display, &event);
+      if (event.type == SelectionRequest) {
+        answer_x11_request(display, &event.xselectionrequest, string);
+      } else if (event.type == SelectionClear) {
+        replaced = true;
+      }
+    }
+
+    int wait_ms = -1;
+    if (timeout > 0) {
+      uint64_t now = monotonic_ms();
+      if (now >= deadline) {
+        break;
+      }
+
+      wait_ms = deadline - now;
+    }
+
+    struct pollfd connection = {ConnectionNumber(display), POLLIN, 0};
+    if (!replaced && poll(&connection, 1, wait_ms) < 0 && errno != EINTR) {
+      break;
+    }
+  }
+
+  if (owned && !replaced) {
+    XSetSelectionOwner(display, clipboard, None, owned_at);
+  }
+
+  XDestroyWindow(display, window);
+  XCloseDisplay(display);
+  return owned;
+}
+#endif
+
+static void on_timeout(int signal) { (void)signal; }
+
+/**
+ * Runs a helper which serves the clipboard in the foreground, stopping it
+ * once the timeout runs out.
+ */
+static bool run_helper(const void *backend, char *string, int ready,
+                       int timeout) {
+  char *const *argv = backend;
+  int input[2];
+  if (pipe(input) != 0) {
+    return false;
+  }
+
+  pid_t helper = fork();
+  if (helper == 0) {
+    dup2(input[0], STDIN_FILENO);
+    close(input[0]);
+    close(input[1]);
+    close(ready);
+    execvp(argv[0], argv);
+    _exit(127);
+  }
+
+  close(input[0]);
+  bool written = helper > 0;
+  for (size_t offset = 0, length = strlen(string); written && offset < length;) {
+    ssize_t count = write(input[1], string + offset, length - offset);
+    written = count > 0 || (count < 0 && errno == EINTR);
+    offset += count > 0 ? count : 0;
+  }
+
+  close(input[1]);
+
+  // a helper which is missing or can not reach the display exits right away
+  int status;
+  pid_t exited = 0;
+  uint64_t grace_end = monotonic_ms() + CLIPBOARD_HELPER_GRACE_MS;
+  while (helper > 0 && exited == 0 && monotonic_ms() < grace_end) {
+    exited = waitpid(helper, &status, WNOHANG);
+    if (exited == 0) {
+      usleep(5000);
+    }
+  }
+
+  bool owned = helper > 0 && written && exited == 0;
+  report_ready(ready, owned);
+
+  if (helper > 0 && exited == 0 && !owned) {
+    kill(helper, SIGTERM);
+  }
+
+  if (owned && timeout > 0) {
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = on_timeout;
+    sigaction(SIGALRM, &action, NULL);
+    alarm(timeout);
+  }
+
+  // interrupted by the alarm unless the helper lost the clipboard before
+  if (helper > 0 && exited == 0 && waitpid(helper, &status, 0) < 0) {
+    kill(helper, SIGTERM);
+    waitpid(helper, &status, 0);
+  }
+
+  return owned;
+}
+
+/**
+ * Forks the owner process and waits until it tells whether it got hold of
+ * the clipboard. The owner may outlive the caller by the whole timeout, and
+ * memory locks are not inherited, so it copies the password and has the
+ * caller's memory released before serving it.
+ */
+static bool start_owner(ClipboardOwner owner, const void *backend,
+                        char *string, int timeout, ClipboardRelease release,
+                        void *context) {
+  int ready[2];
+  if (pipe(ready) != 0) {
+    return false;
+  }
+
+  pid_t pid = fork();
+  if (pid < 0) {
+    close(ready[0]);
+    close(ready[1]);
+    return false;
+  }
+
+  // child from here on
+  if (pid == 0) {
+    close(ready[0]);
+    setsid();
+    quiet_output();
+#ifdef __linux__
+    prctl(PR_SET_DUMPABLE, 0);
+#endif
+
+    // only the copy is left once the caller's memory is released
+    size_t length = strlen(string);
+    char *copy = malloc(length + 1);
+    if (!copy) {
+      _exit(EXIT_FAILURE);
+    }
+    mlock(copy, length + 1);
+    memcpy(copy, string, length + 1);
+    memset(string, 0, length);
+
+    if (release) {
+      release(context);
+    }
+
+    bool owned = owner(backend, copy, ready[1], timeout);
+    memset(copy, 0, length);
+    _exit(owned ? EXIT_SUCCESS : EXIT_FAILURE);
+  }
+
+  close(ready[1]);
+  char status = 0;
+  ssize_t count;
+  while ((count = read(ready[0], &status, 1)) < 0 && errno == EINTR)
+    ;
+  close(ready[0]);
+
+  if (count != 1 || !status) {
+    waitpid(pid, NULL, 0);
+    return false;
+  }
+
+  return true;
+}
+
+/**
+ * The pasteboard on macOS belongs to no process, so pbcopy just sets it.
+ */
+static bool run_pbcopy(char *string) {
+  FILE *cpy = popen("pbcopy 2>/dev/null", "w");
+  if (!cpy) {
+    return false;
+  }
+
+  fprintf(cpy, "%s", string);
+  return pclose(cpy) == 0;
+}
+
+bool clipboard_copy(char *string, ClipboardRelease release, void *context) {
+  uint64_t trace = trace_begin();
+  int timeout = clipboard_timeout();
+  bool x11 = getenv("DISPLAY") != NULL;
+  bool wayland = getenv("WAYLAND_DISPLAY") != NULL;
+
+  // X11 clients under Wayland only see the native selection if the
+  // compositor passes it on, so Wayland goes first
+  bool ok = wayland && start_owner(run_helper, WL_COPY, string, timeout,
+                                   release, context);
+#ifdef PASS_X11
+  ok = ok || (x11 && start_owner(own_x11_selection, NULL, string, timeout,
+                                 release, context));
+#endif
+  ok = ok || (x11 && start_owner(run_helper, XCLIP, string, timeout, release,
+                                 context));
+  ok = ok || (!x11 && !wayland && run_pbcopy(string));
+  trace_end("clipboard", trace);
+
+  if (!ok) {
+    last_error = ERR_CLIPBOARD_COPY;
+  }
+
+  return ok;
+}
@@ -0,0 +1,22 @@
+#include <stdio.h>
+
+#include "clipboard.h"
+#include "error.h"
+#include "trace.h"
+
+bool clipboard_copy(char *string, ClipboardRelease release, void *context) {
+  (void)release;
+  (void)context;
+  uint64_t trace = trace_begin();
+  FILE *cpy = popen("clip", "w");
+
+  if (!cpy) {
+    last_error = ERR_CLIPBOARD_COPY;
+    return false;
+  }
+
+  fprintf(cpy, "%s", string);
+  pclose(cpy);
+  trace_end("clipboard", trace);
+  return true;
+}
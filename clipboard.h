@@ -0,0 +1,11 @@
+#pragma once
+
+#include <stdbool.h>
+
+/**
+ * Called in the process left serving the clipboard once it holds its own copy
+ * of the password, to wipe what else it inherited from the caller.
+ */
+typedef void (*ClipboardRelease)(void *context);
+
+bool clipboard_copy(char *string, ClipboardRelease release, void *context);
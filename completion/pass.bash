@@ -0,0 +1,34 @@
+# bash completion for pass; source this file, e.g. from ~/.bashrc
+#
+# Identifiers come from `pass complete`, which reads what the unlocked
+# session has published and never asks for the master password.
+
+_pass() {
+  local cur=${COMP_WORDS[COMP_CWORD]}
+  local commands="add del put list find agent batch import export stats tune
+    rekey reshard compress complete"
+
+  if [[ $cur == --* ]]; then
+    return
+  fi
+
+  if ((COMP_CWORD == 1)); then
+    COMPREPLY=($(compgen -W "$commands" -- "$cur")
+      $(pass complete "$cur" 2>/dev/null))
+    return
+  fi
+
+  case ${COMP_WORDS[1]} in
+  add | del | put)
+    COMPREPLY=($(pass complete "$cur" 2>/dev/null))
+    ;;
+  batch | import | export)
+    COMPREPLY=($(compgen -f -- "$cur"))
+    ;;
+  compress)
+    COMPREPLY=($(compgen -W "deflate none" -- "$cur"))
+    ;;
+  esac
+}
+
+complete -F _pass pass
@@ -0,0 +1,226 @@
+#include <openssl/crypto.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "compress.h"
+#include "error.h"
+
+/**
+ * Records of a database without compression are the plain data. With
+ * deflate, they start with a method byte: STORED_DATA followed by the data as
+ * it is, for data which does not get any smaller, or DEFLATED_DATA followed
+ * by the length of the data as a little-endian uint32 and a raw deflate
+ * stream.
+ */
+#define STORED_DATA 0
+#define DEFLATED_DATA 1
+#define DEFLATED_HEADER_LENGTH (1 + 4)
+
+// windowBits of a raw deflate stream, without zlib header and checksum, as
+// the records are authenticated anyway
+#define DEFLATE_WINDOW_BITS (-15)
+#define DEFLATE_MIN_WINDOW_BITS 9
+#define DEFLATE_MEMORY_LEVEL 8
+
+/**
+ * zlib keeps copies of the data in its window, which are wiped before the
+ * memory is given back.
+ */
+static voidpf wiped_alloc(voidpf opaque, uInt items, uInt size) {
+  (void)opaque;
+  size_t length = (size_t)items * size;
+  size_t *block = malloc(sizeof(size_t) + length);
+  if (!block) {
+    return Z_NULL;
+  }
+
+  block[0] = length;
+  return block + 1;
+}
+
+static void wiped_free(voidpf opaque, voidpf address) {
+  (void)opaque;
+  size_t *block = (size_t *)address - 1;
+  OPENSSL_cleanse(address, block[0]);
+  free(block);
+}
+
+static uint32_t read_u32(const unsigned char *ptr) {
+  return (uint32_t)ptr[0] | (uint32_t)ptr[1] << 8 | (uint32_t)ptr[2] << 16 |
+         (uint32_t)ptr[3] << 24;
+}
+
+static void write_u32(unsigned char *ptr, uint32_t value) {
+  ptr[0] = value;
+  ptr[1] = value >> 8;
+  ptr[2] = value >> 16;
+  ptr[3] = value >> 24;
+}
+
+const char *compress_name(unsigned char compression) {
+  return compression == COMPRESS_DEFLATE ? "deflate" : "none";
+}
+
+bool compress_by_name(const char *name, unsigned char *compression) {
+  if (strcmp(name, "none") == 0) {
+    *compression = COMPRESS_NONE;
+  } else if (strcmp(name, "deflate") == 0) {
+    *compression = COMPRESS_DEFLATE;
+  } else {
+    return false;
+  }
+
+  return true;
+}
+
+/**
+ * Upper bound for the length of the encoded data.
+ */
+size_t compress_bound(unsigned char compression, size_t plain_len) {
+  if (compression == COMPRESS_NONE) {
+    return plain_len;
+  }
+
+  size_t deflated = DEFLATED_HEADER_LENGTH + compressBound(plain_len);
+  return deflated > 1 + plain_len ? deflated : 1 + plain_len;
+}
+
+/**
+ * Deflates plain into out, returning false if it does not fit, in which case
+ * the data is better stored as it is. The window and the hash table are only
+ * as large as the data needs, as setting up and wiping the full ones takes
+ * longer than compressing a record of a few KiB; inflating with the largest
+ * window reads them all the same.
+ */
+static bool deflate_data(const unsigned char *plain, size_t plain_len,
+                         unsigned char *out, size_t out_len,
+                         size_t *deflated_len) {
+  int window_bits = DEFLATE_MIN_WINDOW_BITS;
+  while (window_bits < -DEFLATE_WINDOW_BITS &&
+         ((size_t)1 << window_bits) < plain_len) {
+    window_bits++;
+  }
+  int memory_level = DEFLATE_MEMORY_LEVEL + window_bits + DEFLATE_WINDOW_BITS;
+
+  z_stream stream = {.zalloc = wiped_alloc, .zfree = wiped_free};
+  if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -window_bits,
+                   memory_level < 1 ? 1 : memory_level,
+                   Z_DEFAULT_STRATEGY) != Z_OK) {
+    return false;
+  }
+
+  stream.next_in = (unsigned char *)plain;
+  stream.avail_in = plain_len;
+  stream.next_out = out;
+  stream.avail_out = out_len;
+
+  bool ok = deflate(&stream, Z_FINISH) == Z_STREAM_END;
+  *deflated_len = stream.total_out;
+  deflateEnd(&stream);
+  return ok;
+}
+
+/**
+ * Encodes plain for a database with the given compression into encoded,
+ * which must have room for compress_bound bytes. Deflate is deterministic,
+ * so the same data always encodes to the same length.
+ */
+bool compress_encode(unsigned char compression, const unsigned char *plain,
+                     size_t plain_len, unsigned char *encoded,
+                     size_t *encoded_len) {
+  if (compression == COMPRESS_NONE) {
+    memcpy(encoded, plain, plain_len);
+    *encoded_len = plain_len;
+    return true;
+  }
+
+  if (plain_len > UINT32_MAX) {
+    last_error = ERR_OUT_OF_MEMORY;
+    return false;
+  }
+
+  // only worth it if the deflated data is shorter than the data itself
+  size_t deflated_len;
+  if (plain_len > DEFLATED_HEADER_LENGTH &&
+      deflate_data(plain, plain_len, encoded + DEFLATED_HEADER_LENGTH,
+                   plain_len - DEFLATED_HEADER_LENGTH, &deflated_len)) {
+    encoded[0] = DEFLATED_DATA;
+    write_u32(encoded + 1, plain_len);
+    *encoded_len = DEFLATED_HEADER_LENGTH + deflated_len;
+    return true;
+  }
+
+  encoded[0] = STORED_DATA;
+  memcpy(encoded + 1, plain, plain_len);
+  *encoded_len = 1 + plain_len;
+  return true;
+}
+
+/**
+ * Length of the data the encoded data decodes to.
+ */
+bool compress_decoded_length(unsigned char compression,
+                             const unsigned char *encoded, size_t encoded_len,
+                             size_t *plain_len) {
+  if (compression == COMPRESS_NONE) {
+    *plain_len = encoded_len;
+    return true;
+  }
+
+  if (encoded_len >= 1 && encoded[0] == STORED_DATA) {
+    *plain_len = encoded_len - 1;
+    return true;
+  }
+
+  if (encoded_len >= DEFLATED_HEADER_LENGTH && encoded[0] == DEFLATED_DATA) {
+    *plain_len = read_u32(encoded + 1);
+    return true;
+  }
+
+  last_error = ERR_DB_CORRUPT;
+  return false;
+}
+
+/**
+ * Decodes the encoded data into plain, which must be exactly as long as
+ * compress_decoded_length says. Deflated data is inflated straight into
+ * place, without buffering any of it.
+ */
+bool compress_decode(unsigned char compression, const unsigned char *encoded,
+                     size_t encoded_len, unsigned char *plain,
+                     size_t plain_len) {
+  size_t expected;
+  if (!compress_decoded_length(compression, encoded, encoded_len, &expected) ||
+      expected != plain_len) {
+    last_error = ERR_DB_CORRUPT;
+    return false;
+  }
+
+  if (compression == COMPRESS_NONE || encoded[0] == STORED_DATA) {
+    memcpy(plain, encoded + encoded_len - plain_len, plain_len);
+    return true;
+  }
+
+  z_stream stream = {.zalloc = wiped_alloc, .zfree = wiped_free};
+  if (inflateInit2(&stream, DEFLATE_WINDOW_BITS) != Z_OK) {
+    last_error = ERR_OUT_OF_MEMORY;
+    return false;
+  }
+
+  stream.next_in = (unsigned char *)encoded + DEFLATED_HEADER_LENGTH;
+  stream.avail_in = encoded_len - DEFLATED_HEADER_LENGTH;
+  stream.next_out = plain;
+  stream.avail_out = plain_len;
+
+  bool ok = inflate(&stream, Z_FINISH) == Z_STREAM_END &&
+            stream.total_out == plain_len && stream.avail_in == 0;
+  inflateEnd(&stream);
+
+  if (!ok) {
+    last_error = ERR_DB_CORRUPT;
+  }
+
+  return ok;
+}
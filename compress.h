@@ -0,0 +1,22 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// compression of the records of a database before they are sealed, as
+// recorded in its header
+#define COMPRESS_NONE 0
+#define COMPRESS_DEFLATE 1
+
+const char *compress_name(unsigned char compression);
+bool compress_by_name(const char *name, unsigned char *compression);
+size_t compress_bound(unsigned char compression, size_t plain_len);
+bool compress_encode(unsigned char compression, const unsigned char *plain,
+                     size_t plain_len, unsigned char *encoded,
+                     size_t *encoded_len);
+bool compress_decoded_length(unsigned char compression,
+                             const unsigned char *encoded, size_t encoded_len,
+                             size_t *plain_len);
+bool compress_decode(unsigned char compression, const unsigned char *encoded,
+                     size_t encoded_len, unsigned char *plain,
+                     size_t plain_len);
@@ -0,0 +1,503 @@
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Argon2id is only available from OpenSSL 3.2 on
+#if OPENSSL_VERSION_NUMBER >= 0x30200000L
+#include <openssl/core_names.h>
+#include <openssl/kdf.h>
+#include <openssl/thread.h>
+#define CRYPTO_HAVE_ARGON2
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+#endif
+
+#include "crypto.h"
+#include "error.h"
+#include "trace.h"
+
+// shortest derivation `pass tune` extrapolates PBKDF2 iterations from
+#define CRYPTO_TUNE_MIN_NS 50000000ULL
+#define CRYPTO_ARGON2_TUNE_MEMORY_MIB 64
+
+/**
+ * New databases keep using the parameters of the legacy format, until they
+ * are tuned for the machine with `pass tune`.
+ */
+void crypto_default_kdf(KdfParams *params) {
+  memset(params, 0, sizeof(KdfParams));
+  params->kdf = CRYPTO_KDF_PBKDF2_SHA256;
+  params->iterations = CRYPTO_KDF_ITERATIONS;
+}
+
+bool crypto_kdf_supported(unsigned char kdf) {
+  if (kdf == CRYPTO_KDF_PBKDF2_SHA256) {
+    return true;
+  }
+
+#ifdef CRYPTO_HAVE_ARGON2
+  if (kdf == CRYPTO_KDF_ARGON2ID) {
+    EVP_KDF *argon2 = EVP_KDF_fetch(NULL, "ARGON2ID", NULL);
+    EVP_KDF_free(argon2);
+    return argon2 != NULL;
+  }
+#endif
+
+  return false;
+}
+
+const char *crypto_kdf_name(unsigned char kdf) {
+  return kdf == CRYPTO_KDF_ARGON2ID ? "argon2id" : "pbkdf2-sha256";
+}
+
+#ifdef CRYPTO_HAVE_ARGON2
+/**
+ * Argon2id fills its memory in independent lanes, which OpenSSL computes in
+ * as many threads as there are lanes if it may start threads at all.
+ */
+static bool derive_argon2id(const char *master_pwd, unsigned char *salt,
+                            size_t salt_length, const KdfParams *params,
+                            unsigned char *derived, size_t derived_length) {
+  EVP_KDF *argon2 = EVP_KDF_fetch(NULL, "ARGON2ID", NULL);
+  EVP_KDF_CTX *ctx = argon2 ? EVP_KDF_CTX_new(argon2) : NULL;
+  EVP_KDF_free(argon2);
+
+  if (!ctx) {
+    last_error = ERR_KDF_UNSUPPORTED;
+    return false;
+  }
+
+  uint32_t passes = params->iterations;
+  uint32_t memory_kib = (uint32_t)params->memory_mib * 1024;
+  uint32_t lanes = params->lanes;
+  uint32_t threads = OSSL_set_max_threads(NULL, lanes) == 1 ? lanes : 1;
+
+  OSSL_PARAM settings[] = {
+      OSSL_PARAM_construct_octet_string(OSSL_KDF_PARAM_PASSWORD,
+                                        (void *)master_pwd, strlen(master_pwd)),
+      OSSL_PARAM_construct_octet_string(OSSL_KDF_PARAM_SALT, salt,
+                                        salt_length),
+      OSSL_PARAM_construct_uint32(OSSL_KDF_PARAM_ITER, &passes),
+      OSSL_PARAM_construct_uint32(OSSL_KDF_PARAM_ARGON2_MEMCOST, &memory_kib),
+      OSSL_PARAM_construct_uint32(OSSL_KDF_PARAM_ARGON2_LANES, &lanes),
+      OSSL_PARAM_construct_uint32(OSSL_KDF_PARAM_THREADS, &threads),
+      OSSL_PARAM_construct_end(),
+  };
+
+  bool ok = EVP_KDF_derive(ctx, derived, derived_length, settings) == 1;
+  EVP_KDF_CTX_free(ctx);
+
+  if (!ok) {
+    last_error = ERR_CRYPTO;
+  }
+
+  return ok;
+}
+
+static int cpu_count() {
+#ifdef _WIN32
+  SYSTEM_INFO info;
+  GetSystemInfo(&info);
+  return info.dwNumberOfProcessors;
+#else
+  long count = sysconf(_SC_NPROCESSORS_ONLN);
+  return count > 0 ? count : 1;
+#endif
+}
+#endif
+
+static bool derive(const char *master_pwd, unsigned char *salt,
+                   size_t salt_length, const KdfParams *params,
+                   unsigned char *derived, size_t derived_length) {
+  if (params->kdf == CRYPTO_KDF_PBKDF2_SHA256) {
+    if (PKCS5_PBKDF2_HMAC(master_pwd, strlen(master_pwd), salt, salt_length,
+                          params->iterations, EVP_sha256(), derived_length,
+                          derived) != 1) {
+      last_error = ERR_CRYPTO;
+      return false;
+    }
+
+    return true;
+  }
+
+#ifdef CRYPTO_HAVE_ARGON2
+  if (params->kdf == CRYPTO_KDF_ARGON2ID) {
+    return derive_argon2id(master_pwd, salt, salt_length, params, derived,
+                           derived_length);
+  }
+#endif
+
+  last_error = ERR_KDF_UNSUPPORTED;
+  return false;
+}
+
+/**
+ * The legacy key schedule is the one of `openssl enc -pbkdf2`: a single
+ * PBKDF2-SHA256 run yields both the AES key and the CBC initialization vector.
+ * Its first 32 bytes are exactly the key derived for the current format with
+ * the default parameters, so a legacy database can be migrated without
+ * deriving another key.
+ */
+bool crypto_derive_key(char *master_pwd, unsigned char *salt,
+                       size_t salt_length, const KdfParams *params,
+                       bool legacy, VaultKey *key) {
+  unsigned char key_iv[CRYPTO_KEY_LENGTH + CRYPTO_IV_LENGTH];
+  size_t derived_length = CRYPTO_KEY_LENGTH + (legacy ? CRYPTO_IV_LENGTH : 0);
+
+  KdfParams kdf;
+  if (legacy) {
+    crypto_default_kdf(&kdf);
+  } else {
+    kdf = *params;
+  }
+
+  crypto_wipe_key(key);
+  if (salt_length > CRYPTO_SALT_LENGTH) {
+    last_error = ERR_CRYPTO;
+    return false;
+  }
+
+  uint64_t trace = trace_begin();
+  bool ok = derive(master_pwd, salt, salt_length, &kdf, key_iv, derived_length);
+  trace_end("kdf", trace);
+
+  key->kdf = kdf;
+  memcpy(key->salt, salt, salt_length);
+  key->salt_length = salt_length;
+  memcpy(key->key, key_iv, CRYPTO_KEY_LENGTH);
+  if (legacy) {
+    memcpy(key->iv, key_iv + CRYPTO_KEY_LENGTH, CRYPTO_IV_LENGTH);
+  }
+
+  OPENSSL_cleanse(key_iv, sizeof(key_iv));
+
+  if (!ok) {
+    crypto_wipe_key(key);
+    return false;
+  }
+
+  return true;
+}
+
+/**
+ * Derives a key with a fresh salt, using the default parameters if none are
+ * given.
+ */
+bool crypto_new_key(char *master_pwd, const KdfParams *params, VaultKey *key) {
+  KdfParams defaults;
+  crypto_default_kdf(&defaults);
+
+  unsigned char salt[CRYPTO_SALT_LENGTH];
+  if (RAND_bytes(salt, CRYPTO_SALT_LENGTH) != 1) {
+    last_error = ERR_CRYPTO;
+    return false;
+  }
+
+  return crypto_derive_key(master_pwd, salt, CRYPTO_SALT_LENGTH,
+                           params ? params : &defaults, false, key);
+}
+
+/**
+ * Times a single derivation of a throwaway key.
+ */
+static bool time_derivation(const KdfParams *params, uint64_t *derive_ns) {
+  unsigned char salt[CRYPTO_SALT_LENGTH] = {0};
+  unsigned char derived[CRYPTO_KEY_LENGTH];
+
+  uint64_t start = trace_clock();
+  bool ok = derive("pass tune", salt, sizeof(salt), params, derived,
+                   sizeof(derived));
+  *derive_ns = trace_clock() - start;
+
+  OPENSSL_cleanse(derived, sizeof(derived));
+  return ok;
+}
+
+/**
+ * PBKDF2 takes time in proportion to its iterations, which are extrapolated
+ * from a run long enough to be measured reliably.
+ */
+static bool tune_pbkdf2(uint64_t target_ns, KdfParams *params) {
+  crypto_default_kdf(params);
+  params->iterations = CRYPTO_KDF_ITERATIONS / 10;
+
+  uint64_t derive_ns;
+  while (true) {
+    if (!time_derivation(params, &derive_ns)) {
+      return false;
+    }
+
+    if (derive_ns >= CRYPTO_TUNE_MIN_NS || params->iterations > UINT32_MAX / 2) {
+      break;
+    }
+
+    params->iterations *= 2;
+  }
+
+  double iterations = (double)params->iterations * target_ns / (derive_ns + 1);
+  params->iterations = iterations < CRYPTO_KDF_ITERATIONS ? CRYPTO_KDF_ITERATIONS
+                       : iterations > UINT32_MAX         ? UINT32_MAX
+                                                         : (uint32_t)iterations;
+  return true;
+}
+
+#ifdef CRYPTO_HAVE_ARGON2
+/**
+ * Argon2id uses one lane per core, then as much memory as fits into the
+ * target time with a single pass, and the remaining time for more passes.
+ */
+static bool tune_argon2id(uint64_t target_ns, KdfParams *params) {
+  int lanes = cpu_count();
+  params->kdf = CRYPTO_KDF_ARGON2ID;
+  params->lanes = lanes < CRYPTO_ARGON2_MAX_LANES ? lanes
+                                                  : CRYPTO_ARGON2_MAX_LANES;
+  params->memory_mib = CRYPTO_ARGON2_TUNE_MEMORY_MIB;
+  params->iterations = 1;
+
+  uint64_t derive_ns;
+  if (!time_derivation(params, &derive_ns)) {
+    return false;
+  }
+
+  while (derive_ns * 2 <= target_ns &&
+         params->memory_mib * 2 <= CRYPTO_ARGON2_MAX_MEMORY_MIB) {
+    params->memory_mib *= 2;
+    if (!time_derivation(params, &derive_ns)) {
+      return false;
+    }
+  }
+
+  while (derive_ns > target_ns &&
+         params->memory_mib / 2 >= CRYPTO_ARGON2_MIN_MEMORY_MIB) {
+    params->memory_mib /= 2;
+    if (!time_derivation(params, &derive_ns)) {
+      return false;
+    }
+  }
+
+  uint64_t passes = target_ns / (derive_ns + 1);
+  params->iterations = passes > 1 ? passes : 1;
+  return true;
+}
+#endif
+
+/**
+ * Picks the parameters of the key derivation function which take about the
+ * target time on this machine, but never less than the defaults; derive_ns is
+ * the time a derivation with them took.
+ */
+bool crypto_tune_kdf(unsigned char kdf, uint32_t target_ms, KdfParams *params,
+                     uint64_t *derive_ns) {
+  uint64_t target_ns = target_ms * 1000000ULL;
+  bool ok = false;
+
+  if (kdf == CRYPTO_KDF_PBKDF2_SHA256) {
+    ok = tune_pbkdf2(target_ns, params);
+#ifdef CRYPTO_HAVE_ARGON2
+  } else if (kdf == CRYPTO_KDF_ARGON2ID && crypto_kdf_supported(kdf)) {
+    ok = tune_argon2id(target_ns, params);
+#endif
+  } else {
+    last_error = ERR_KDF_UNSUPPORTED;
+  }
+
+  return ok && time_derivation(params, derive_ns);
+}
+
+void crypto_wipe_key(VaultKey *key) { OPENSSL_cleanse(key, sizeof(VaultKey)); }
+
+bool crypto_legacy_decrypt(VaultKey *key, unsigned char *cipher,
+                           size_t cipher_len, unsigned char **plain,
+                           size_t *plain_len) {
+  // a key derived for a different salt can never decrypt this payload
+  if (cipher_len < CRYPTO_LEGACY_HEADER_LENGTH ||
+      memcmp(cipher, CRYPTO_LEGACY_MAGIC, CRYPTO_LEGACY_MAGIC_LENGTH) != 0 ||
+      key->salt_length != CRYPTO_LEGACY_SALT_LENGTH ||
+      memcmp(cipher + CRYPTO_LEGACY_MAGIC_LENGTH, key->salt,
+             CRYPTO_LEGACY_SALT_LENGTH)) {
+    last_error = ERR_DB_MASTER_PWD;
+    return false;
+  }
+
+  // plaintext is never longer than the ciphertext; keep one extra byte so
+  // that callers can treat the result as a string
+  size_t body_len = cipher_len - CRYPTO_LEGACY_HEADER_LENGTH;
+  unsigned char *out = malloc(body_len + 1);
+  if (!out) {
+    last_error = ERR_OUT_OF_MEMORY;
+    return false;
+  }
+
+  EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+  int len = 0, final_len = 0;
+
+  // a wrong master password shows up as a padding error in the final block
+  bool ok =
+      ctx &&
+      EVP_DecryptInit_ex(ctx, EVP_aes_256_cbc(), NULL, key->key, key->iv) &&
+      EVP_DecryptUpdate(ctx, out, &len, cipher + CRYPTO_LEGACY_HEADER_LENGTH,
+                        body_len) &&
+      EVP_DecryptFinal_ex(ctx, out + len, &final_len);
+
+  EVP_CIPHER_CTX_free(ctx);
+
+  if (!ok) {
+    OPENSSL_cleanse(out, body_len);
+    free(out);
+    last_error = ERR_DB_MASTER_PWD;
+    return false;
+  }
+
+  *plain = out;
+  *plain_len = len + final_len;
+  out[*plain_len] = '\0';
+  return true;
+}
+
+/**
+ * AES-256-GCM with a random nonce; sealed must have room for
+ * plain_len + CRYPTO_SEAL_OVERHEAD bytes.
+ */
+bool crypto_seal(VaultKey *key, const unsigned char *aad, size_t aad_len,
+                 const unsigned char *plain, size_t plain_len,
+                 unsigned char *sealed) {
+  unsigned char *nonce = sealed;
+  unsigned char *body = sealed + CRYPTO_NONCE_LENGTH;
+  unsigned char *tag = body + plain_len;
+
+  if (RAND_bytes(nonce, CRYPTO_NONCE_LENGTH) != 1) {
+    last_error = ERR_CRYPTO;
+    return false;
+  }
+
+  EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+  int len = 0;
+
+  bool ok =
+      ctx &&
+      EVP_EncryptInit_ex(ctx, EVP_aes_256_gcm(), NULL, key->key, nonce) &&
+      (aad_len == 0 || EVP_EncryptUpdate(ctx, NULL, &len, aad, aad_len)) &&
+      (plain_len == 0 ||
+       EVP_EncryptUpdate(ctx, body, &len, plain, plain_len)) &&
+      EVP_EncryptFinal_ex(ctx, body + plain_len, &len) &&
+      EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, CRYPTO_TAG_LENGTH, tag);
+
+  EVP_CIPHER_CTX_free(ctx);
+
+  if (!ok) {
+    last_error = ERR_CRYPTO;
+    return false;
+  }
+
+  return true;
+}
+
+/**
+ * Verifies and decrypts a record produced by crypto_seal; plain must have room
+ * for sealed_len - CRYPTO_SEAL_OVERHEAD bytes.
+ */
+bool crypto_open(VaultKey *key, const unsigned char *aad, size_t aad_len,
+                 const unsigned char *sealed, size_t sealed_len,
+                 unsigned char *plain) {
+  if (sealed_len < CRYPTO_SEAL_OVERHEAD) {
+    last_error = ERR_DB_CORRUPT;
+    return false;
+  }
+
+  size_t plain_len = sealed_len - CRYPTO_SEAL_OVERHEAD;
+  const unsigned char *nonce = sealed;
+  const unsigned char *body = sealed + CRYPTO_NONCE_LENGTH;
+  const unsigned char *tag = body + plain_len;
+
+  EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+  int len = 0;
+
+  bool ok =
+      ctx &&
+      EVP_DecryptInit_ex(ctx, EVP_aes_256_gcm(), NULL, key->key, nonce) &&
+      (aad_len == 0 || EVP_DecryptUpdate(ctx, NULL, &len, aad, aad_len)) &&
+      (plain_len == 0 ||
+       EVP_DecryptUpdate(ctx, plain, &len, body, plain_len)) &&
+      EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, CRYPTO_TAG_LENGTH,
+                          (void *)tag) &&
+      EVP_DecryptFinal_ex(ctx, plain + plain_len, &len) > 0;
+
+  EVP_CIPHER_CTX_free(ctx);
+
+  if (!ok) {
+    OPENSSL_cleanse(plain, plain_len);
+    last_error = ERR_DB_MASTER_PWD;
+    return false;
+  }
+
+  return true;
+}
+
+/**
+ * Starts decrypting a record produced by crypto_seal piece by piece, given
+ * its nonce; the pieces of the body follow with crypto_open_update.
+ */
+bool crypto_open_begin(VaultKey *key, const unsigned char *aad, size_t aad_len,
+                       const unsigned char *nonce, CryptoStream *stream) {
+  EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+  int len = 0;
+
+  bool ok =
+      ctx &&
+      EVP_DecryptInit_ex(ctx, EVP_aes_256_gcm(), NULL, key->key, nonce) &&
+      (aad_len == 0 || EVP_DecryptUpdate(ctx, NULL, &len, aad, aad_len));
+
+  if (!ok) {
+    EVP_CIPHER_CTX_free(ctx);
+    last_error = ERR_CRYPTO;
+    return false;
+  }
+
+  stream->ctx = ctx;
+  return true;
+}
+
+/**
+ * Decrypts the next piece of the body into plain, which must have room for
+ * body_len bytes. Nothing decrypted is authentic before crypto_open_final.
+ */
+bool crypto_open_update(CryptoStream *stream, const unsigned char *body,
+                        size_t body_len, unsigned char *plain) {
+  int len = 0;
+  if (body_len > 0 &&
+      !EVP_DecryptUpdate(stream->ctx, plain, &len, body, body_len)) {
+    last_error = ERR_CRYPTO;
+    return false;
+  }
+
+  return true;
+}
+
+/**
+ * Verifies the tag of the record, and releases the stream in any case; a
+ * NULL tag abandons the stream.
+ */
+bool crypto_open_final(CryptoStream *stream, const unsigned char *tag) {
+  EVP_CIPHER_CTX *ctx = stream->ctx;
+  unsigned char rest[16];
+  int len = 0;
+
+  bool ok = tag &&
+            EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, CRYPTO_TAG_LENGTH,
+                                (void *)tag) &&
+            EVP_DecryptFinal_ex(ctx, rest, &len) > 0;
+
+  EVP_CIPHER_CTX_free(ctx);
+  stream->ctx = NULL;
+
+  if (tag && !ok) {
+    last_error = ERR_DB_MASTER_PWD;
+  }
+
+  return ok;
+}
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// databases written by earlier versions are compatible with
+// `openssl enc -aes-256-cbc -pbkdf2 -iter 100000`
+#define CRYPTO_LEGACY_MAGIC "Salted__"
+#define CRYPTO_LEGACY_MAGIC_LENGTH 8
+#define CRYPTO_LEGACY_SALT_LENGTH 8
+#define CRYPTO_LEGACY_HEADER_LENGTH                                            \
+  (CRYPTO_LEGACY_MAGIC_LENGTH + CRYPTO_LEGACY_SALT_LENGTH)
+
+#define CRYPTO_KDF_PBKDF2_SHA256 1
+#define CRYPTO_KDF_ARGON2ID 2
+
+// parameters of new and legacy databases, and the least `pass tune` picks
+#define CRYPTO_KDF_ITERATIONS 100000
+#define CRYPTO_ARGON2_MIN_MEMORY_MIB 19
+#define CRYPTO_ARGON2_MAX_MEMORY_MIB 1024
+#define CRYPTO_ARGON2_MAX_LANES 8
+#define CRYPTO_SALT_LENGTH 16
+#define CRYPTO_KEY_LENGTH 32
+#define CRYPTO_IV_LENGTH 16
+
+// sealed records are nonce + ciphertext + authentication tag
+#define CRYPTO_NONCE_LENGTH 12
+#define CRYPTO_TAG_LENGTH 16
+#define CRYPTO_SEAL_OVERHEAD (CRYPTO_NONCE_LENGTH + CRYPTO_TAG_LENGTH)
+
+// key derivation function and its cost, as recorded in the database header;
+// passes are PBKDF2 iterations or Argon2 passes, memory and lanes are only
+// used by Argon2id
+typedef struct KdfParams {
+  unsigned char kdf;
+  unsigned char lanes;
+  uint16_t memory_mib;
+  uint32_t iterations;
+} KdfParams;
+
+// output of the key derivation, which is all that is needed to read and
+// write the database; the master password itself is never kept around
+typedef struct VaultKey {
+  KdfParams kdf;
+  unsigned char salt[CRYPTO_SALT_LENGTH];
+  unsigned char salt_length;
+  unsigned char key[CRYPTO_KEY_LENGTH];
+  // only used for reading databases in the legacy format
+  unsigned char iv[CRYPTO_IV_LENGTH];
+} VaultKey;
+
+// decryption of a sealed record in pieces, for records too large to be
+// decrypted at once
+typedef struct CryptoStream {
+  void *ctx;
+} CryptoStream;
+
+void crypto_default_kdf(KdfParams *params);
+bool crypto_kdf_supported(unsigned char kdf);
+const char *crypto_kdf_name(unsigned char kdf);
+bool crypto_derive_key(char *master_pwd, unsigned char *salt,
+                       size_t salt_length, const KdfParams *params,
+                       bool legacy, VaultKey *key);
+bool crypto_new_key(char *master_pwd, const KdfParams *params, VaultKey *key);
+bool crypto_tune_kdf(unsigned char kdf, uint32_t target_ms, KdfParams *params,
+                     uint64_t *derive_ns);
+void crypto_wipe_key(VaultKey *key);
+bool crypto_legacy_decrypt(VaultKey *key, unsigned char *cipher,
+                           size_t cipher_len, unsigned char **plain,
+                           size_t *plain_len);
+bool crypto_seal(VaultKey *key, const unsigned char *aad, size_t aad_len,
+                 const unsigned char *plain, size_t plain_len,
+                 unsigned char *sealed);
+bool crypto_open(VaultKey *key, const unsigned char *aad, size_t aad_len,
+                 const unsigned char *sealed, size_t sealed_len,
+                 unsigned char *plain);
+bool crypto_open_begin(VaultKey *key, const unsigned char *aad, size_t aad_len,
+                       const unsigned char *nonce, CryptoStream *stream);
+bool crypto_open_update(CryptoStream *stream, const unsigned char *body,
+                        size_t body_len, unsigned char *plain);
+bool crypto_open_final(CryptoStream *stream, const unsigned char *tag);
@@ -1,10 +1,30 @@
+#include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
+#include <openssl/crypto.h>
+#include <openssl/rand.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 
+#ifdef _WIN32
+#include <io.h>
+#include <windows.h>
+#else
+#include <sys/file.h>
+#include <unistd.h>
+#endif
+
+#include "compress.h"
+#include "crypto.h"
 #include "database.h"
 #include "error.h"
+#include "parallel.h"
+#include "payload.h"
+#include "trace.h"
 
 #ifdef _WIN32
 #define ENV_HOME "HOMEPATH"
@@ -12,20 +32,108 @@
 #define ENV_HOME "HOME"
 #endif
 
-bool openssl_valid() {
-  FILE *result = popen("openssl version", "r");
-  if (!result) {
-    last_error = ERR_OPENSSL_INVALID;
-    return false;
-  }
+/**
+ * Database layout, all integers are little-endian:
+ *
+ *   header    "PASSVLT\0" version:u16 kdf:u8 salt_length:u8 iterations:u32
+ *             salt[16] index_length:u32 kdf_memory_mib:u16 kdf_lanes:u8
+ *             compression:u8
+ *   index     sealed list of identifiers and the location of their record,
+ *             authenticated together with the header
+ *   records   one sealed password per entry, authenticated together with
+ *             its identifier
+ *
+ * Changes are not written to the database right away but appended to a
+ * journal next to it, which is folded back into the database once it grows
+ * past a few records:
+ *
+ *   header    "PASSJRN\0" snapshot_id[16]
+ *   records   sealed_length:u32 sealed list of changes, authenticated
+ *             together with the snapshot id and the record number
+ *
+ * The kdf is PBKDF2-SHA256 (1), where iterations is its iteration count and
+ * memory and lanes are zero, or Argon2id (2), where iterations is the number
+ * of passes.
+ *
+ * Compression is none (0) or deflate (1), which applies to the password
+ * records and the journal records, as encoded by compress_encode before they
+ * are sealed. The index is never compressed, as the locations of the records
+ * it holds would depend on its own compressed size. It came with version 3, so
+ * that earlier versions refuse compressed records instead of handing them out
+ * as passwords; in version 2 the byte is reserved and the database is not
+ * compressed.
+ *
+ * The snapshot id is the authentication tag of the database index, so a
+ * journal left over from an older version of the database is ignored.
+ *
+ * Readers hold a shared and writers an exclusive lock on a separate lock file,
+ * as the database file itself is replaced on every compaction.
+ *
+ * A sharded database splits its entries among several database files next to
+ * a manifest, which takes the place of the database file:
+ *
+ *   header    "PASSMAN\0" version:u16, followed by the fields of the database
+ *             header with payload_length in place of index_length, and
+ *             shard_count:u32 generation:u32
+ *   payload   sealed seed[16] of the hash which picks the shard of an
+ *             identifier, authenticated together with the header
+ *
+ * Shard i is the database file "<database>.shard<generation>-<i>", with its
+ * own journal and lock file. All of them share the salt and key derivation of
+ * the manifest, so the same key opens every shard.
+ */
+#define VAULT_MAGIC "PASSVLT"
+#define VAULT_MAGIC_LENGTH 8
+#define VAULT_VERSION 3
+// without compression, read but no longer written
+#define VAULT_VERSION_UNCOMPRESSED 2
+#define VAULT_HEADER_LENGTH 40
+
+#define JOURNAL_MAGIC "PASSJRN"
+#define JOURNAL_MAGIC_LENGTH 8
+#define JOURNAL_HEADER_LENGTH (JOURNAL_MAGIC_LENGTH + ENTRIES_SNAPSHOT_ID_LENGTH)
+#define JOURNAL_AAD_LENGTH (ENTRIES_SNAPSHOT_ID_LENGTH + 4)
+// compact the journal into the database once it holds this much
+#define JOURNAL_MAX_RECORDS 64
+#define JOURNAL_MAX_LENGTH (256 * 1024)
+
+#define MANIFEST_MAGIC "PASSMAN"
+#define MANIFEST_MAGIC_LENGTH 8
+#define MANIFEST_VERSION 1
+#define MANIFEST_HEADER_LENGTH (VAULT_HEADER_LENGTH + 8)
+#define MANIFEST_SEED_LENGTH 16
 
-  char version[20] = {'0'};
-  fgets(version, 20, result);
-  pclose(result);
+// records handed to a rekey worker at a time
+#define REKEY_BATCH 64
 
-  // OpenSSL x.y.z
-  //         ^
-  if ((version[8] - '0') < 3) {
+// large indexes are read, decrypted and parsed in blocks of this size, by
+// stages which run side by side
+#define PIPELINE_BLOCK_LENGTH (256 * 1024)
+#define PIPELINE_MIN_LENGTH (4 * PIPELINE_BLOCK_LENGTH)
+#define PIPELINE_STAGES 3
+
+typedef struct VaultHeader {
+  bool legacy;
+  // a manifest rather than a database file
+  bool sharded;
+  KdfParams kdf;
+  unsigned char *salt;
+  int salt_length;
+  uint32_t index_length;
+  unsigned char compression;
+} VaultHeader;
+
+// layout of a sharded database; a single database file has no shards
+typedef struct Manifest {
+  int shard_count;
+  uint32_t generation;
+  unsigned char seed[MANIFEST_SEED_LENGTH];
+} Manifest;
+
+bool openssl_valid() {
+  // OpenSSL 0xMNN00PP0L
+  //           ^
+  if (OpenSSL_version_num() < 0x30000000L) {
     last_error = ERR_OPENSSL_INVALID;
     return false;
   }
@@ -70,7 +178,307 @@ bool database_exists() {
   return true;
 }
 
-bool create_database(char *master_pwd) {
+static bool read_file(FILE *file, unsigned char **data, size_t *data_len) {
+  fseek(file, 0, SEEK_END);
+  long size = ftell(file);
+  fseek(file, 0, SEEK_SET);
+
+  unsigned char *buffer = size >= 0 ? malloc(size + 1) : NULL;
+  if (!buffer || fread(buffer, 1, size, file) != (size_t)size) {
+    free(buffer);
+    last_error = ERR_DB_OPEN_FAILED;
+    return false;
+  }
+
+  *data = buffer;
+  *data_len = size;
+  return true;
+}
+
+static uint32_t read_u32(const unsigned char *ptr) {
+  return (uint32_t)ptr[0] | (uint32_t)ptr[1] << 8 | (uint32_t)ptr[2] << 16 |
+         (uint32_t)ptr[3] << 24;
+}
+
+static void write_u32(unsigned char *ptr, uint32_t value) {
+  ptr[0] = value;
+  ptr[1] = value >> 8;
+  ptr[2] = value >> 16;
+  ptr[3] = value >> 24;
+}
+
+static void build_header(VaultKey *key, uint32_t index_length,
+                         unsigned char compression, unsigned char *header) {
+  memset(header, 0, VAULT_HEADER_LENGTH);
+  memcpy(header, VAULT_MAGIC, VAULT_MAGIC_LENGTH);
+  header[8] = VAULT_VERSION;
+  header[10] = key->kdf.kdf;
+  header[11] = key->salt_length;
+  write_u32(header + 12, key->kdf.iterations);
+  memcpy(header + 16, key->salt, key->salt_length);
+  write_u32(header + 32, index_length);
+  header[36] = key->kdf.memory_mib;
+  header[37] = key->kdf.memory_mib >> 8;
+  header[38] = key->kdf.lanes;
+  header[39] = compression;
+}
+
+static bool valid_kdf(KdfParams *kdf) {
+  if (kdf->kdf == CRYPTO_KDF_PBKDF2_SHA256) {
+    return kdf->iterations > 0 && kdf->memory_mib == 0 && kdf->lanes == 0;
+  }
+
+  return kdf->kdf == CRYPTO_KDF_ARGON2ID && kdf->iterations > 0 &&
+         kdf->memory_mib > 0 && kdf->lanes > 0;
+}
+
+/**
+ * Parses the header of a database file or, as it starts with the same
+ * fields, of a manifest.
+ */
+static bool parse_header(unsigned char *header, size_t header_len,
+                         VaultHeader *parsed) {
+  if (header_len < VAULT_HEADER_LENGTH || header[11] > CRYPTO_SALT_LENGTH) {
+    last_error = ERR_DB_CORRUPT;
+    return false;
+  }
+
+  int version = header[8] | header[9] << 8;
+  parsed->sharded =
+      memcmp(header, MANIFEST_MAGIC, MANIFEST_MAGIC_LENGTH) == 0;
+  bool known = parsed->sharded
+                   ? version == MANIFEST_VERSION
+                   : memcmp(header, VAULT_MAGIC, VAULT_MAGIC_LENGTH) == 0 &&
+                         (version == VAULT_VERSION ||
+                          version == VAULT_VERSION_UNCOMPRESSED);
+  if (!known) {
+    last_error = ERR_DB_CORRUPT;
+    return false;
+  }
+
+  memset(&parsed->kdf, 0, sizeof(KdfParams));
+  parsed->kdf.kdf = header[10];
+  parsed->kdf.iterations = read_u32(header + 12);
+  parsed->kdf.memory_mib = header[36] | header[37] << 8;
+  parsed->kdf.lanes = header[38];
+  if (!valid_kdf(&parsed->kdf)) {
+    last_error = ERR_DB_CORRUPT;
+    return false;
+  }
+
+  parsed->salt = header + 16;
+  parsed->salt_length = header[11];
+  parsed->index_length = read_u32(header + 32);
+  parsed->compression =
+      !parsed->sharded && version == VAULT_VERSION_UNCOMPRESSED ? COMPRESS_NONE
+                                                                : header[39];
+  if (parsed->compression > COMPRESS_DEFLATE) {
+    last_error = ERR_DB_CORRUPT;
+    return false;
+  }
+
+  return true;
+}
+
+/**
+ * Reads the header of an open database file, telling apart the legacy format
+ * written by `openssl enc` from the current one.
+ */
+static bool read_header(FILE *db, unsigned char *header, VaultHeader *parsed) {
+  size_t header_len = fread(header, 1, VAULT_HEADER_LENGTH, db);
+
+  parsed->legacy =
+      header_len >= CRYPTO_LEGACY_HEADER_LENGTH &&
+      memcmp(header, CRYPTO_LEGACY_MAGIC, CRYPTO_LEGACY_MAGIC_LENGTH) == 0;
+
+  if (parsed->legacy) {
+    parsed->sharded = false;
+    crypto_default_kdf(&parsed->kdf);
+    parsed->salt = header + CRYPTO_LEGACY_MAGIC_LENGTH;
+    parsed->salt_length = CRYPTO_LEGACY_SALT_LENGTH;
+    parsed->compression = COMPRESS_NONE;
+    return true;
+  }
+
+  return parse_header(header, header_len, parsed);
+}
+
+static void get_journal_path(char *db_path, char *journal_path) {
+  sprintf(journal_path, "%s.journal", db_path);
+}
+
+static void get_rekey_path(char *db_path, char *rekey_path) {
+  sprintf(rekey_path, "%s.rekey", db_path);
+}
+
+static void file_identity(struct stat *info, FileIdentity *identity) {
+  identity->inode = info->st_ino;
+  identity->size = info->st_size;
+#ifdef _WIN32
+  identity->mtime_sec = info->st_mtime;
+#else
+  identity->mtime_sec = info->st_mtim.tv_sec;
+  identity->mtime_nsec = info->st_mtim.tv_nsec;
+#endif
+}
+
+static bool vault_identity(char *db_path, VaultIdentity *identity) {
+  struct stat info;
+  if (stat(db_path, &info) != 0) {
+    return false;
+  }
+
+  memset(identity, 0, sizeof(VaultIdentity));
+  file_identity(&info, &identity->database);
+
+  // appending to the journal changes the contents as well
+  char journal_path[FS_MAX_PATH_LENGTH + 8];
+  get_journal_path(db_path, journal_path);
+  if (stat(journal_path, &info) == 0) {
+    file_identity(&info, &identity->journal);
+  }
+
+  return true;
+}
+
+/**
+ * Writes the path of a shard into a buffer of FS_MAX_PATH_LENGTH, failing if
+ * it does not fit.
+ */
+static bool get_shard_path(char *db_path, Manifest *manifest, int shard,
+                           char *shard_path) {
+  int length = snprintf(shard_path, FS_MAX_PATH_LENGTH, "%s.shard%u-%02d",
+                        db_path, manifest->generation, shard);
+  if (length < 0 || length >= FS_MAX_PATH_LENGTH) {
+    last_error = ERR_DB_OPEN_FAILED;
+    return false;
+  }
+
+  return true;
+}
+
+/**
+ * Picks the shard of an identifier with a hash keyed by the seed of the
+ * manifest, so that which shard changes gives nothing away about the
+ * identifier. Being keyed, it is also unrelated to the hash of the entries
+ * table, whose slots would otherwise be crowded by entries of one shard.
+ */
+static int shard_of(Manifest *manifest, const char *identifier) {
+  // FNV-1a over seed and identifier, finished like MurmurHash3
+  uint32_t hash = 2166136261u;
+  for (int i = 0; i < MANIFEST_SEED_LENGTH; i++) {
+    hash = (hash ^ manifest->seed[i]) * 16777619u;
+  }
+
+  for (const unsigned char *ptr = (const unsigned char *)identifier; *ptr;
+       ptr++) {
+    hash = (hash ^ *ptr) * 16777619u;
+  }
+
+  hash ^= hash >> 16;
+  hash *= 0x85ebca6bu;
+  hash ^= hash >> 13;
+  hash *= 0xc2b2ae35u;
+  hash ^= hash >> 16;
+  return hash % manifest->shard_count;
+}
+
+/**
+ * Reads the manifest if the database is sharded; a single database file, or
+ * none at all, has no shards. Shard count and generation are known without a
+ * key, while the seed is only opened with one.
+ */
+static bool read_manifest(VaultKey *key, char *db_path, Manifest *manifest) {
+  memset(manifest, 0, sizeof(Manifest));
+
+  FILE *db = fopen(db_path, "rb");
+  if (!db) {
+    return true;
+  }
+
+  unsigned char header[MANIFEST_HEADER_LENGTH];
+  size_t header_len = fread(header, 1, MANIFEST_HEADER_LENGTH, db);
+  if (header_len < MANIFEST_HEADER_LENGTH ||
+      memcmp(header, MANIFEST_MAGIC, MANIFEST_MAGIC_LENGTH) != 0) {
+    fclose(db);
+    return true;
+  }
+
+  VaultHeader parsed;
+  bool ok = parse_header(header, header_len, &parsed);
+  manifest->shard_count = read_u32(header + VAULT_HEADER_LENGTH);
+  manifest->generation = read_u32(header + VAULT_HEADER_LENGTH + 4);
+  if (ok && (manifest->shard_count < 2 ||
+             manifest->shard_count > DATABASE_MAX_SHARDS)) {
+    last_error = ERR_DB_CORRUPT;
+    ok = false;
+  }
+
+  // a key derived for another salt can never open the manifest
+  if (ok && key &&
+      (parsed.salt_length != key->salt_length ||
+       memcmp(parsed.salt, key->salt, parsed.salt_length) != 0)) {
+    last_error = ERR_DB_MASTER_PWD;
+    ok = false;
+  }
+
+  if (ok && key) {
+    unsigned char sealed[MANIFEST_SEED_LENGTH + CRYPTO_SEAL_OVERHEAD];
+    ok = parsed.index_length == sizeof(sealed) &&
+         fread(sealed, 1, sizeof(sealed), db) == sizeof(sealed) &&
+         crypto_open(key, header, MANIFEST_HEADER_LENGTH, sealed,
+                     sizeof(sealed), manifest->seed);
+    if (!ok && last_error != ERR_DB_MASTER_PWD) {
+      last_error = ERR_DB_CORRUPT;
+    }
+  }
+
+  fclose(db);
+  return ok;
+}
+
+/**
+ * Folds the identity of a shard into the journal part of the identity of a
+ * sharded database, which therefore changes along with any of its shards.
+ */
+static void add_shard_identity(VaultIdentity *identity, VaultIdentity *shard) {
+  FileIdentity *summary = &identity->journal;
+  const unsigned char *bytes = (const unsigned char *)shard;
+
+  // FNV-1a
+  uint64_t hash = summary->inode ? summary->inode : 14695981039346656037u;
+  for (size_t i = 0; i < sizeof(VaultIdentity); i++) {
+    hash = (hash ^ bytes[i]) * 1099511628211u;
+  }
+
+  summary->inode = hash;
+  summary->size += shard->database.size + shard->journal.size;
+}
+
+/**
+ * Identity of a single database file, or of a manifest and all of its shards.
+ */
+static bool layout_identity(char *db_path, Manifest *manifest,
+                            VaultIdentity *identity) {
+  if (!vault_identity(db_path, identity)) {
+    return false;
+  }
+
+  for (int i = 0; i < manifest->shard_count; i++) {
+    char shard_path[FS_MAX_PATH_LENGTH];
+    VaultIdentity shard;
+    if (!get_shard_path(db_path, manifest, i, shard_path) ||
+        !vault_identity(shard_path, &shard)) {
+      return false;
+    }
+
+    add_shard_identity(identity, &shard);
+  }
+
+  return true;
+}
+
+bool database_identity(VaultIdentity *identity) {
   char db_path[FS_MAX_PATH_LENGTH];
   bool path_ok = get_db_path(db_path);
 
@@ -78,23 +486,153 @@ bool create_database(char *master_pwd) {
     return false;
   }
 
-  // no database, use OpenSSL to create initial database
-  char command[FS_MAX_PATH_LENGTH];
-  sprintf(command,
-          "openssl enc -aes-256-cbc -pbkdf2 -iter 100000 -out %s -pass pass:%s",
-          db_path, master_pwd);
+  Manifest manifest;
+  if (!read_manifest(NULL, db_path, &manifest)) {
+    return false;
+  }
 
-  FILE *db = popen(command, "w");
-  if (!db) {
+  if (!layout_identity(db_path, &manifest, identity)) {
+    last_error = ERR_DB_OPEN_FAILED;
+    return false;
+  }
+
+  return true;
+}
+
+/**
+ * Blocks until the lock next to the database is held, returning a descriptor
+ * to pass to release_lock or -1.
+ */
+static int acquire_lock(char *db_path, bool exclusive) {
+  char lock_path[FS_MAX_PATH_LENGTH + 8];
+  sprintf(lock_path, "%s.lock", db_path);
+
+  uint64_t trace = trace_begin();
+
+#ifdef _WIN32
+  int fd = _open(lock_path, _O_RDWR | _O_CREAT, _S_IREAD | _S_IWRITE);
+  OVERLAPPED overlapped = {0};
+  bool locked = fd >= 0 &&
+                LockFileEx((HANDLE)_get_osfhandle(fd),
+                           exclusive ? LOCKFILE_EXCLUSIVE_LOCK : 0, 0, MAXDWORD,
+                           MAXDWORD, &overlapped);
+#else
+  int fd = open(lock_path, O_RDWR | O_CREAT, 0600);
+  int result = -1;
+  while (fd >= 0 && (result = flock(fd, exclusive ? LOCK_EX : LOCK_SH)) != 0 &&
+         errno == EINTR)
+    ;
+  bool locked = result == 0;
+#endif
+
+  trace_end("lock", trace);
+
+  if (!locked) {
+    if (fd >= 0) {
+      close(fd);
+    }
+
+    last_error = ERR_DB_OPEN_FAILED;
+    return -1;
+  }
+
+  return fd;
+}
+
+// closing the descriptor releases the lock
+static void release_lock(int lock) { close(lock); }
+
+/**
+ * Locks the database and reads its manifest. Writers of a single database
+ * file hold the lock exclusively, while those of a sharded one share it and
+ * lock their shard on their own, so that only resharding shuts out everyone.
+ */
+static int lock_database(VaultKey *key, char *db_path, bool write,
+                         Manifest *manifest) {
+  for (;;) {
+    Manifest peek;
+    if (!read_manifest(NULL, db_path, &peek)) {
+      return -1;
+    }
+
+    int lock = acquire_lock(db_path, write && peek.shard_count == 0);
+    if (lock < 0) {
+      return -1;
+    }
+
+    if (!read_manifest(key, db_path, manifest)) {
+      release_lock(lock);
+      return -1;
+    }
+
+    // unless resharded while waiting for the lock
+    if ((manifest->shard_count > 0) == (peek.shard_count > 0)) {
+      return lock;
+    }
+
+    release_lock(lock);
+  }
+}
+
+/**
+ * Flushes a file all the way to the disk before it is renamed into place or
+ * considered written.
+ */
+static bool sync_file(FILE *file) {
+  if (fflush(file) != 0) {
+    return false;
+  }
+
+#ifdef _WIN32
+  return _commit(_fileno(file)) == 0;
+#else
+  return fsync(fileno(file)) == 0;
+#endif
+}
+
+/**
+ * Makes a rename or a newly created file in the database directory durable.
+ */
+static void sync_directory(char *db_path) {
+#ifndef _WIN32
+  char dir_path[FS_MAX_PATH_LENGTH];
+  strcpy(dir_path, db_path);
+
+  char *separator = strrchr(dir_path, '/');
+  if (separator) {
+    *separator = '\0';
+  } else {
+    strcpy(dir_path, ".");
+  }
+
+  int fd = open(dir_path, O_RDONLY);
+  if (fd >= 0) {
+    fsync(fd);
+    close(fd);
+  }
+#endif
+}
+
+/**
+ * Moves a file written and flushed to the disk in place of the database file.
+ */
+static bool replace_file(char *temp_path, char *db_path) {
+#ifdef _WIN32
+  // rename does not replace existing files on Windows
+  remove(db_path);
+#endif
+
+  if (rename(temp_path, db_path) != 0) {
+    remove(temp_path);
     last_error = ERR_DB_OPEN_FAILED;
     return false;
   }
 
-  pclose(db);
+  sync_directory(db_path);
   return true;
 }
 
-bool read_database(char *master_pwd, Lines lines, int *lines_read) {
+bool database_info(DatabaseInfo *info) {
   char db_path[FS_MAX_PATH_LENGTH];
   bool path_ok = get_db_path(db_path);
 
@@ -102,39 +640,93 @@ bool read_database(char *master_pwd, Lines lines, int *lines_read) {
     return false;
   }
 
-  char command[FS_MAX_PATH_LENGTH];
-  sprintf(
-      command,
-      "openssl enc -aes-256-cbc -pbkdf2 -iter 100000 -d -in %s -pass pass:%s",
-      db_path, master_pwd);
-
-  FILE *db = popen(command, "r");
+  FILE *db = fopen(db_path, "rb");
   if (!db) {
     last_error = ERR_DB_OPEN_FAILED;
     return false;
   }
 
-  Line line;
-  int count = 0;
+  unsigned char header[VAULT_HEADER_LENGTH];
+  VaultHeader parsed;
+  bool ok = read_header(db, header, &parsed);
+  fclose(db);
 
-  while (fgets(line, sizeof(line), db) != NULL) {
-    strtok(line, "\n"); // remove trailing new line
-    memcpy(lines[count++], line, sizeof(line));
-  }
+  Manifest manifest;
+  ok = ok && read_manifest(NULL, db_path, &manifest);
 
-  *lines_read = count;
+  VaultIdentity identity;
+  if (ok && !vault_identity(db_path, &identity)) {
+    last_error = ERR_DB_OPEN_FAILED;
+    ok = false;
+  }
 
-  // master password checks out?
-  int res = pclose(db);
-  if (res > 0) {
-    last_error = ERR_DB_MASTER_PWD;
+  if (!ok) {
     return false;
   }
 
+  memset(info, 0, sizeof(DatabaseInfo));
+  for (int i = 0; i < manifest.shard_count; i++) {
+    char shard_path[FS_MAX_PATH_LENGTH];
+    if (!get_shard_path(db_path, &manifest, i, shard_path)) {
+      return false;
+    }
+
+    VaultIdentity shard;
+    VaultHeader shard_header;
+    db = fopen(shard_path, "rb");
+    ok = db && read_header(db, header, &shard_header) &&
+         vault_identity(shard_path, &shard);
+    if (db) {
+      fclose(db);
+    }
+
+    if (!ok) {
+      last_error = ERR_DB_OPEN_FAILED;
+      return false;
+    }
+
+    info->index_length += shard_header.index_length;
+    info->compression = compress_name(shard_header.compression);
+    info->database_size += shard.database.size;
+    info->journal_size += shard.journal.size;
+  }
+
+  info->legacy = parsed.legacy;
+  info->kdf = crypto_kdf_name(parsed.kdf.kdf);
+  info->iterations = parsed.kdf.iterations;
+  info->memory_mib = parsed.kdf.memory_mib;
+  info->lanes = parsed.kdf.lanes;
+  info->salt_length = parsed.salt_length;
+  info->shards = manifest.shard_count;
+  if (manifest.shard_count == 0) {
+    info->compression = compress_name(parsed.compression);
+    info->index_length = parsed.legacy ? 0 : parsed.index_length;
+    info->journal_size = identity.journal.size;
+  }
+
+  info->database_size += identity.database.size;
   return true;
 }
 
-bool save_database(char *master_pwd, Lines lines, int num_lines) {
+bool create_database(char *master_pwd, VaultKey *key) {
+  if (!crypto_new_key(master_pwd, NULL, key)) {
+    return false;
+  }
+
+  // an empty database is just a header and an empty index
+  Entries entries;
+  entries_init(&entries);
+  bool ok = save_database(key, &entries);
+  entries_free(&entries);
+  return ok;
+}
+
+/**
+ * Derives the key for the existing database from the master password and the
+ * salt stored in the database header. Whether the password was correct only
+ * becomes known once the database is decrypted.
+ */
+bool unlock_database(char *master_pwd, VaultKey *key) {
   char db_path[FS_MAX_PATH_LENGTH];
   bool path_ok = get_db_path(db_path);
 
@@ -142,21 +734,2204 @@ bool save_database(char *master_pwd, Lines lines, int num_lines) {
     return false;
   }
 
-  char command[FS_MAX_PATH_LENGTH];
-  sprintf(command,
-          "openssl enc -aes-256-cbc -pbkdf2 -iter 100000 -out %s -pass pass:%s",
-          db_path, master_pwd);
-
-  FILE *db = popen(command, "w");
+  FILE *db = fopen(db_path, "rb");
   if (!db) {
     last_error = ERR_DB_OPEN_FAILED;
     return false;
   }
 
-  for (int i = 0; i < num_lines; i++) {
-    fprintf(db, "%s\n", lines[i]);
+  unsigned char header[VAULT_HEADER_LENGTH];
+  VaultHeader parsed;
+  bool ok = read_header(db, header, &parsed);
+  fclose(db);
+
+  if (!ok) {
+    return false;
+  }
+
+  return crypto_derive_key(master_pwd, parsed.salt, parsed.salt_length,
+                           &parsed.kdf, parsed.legacy, key);
+}
+
+/**
+ * Legacy databases are a single AES-CBC stream holding all passwords; they
+ * are converted to the current format on the next save.
+ */
+static bool read_legacy_database(VaultKey *key, FILE *db, Entries *entries) {
+  unsigned char *cipher;
+  size_t cipher_len;
+  if (!read_file(db, &cipher, &cipher_len)) {
+    return false;
+  }
+
+  // master password checks out?
+  unsigned char *plain;
+  size_t plain_len;
+  bool ok = crypto_legacy_decrypt(key, cipher, cipher_len, &plain, &plain_len);
+  free(cipher);
+
+  if (!ok) {
+    return false;
+  }
+
+  ok = payload_parse(entries, plain, plain_len);
+
+  OPENSSL_cleanse(plain, plain_len);
+  free(plain);
+  return ok;
+}
+
+/**
+ * Opens a sealed password or journal record into the entries arena, where it
+ * is left decoded according to the compression of the database, followed by
+ * a terminator.
+ */
+static bool open_record(VaultKey *key, Entries *entries,
+                        unsigned char compression, const unsigned char *aad,
+                        size_t aad_len, const unsigned char *sealed,
+                        size_t sealed_len, unsigned char **plain,
+                        size_t *plain_len) {
+  size_t encoded_len = sealed_len - CRYPTO_SEAL_OVERHEAD;
+  bool compressed = compression != COMPRESS_NONE;
+
+  // without compression the record is decrypted right where it stays
+  unsigned char *encoded = compressed
+                               ? malloc(encoded_len + 1)
+                               : arena_alloc(&entries->arena, encoded_len + 1);
+  if (!encoded) {
+    last_error = ERR_OUT_OF_MEMORY;
+    return false;
+  }
+
+  bool ok = crypto_open(key, aad, aad_len, sealed, sealed_len, encoded);
+  unsigned char *decoded = encoded;
+  size_t decoded_len = encoded_len;
+  if (ok && compressed) {
+    ok = compress_decoded_length(compression, encoded, encoded_len,
+                                 &decoded_len) &&
+         (decoded = arena_alloc(&entries->arena, decoded_len + 1)) &&
+         compress_decode(compression, encoded, encoded_len, decoded,
+                         decoded_len);
+  }
+
+  if (compressed) {
+    OPENSSL_cleanse(encoded, encoded_len);
+    free(encoded);
+  }
+
+  if (!ok) {
+    return false;
+  }
+
+  decoded[decoded_len] = '\0';
+  *plain = decoded;
+  *plain_len = decoded_len;
+  return true;
+}
+
+static void journal_aad(Entries *entries, int record, unsigned char *aad) {
+  memcpy(aad, entries->snapshot_id, ENTRIES_SNAPSHOT_ID_LENGTH);
+  write_u32(aad + ENTRIES_SNAPSHOT_ID_LENGTH, record);
+}
+
+/**
+ * Reads the next journal record, returning false once there is no complete
+ * record left.
+ */
+static bool read_journal_record(FILE *journal, unsigned char **sealed,
+                                size_t *sealed_len) {
+  unsigned char length[4];
+  if (fread(length, 1, 4, journal) != 4) {
+    return false;
+  }
+
+  size_t record_len = read_u32(length);
+  unsigned char *record =
+      record_len >= CRYPTO_SEAL_OVERHEAD ? malloc(record_len) : NULL;
+  if (!record || fread(record, 1, record_len, journal) != record_len) {
+    free(record);
+    return false;
   }
 
-  pclose(db);
+  *sealed = record;
+  *sealed_len = record_len;
   return true;
 }
+
+/**
+ * Applies the changes recorded in the journal on top of the entries just read
+ * from the database. A record cut short by a crash is dropped, and the next
+ * save compacts the journal to get rid of it.
+ */
+static bool read_journal(VaultKey *key, char *db_path, Entries *entries) {
+  char journal_path[FS_MAX_PATH_LENGTH + 8];
+  get_journal_path(db_path, journal_path);
+
+  FILE *journal = fopen(journal_path, "rb");
+  if (!journal) {
+    return true;
+  }
+
+  unsigned char header[JOURNAL_HEADER_LENGTH];
+  if (fread(header, 1, JOURNAL_HEADER_LENGTH, journal) !=
+          JOURNAL_HEADER_LENGTH ||
+      memcmp(header, JOURNAL_MAGIC, JOURNAL_MAGIC_LENGTH) != 0 ||
+      memcmp(header + JOURNAL_MAGIC_LENGTH, entries->snapshot_id,
+             ENTRIES_SNAPSHOT_ID_LENGTH) != 0) {
+    fclose(journal);
+    return true;
+  }
+
+  long length = JOURNAL_HEADER_LENGTH;
+  unsigned char *sealed;
+  size_t sealed_len;
+  bool ok = true;
+
+  while (ok && read_journal_record(journal, &sealed, &sealed_len)) {
+    unsigned char aad[JOURNAL_AAD_LENGTH];
+    journal_aad(entries, entries->journal_records, aad);
+
+    // opened into the arena, where the replayed strings stay
+    unsigned char *plain;
+    size_t plain_len;
+    ok = open_record(key, entries, entries->compression, aad,
+                     JOURNAL_AAD_LENGTH, sealed, sealed_len, &plain,
+                     &plain_len);
+    if (!ok && last_error != ERR_OUT_OF_MEMORY) {
+      last_error = ERR_DB_CORRUPT;
+    }
+
+    ok = ok && payload_apply_changes(entries, plain, plain_len);
+    free(sealed);
+
+    length += 4 + sealed_len;
+    entries->journal_records++;
+  }
+
+  if (ok && ftell(journal) != length) {
+    entries->journal_records = JOURNAL_MAX_RECORDS;
+  }
+
+  entries->journal_length = length;
+  fclose(journal);
+  return ok;
+}
+
+typedef enum PipelineStage {
+  STAGE_PARSE,
+  STAGE_DECRYPT,
+  STAGE_READ,
+} PipelineStage;
+
+// state shared by the stages of reading a large index: the read stage fills
+// blocks from the file, the decrypt stage decrypts them into the index and
+// the parse stage builds the entries from what was decrypted so far
+typedef struct IndexPipeline {
+  FILE *db;
+  Entries *entries;
+  CryptoStream stream;
+  unsigned char *index;
+  size_t body_length;
+  // blocks read ahead of decryption, one per place in the read queue
+  unsigned char *blocks;
+  unsigned char tag[CRYPTO_TAG_LENGTH];
+  // lengths of the blocks read but not decrypted, and of those decrypted but
+  // not parsed
+  ParallelQueue read;
+  ParallelQueue decrypted;
+  // progress of each stage, only touched by the worker running the stage
+  size_t read_length;
+  size_t read_blocks;
+  size_t decrypted_length;
+  size_t decrypted_blocks;
+  size_t parsed_length;
+  PayloadStream parse;
+  PassError parse_error;
+  bool parse_failed;
+  // each stage runs on one worker at a time
+  atomic_flag busy[PIPELINE_STAGES];
+  atomic_bool done[PIPELINE_STAGES];
+  atomic_bool failed;
+  atomic_int error;
+} IndexPipeline;
+
+static void pipeline_fail(IndexPipeline *pipe, PassError error) {
+  atomic_store(&pipe->error, error);
+  atomic_store(&pipe->failed, true);
+}
+
+/**
+ * Reads the next block of the sealed index into the block at the tail of the
+ * read queue, and its tag after the last one.
+ */
+static bool read_stage(IndexPipeline *pipe) {
+  if (pipe->read_length == pipe->body_length) {
+    if (fread(pipe->tag, 1, CRYPTO_TAG_LENGTH, pipe->db) !=
+        CRYPTO_TAG_LENGTH) {
+      pipeline_fail(pipe, ERR_DB_CORRUPT);
+      return false;
+    }
+
+    atomic_store(&pipe->done[STAGE_READ], true);
+    return true;
+  }
+
+  if (parallel_queue_full(&pipe->read)) {
+    return false;
+  }
+
+  size_t length = pipe->body_length - pipe->read_length;
+  length = length < PIPELINE_BLOCK_LENGTH ? length : PIPELINE_BLOCK_LENGTH;
+  unsigned char *block =
+      pipe->blocks +
+      pipe->read_blocks % PARALLEL_QUEUE_CAPACITY * PIPELINE_BLOCK_LENGTH;
+
+  if (fread(block, 1, length, pipe->db) != length) {
+    pipeline_fail(pipe, ERR_DB_CORRUPT);
+    return false;
+  }
+
+  parallel_queue_push(&pipe->read, length);
+  pipe->read_length += length;
+  pipe->read_blocks++;
+  return true;
+}
+
+/**
+ * Decrypts the block at the head of the read queue into the index, and
+ * verifies the tag once all blocks are through.
+ */
+static bool decrypt_stage(IndexPipeline *pipe) {
+  if (pipe->decrypted_length == pipe->body_length) {
+    if (!atomic_load(&pipe->done[STAGE_READ])) {
+      return false;
+    }
+
+    if (!crypto_open_final(&pipe->stream, pipe->tag)) {
+      pipeline_fail(pipe, last_error);
+      return false;
+    }
+
+    atomic_store(&pipe->done[STAGE_DECRYPT], true);
+    return true;
+  }
+
+  size_t length;
+  if (parallel_queue_full(&pipe->decrypted) ||
+      !parallel_queue_peek(&pipe->read, &length)) {
+    return false;
+  }
+
+  unsigned char *block =
+      pipe->blocks +
+      pipe->decrypted_blocks % PARALLEL_QUEUE_CAPACITY * PIPELINE_BLOCK_LENGTH;
+  if (!crypto_open_update(&pipe->stream, block, length,
+                          pipe->index + pipe->decrypted_length)) {
+    pipeline_fail(pipe, last_error);
+    return false;
+  }
+
+  parallel_queue_pop(&pipe->read, &length);
+  parallel_queue_push(&pipe->decrypted, length);
+  pipe->decrypted_length += length;
+  pipe->decrypted_blocks++;
+  return true;
+}
+
+/**
+ * Parses the entries the newly decrypted block completes. A parse error is
+ * only reported once the tag is verified, as a wrong key decrypts to garbage
+ * as well.
+ */
+static bool parse_stage(IndexPipeline *pipe) {
+  size_t length;
+  if (!parallel_queue_pop(&pipe->decrypted, &length)) {
+    return false;
+  }
+
+  pipe->parsed_length += length;
+  if (!pipe->parse_failed &&
+      !payload_parse_stream(pipe->entries, &pipe->parse, pipe->index,
+                            pipe->parsed_length, pipe->body_length)) {
+    pipe->parse_error = last_error;
+    pipe->parse_failed = true;
+  }
+
+  if (pipe->parsed_length == pipe->body_length) {
+    atomic_store(&pipe->done[STAGE_PARSE], true);
+  }
+
+  return true;
+}
+
+static bool pipeline_finished(IndexPipeline *pipe) {
+  return atomic_load(&pipe->failed) ||
+         (atomic_load(&pipe->done[STAGE_READ]) &&
+          atomic_load(&pipe->done[STAGE_DECRYPT]) &&
+          atomic_load(&pipe->done[STAGE_PARSE]));
+}
+
+/**
+ * Workers start with a stage of their own and help out with the others
+ * while it waits, so that the pipeline also completes on fewer workers than
+ * stages.
+ */
+static void run_pipeline(void *context, int worker) {
+  IndexPipeline *pipe = context;
+
+  while (!pipeline_finished(pipe)) {
+    bool progress = false;
+    for (int i = 0; i < PIPELINE_STAGES && !progress; i++) {
+      PipelineStage stage = (worker + i) % PIPELINE_STAGES;
+      if (atomic_flag_test_and_set(&pipe->busy[stage])) {
+        continue;
+      }
+
+      // done is only checked once the stage is taken, as another worker may
+      // have finished it just before
+      if (!atomic_load(&pipe->done[stage])) {
+        progress = stage == STAGE_READ      ? read_stage(pipe)
+                   : stage == STAGE_DECRYPT ? decrypt_stage(pipe)
+                                            : parse_stage(pipe);
+      }
+      atomic_flag_clear(&pipe->busy[stage]);
+    }
+
+    if (!progress) {
+      parallel_yield();
+    }
+  }
+}
+
+/**
+ * Reads, decrypts and parses a large index in blocks, with the stages
+ * overlapping, so that the time taken is about that of the slowest stage
+ * rather than of all three. The file is positioned at the sealed index.
+ */
+static bool read_index_pipelined(VaultKey *key, FILE *db,
+                                 unsigned char *header, size_t index_len,
+                                 unsigned char *index, Entries *entries,
+                                 unsigned char *tag) {
+  unsigned char nonce[CRYPTO_NONCE_LENGTH];
+  IndexPipeline pipe = {
+      .db = db,
+      .entries = entries,
+      .index = index,
+      .body_length = index_len - CRYPTO_SEAL_OVERHEAD,
+      .blocks = malloc(PARALLEL_QUEUE_CAPACITY * PIPELINE_BLOCK_LENGTH),
+  };
+
+  if (!pipe.blocks) {
+    last_error = ERR_OUT_OF_MEMORY;
+    return false;
+  }
+
+  if (fread(nonce, 1, CRYPTO_NONCE_LENGTH, db) != CRYPTO_NONCE_LENGTH ||
+      !crypto_open_begin(key, header, VAULT_HEADER_LENGTH, nonce,
+                         &pipe.stream)) {
+    free(pipe.blocks);
+    last_error = ERR_DB_CORRUPT;
+    return false;
+  }
+
+  parallel_queue_init(&pipe.read);
+  parallel_queue_init(&pipe.decrypted);
+  for (int i = 0; i < PIPELINE_STAGES; i++) {
+    atomic_flag_clear(&pipe.busy[i]);
+    atomic_init(&pipe.done[i], false);
+  }
+  atomic_init(&pipe.failed, false);
+  atomic_init(&pipe.error, ERR_DB_CORRUPT);
+
+  int workers = parallel_workers();
+  workers = workers < PIPELINE_STAGES ? workers : PIPELINE_STAGES;
+
+  uint64_t trace = trace_begin();
+  parallel_run(run_pipeline, &pipe, workers);
+  trace_end("index_pipeline", trace);
+
+  bool ok = !atomic_load(&pipe.failed) && !pipe.parse_failed;
+  if (atomic_load(&pipe.failed)) {
+    last_error = (PassError)atomic_load(&pipe.error);
+  } else if (pipe.parse_failed) {
+    last_error = pipe.parse_error;
+  }
+
+  if (pipe.stream.ctx) {
+    crypto_open_final(&pipe.stream, NULL);
+  }
+
+  OPENSSL_cleanse(pipe.blocks, PARALLEL_QUEUE_CAPACITY * PIPELINE_BLOCK_LENGTH);
+  free(pipe.blocks);
+
+  if (!ok) {
+    OPENSSL_cleanse(index, pipe.body_length);
+    return false;
+  }
+
+  memcpy(tag, pipe.tag, CRYPTO_TAG_LENGTH);
+  return true;
+}
+
+/**
+ * Reads and decrypts the index in one go, which is faster for the usual
+ * small ones, and wherever a single core would have to run all stages in
+ * turn anyway.
+ */
+static bool read_index(VaultKey *key, FILE *db, unsigned char *header,
+                       size_t index_len, unsigned char *index,
+                       Entries *entries, unsigned char *tag) {
+  if (index_len >= PIPELINE_MIN_LENGTH && parallel_workers() > 1) {
+    return read_index_pipelined(key, db, header, index_len, index, entries,
+                                tag);
+  }
+
+  unsigned char *sealed = malloc(index_len);
+
+  // master password checks out?
+  bool ok = sealed && fread(sealed, 1, index_len, db) == index_len &&
+            crypto_open(key, header, VAULT_HEADER_LENGTH, sealed, index_len,
+                        index);
+  if (!sealed) {
+    last_error = ERR_OUT_OF_MEMORY;
+  } else if (!ok && last_error != ERR_DB_MASTER_PWD) {
+    last_error = ERR_DB_CORRUPT;
+  }
+
+  size_t plain_len = ok ? index_len - CRYPTO_SEAL_OVERHEAD : 0;
+  ok = ok && payload_parse(entries, index, plain_len);
+
+  if (ok) {
+    memcpy(tag, sealed + index_len - CRYPTO_TAG_LENGTH, CRYPTO_TAG_LENGTH);
+  }
+
+  free(sealed);
+  return ok;
+}
+
+/**
+ * Only decrypts the index of the database; passwords are opened one by one
+ * with read_entry.
+ */
+static bool load_database(VaultKey *key, char *db_path, Entries *entries) {
+  FILE *db = fopen(db_path, "rb");
+  if (!db) {
+    last_error = ERR_DB_OPEN_FAILED;
+    return false;
+  }
+
+  entries_init(entries);
+
+  unsigned char header[VAULT_HEADER_LENGTH];
+  VaultHeader parsed;
+  if (!read_header(db, header, &parsed)) {
+    fclose(db);
+    return false;
+  }
+
+  if (parsed.legacy) {
+    bool ok = read_legacy_database(key, db, entries);
+    fclose(db);
+
+    if (!ok) {
+      entries_free(entries);
+    }
+
+    return ok;
+  }
+
+  // manifests are read with read_manifest
+  if (parsed.sharded) {
+    fclose(db);
+    last_error = ERR_DB_CORRUPT;
+    return false;
+  }
+
+  entries->compression = parsed.compression;
+
+  // a key derived for another salt can never open this database
+  if (parsed.salt_length != key->salt_length ||
+      memcmp(parsed.salt, key->salt, parsed.salt_length) != 0) {
+    fclose(db);
+    last_error = ERR_DB_MASTER_PWD;
+    return false;
+  }
+
+  // the index is decrypted straight into the arena the entries point into
+  size_t index_len = parsed.index_length;
+  unsigned char *index = arena_alloc(&entries->arena, index_len);
+  if (!index) {
+    last_error = ERR_OUT_OF_MEMORY;
+  }
+
+  // the tag of the index identifies this version of the database
+  unsigned char tag[CRYPTO_TAG_LENGTH];
+  bool ok = index && read_index(key, db, header, index_len, index, entries,
+                                tag);
+  if (ok) {
+    memcpy(entries->snapshot_id, tag, ENTRIES_SNAPSHOT_ID_LENGTH);
+  }
+
+  entries->source = db;
+
+  uint64_t trace = trace_begin();
+  ok = ok && read_journal(key, db_path, entries);
+  trace_end("journal_replay", trace);
+
+  if (!ok) {
+    entries_free(entries);
+    return false;
+  }
+
+  return true;
+}
+
+/**
+ * Loads a database file along with its identity.
+ */
+static bool load_identified(VaultKey *key, char *db_path, Entries *entries) {
+  VaultIdentity identity;
+  if (!vault_identity(db_path, &identity)) {
+    last_error = ERR_DB_OPEN_FAILED;
+    return false;
+  }
+
+  if (!load_database(key, db_path, entries)) {
+    return false;
+  }
+
+  entries->identity = identity;
+  return true;
+}
+
+/**
+ * Loads a single shard, taking its lock unless the whole database is locked
+ * exclusively already.
+ */
+static bool load_shard(VaultKey *key, char *db_path, Manifest *manifest,
+                       int shard, bool lock, Entries *entries) {
+  char shard_path[FS_MAX_PATH_LENGTH];
+  if (!get_shard_path(db_path, manifest, shard, shard_path)) {
+    return false;
+  }
+
+  int shard_lock = lock ? acquire_lock(shard_path, false) : -1;
+  if (lock && shard_lock < 0) {
+    return false;
+  }
+
+  bool ok = load_identified(key, shard_path, entries);
+  if (lock) {
+    release_lock(shard_lock);
+  }
+
+  if (ok) {
+    entries->shard = shard;
+  }
+
+  return ok;
+}
+
+// state shared by the workers loading the shards
+typedef struct ShardJob {
+  VaultKey *key;
+  char *db_path;
+  Manifest *manifest;
+  bool lock;
+  Entries *shards;
+  atomic_int next;
+  atomic_bool failed;
+  atomic_int error;
+} ShardJob;
+
+/**
+ * Workers take the shards one by one until none are left or one of them
+ * could not be loaded.
+ */
+static void load_shards(void *context, int worker) {
+  (void)worker;
+  ShardJob *job = context;
+
+  while (!atomic_load(&job->failed)) {
+    int shard = atomic_fetch_add(&job->next, 1);
+    if (shard >= job->manifest->shard_count) {
+      break;
+    }
+
+    if (!load_shard(job->key, job->db_path, job->manifest, shard, job->lock,
+                    &job->shards[shard])) {
+      atomic_store(&job->error, last_error);
+      atomic_store(&job->failed, true);
+    }
+  }
+}
+
+/**
+ * Lists the entries of all shards in the merged entries, which refer to the
+ * shards for their records.
+ */
+static bool merge_shards(Entries *entries) {
+  entries_clear(entries);
+  entries->journal_records = 0;
+
+  // the shards are always written together, all with the same compression
+  entries->compression =
+      entries->shard_count > 0 ? entries->shards[0].compression
+                               : COMPRESS_NONE;
+
+  int count = 0;
+  for (int i = 0; i < entries->shard_count; i++) {
+    count += entries->shards[i].count;
+    entries->journal_records += entries->shards[i].journal_records;
+  }
+
+  if (!entries_reserve(entries, count)) {
+    return false;
+  }
+
+  for (int i = 0; i < entries->shard_count; i++) {
+    Entries *shard = &entries->shards[i];
+
+    for (int j = 0; j < shard->count; j++) {
+      Entry *entry = &shard->items[j];
+      if (!entries_append_view(entries, entry->identifier,
+                               entry->identifier_length, entry->password)) {
+        return false;
+      }
+
+      Entry *merged = &entries->items[entries->count - 1];
+      merged->sealed = entry->sealed;
+      merged->shard = i;
+      merged->record_offset = entry->record_offset;
+      merged->record_length = entry->record_length;
+      merged->created = entry->created;
+      merged->modified = entry->modified;
+      merged->accessed = entry->accessed;
+      merged->access_count = entry->access_count;
+    }
+  }
+
+  entries_rank_hot(entries);
+  return true;
+}
+
+/**
+ * Identity of the merged entries, made up of the identity of the manifest and
+ * those of the shards as they were loaded.
+ */
+static bool merged_identity(char *db_path, Entries *entries,
+                            VaultIdentity *identity) {
+  if (!vault_identity(db_path, identity)) {
+    last_error = ERR_DB_OPEN_FAILED;
+    return false;
+  }
+
+  for (int i = 0; i < entries->shard_count; i++) {
+    add_shard_identity(identity, &entries->shards[i].identity);
+  }
+
+  return true;
+}
+
+/**
+ * Loads all shards in parallel, each on its own core, and merges their
+ * entries.
+ */
+static bool read_shards(VaultKey *key, char *db_path, Manifest *manifest,
+                        bool lock, Entries *entries) {
+  entries_init(entries);
+
+  int count = manifest->shard_count;
+  entries->shards = malloc(count * sizeof(Entries));
+  if (!entries->shards) {
+    last_error = ERR_OUT_OF_MEMORY;
+    return false;
+  }
+
+  entries->shard_count = count;
+  for (int i = 0; i < count; i++) {
+    entries_init(&entries->shards[i]);
+  }
+
+  ShardJob job = {
+      .key = key,
+      .db_path = db_path,
+      .manifest = manifest,
+      .lock = lock,
+      .shards = entries->shards,
+  };
+  atomic_init(&job.next, 0);
+  atomic_init(&job.failed, false);
+  atomic_init(&job.error, ERR_DB_OPEN_FAILED);
+
+  int workers = parallel_workers();
+  workers = workers < count ? workers : count;
+
+  // the error is thread local and workers pass theirs back through the job,
+  // but worker 0 runs on this thread and may leave its own behind
+  PassError error = last_error;
+  uint64_t trace = trace_begin();
+  parallel_run(load_shards, &job, workers);
+  trace_end("load_shards", trace);
+
+  bool ok = !atomic_load(&job.failed);
+  last_error = ok ? error : (PassError)atomic_load(&job.error);
+
+  ok = ok && merge_shards(entries) &&
+       merged_identity(db_path, entries, &entries->identity);
+  if (!ok) {
+    entries_free(entries);
+  }
+
+  return ok;
+}
+
+/**
+ * Reads the database together with its journal, so that a writer can not
+ * slip a compaction in between. A sharded database is read as a whole, with
+ * the entries of all shards merged.
+ */
+bool read_database(VaultKey *key, Entries *entries) {
+  char db_path[FS_MAX_PATH_LENGTH];
+  bool path_ok = get_db_path(db_path);
+
+  if (!path_ok) {
+    return false;
+  }
+
+  uint64_t trace = trace_begin();
+  Manifest manifest;
+  int lock = lock_database(key, db_path, false, &manifest);
+  if (lock < 0) {
+    return false;
+  }
+
+  bool ok = manifest.shard_count > 0
+                ? read_shards(key, db_path, &manifest, true, entries)
+                : load_identified(key, db_path, entries);
+  release_lock(lock);
+
+  trace_end("read_database", trace);
+  return ok;
+}
+
+/**
+ * Reads the part of the database the identifier belongs to, which is all of
+ * a single database file, but only one shard of a sharded database.
+ */
+bool read_database_for(VaultKey *key, const char *identifier,
+                       Entries *entries) {
+  char db_path[FS_MAX_PATH_LENGTH];
+  bool path_ok = get_db_path(db_path);
+
+  if (!path_ok) {
+    return false;
+  }
+
+  uint64_t trace = trace_begin();
+  Manifest manifest;
+  int lock = lock_database(key, db_path, false, &manifest);
+  if (lock < 0) {
+    return false;
+  }
+
+  bool ok = manifest.shard_count > 0
+                ? load_shard(key, db_path, &manifest,
+                             shard_of(&manifest, identifier), true, entries)
+                : load_identified(key, db_path, entries);
+  release_lock(lock);
+
+  trace_end("read_database", trace);
+  return ok;
+}
+
+/**
+ * File holding the sealed record of the entry, which is the one of its shard
+ * for entries merged from all shards.
+ */
+static FILE *entry_source(Entries *entries, Entry *entry) {
+  return entries->shards ? entries->shards[entry->shard].source
+                         : entries->source;
+}
+
+static unsigned char entry_compression(Entries *entries, Entry *entry) {
+  return entries->shards ? entries->shards[entry->shard].compression
+                         : entries->compression;
+}
+
+/**
+ * Opens the sealed password record of the entry, unless already done.
+ */
+bool read_entry(VaultKey *key, Entries *entries, int entry_idx) {
+  Entry *entry = &entries->items[entry_idx];
+  if (entry->password) {
+    return true;
+  }
+
+  FILE *source = entry_source(entries, entry);
+  if (!entry->sealed || !source ||
+      entry->record_length < CRYPTO_SEAL_OVERHEAD) {
+    last_error = ERR_DB_CORRUPT;
+    return false;
+  }
+
+  uint64_t trace = trace_begin();
+  unsigned char *sealed = malloc(entry->record_length);
+  if (!sealed) {
+    last_error = ERR_OUT_OF_MEMORY;
+  }
+
+  // records are bound to their identifier
+  unsigned char *password;
+  size_t password_len;
+  bool ok = sealed && fseek(source, entry->record_offset, SEEK_SET) == 0 &&
+            fread(sealed, 1, entry->record_length, source) ==
+                entry->record_length &&
+            open_record(key, entries, entry_compression(entries, entry),
+                        (unsigned char *)entry->identifier,
+                        entry->identifier_length, sealed,
+                        entry->record_length, &password, &password_len);
+  free(sealed);
+  trace_end("read_entry", trace);
+
+  if (!ok) {
+    if (last_error != ERR_OUT_OF_MEMORY) {
+      last_error = ERR_DB_CORRUPT;
+    }
+
+    return false;
+  }
+
+  entry->password = (char *)password;
+  return true;
+}
+
+static int compare_identifiers(const void *a, const void *b) {
+  const Entry *first = *(const Entry **)a;
+  const Entry *second = *(const Entry **)b;
+  size_t length = first->identifier_length < second->identifier_length
+                      ? first->identifier_length
+                      : second->identifier_length;
+  int order = memcmp(first->identifier, second->identifier, length);
+  if (order != 0) {
+    return order;
+  }
+
+  return first->identifier_length < second->identifier_length   ? -1
+         : first->identifier_length > second->identifier_length ? 1
+                                                                 : 0;
+}
+
+/**
+ * Encodes a password or journal record for a database with the given
+ * compression, into a buffer which is to be wiped and freed.
+ */
+static bool encode_data(unsigned char compression, const unsigned char *data,
+                        size_t data_len, unsigned char **encoded,
+                        size_t *encoded_len) {
+  unsigned char *buffer = malloc(compress_bound(compression, data_len) + 1);
+  if (!buffer) {
+    last_error = ERR_OUT_OF_MEMORY;
+    return false;
+  }
+
+  if (!compress_encode(compression, data, data_len, buffer, encoded_len)) {
+    free(buffer);
+    return false;
+  }
+
+  *encoded = buffer;
+  return true;
+}
+
+/**
+ * Seals the password of an entry, encoded for a database with the given
+ * compression, into a record of record_length bytes.
+ */
+static bool seal_password(VaultKey *key, unsigned char compression,
+                          Entry *entry, uint32_t record_length,
+                          unsigned char *record) {
+  unsigned char *encoded;
+  size_t encoded_len;
+  if (!encode_data(compression, (unsigned char *)entry->password,
+                   strlen(entry->password), &encoded, &encoded_len)) {
+    return false;
+  }
+
+  // the length was planned with the same encoding
+  bool ok = encoded_len + CRYPTO_SEAL_OVERHEAD == record_length;
+  if (!ok) {
+    last_error = ERR_DB_CORRUPT;
+  }
+
+  ok = ok && crypto_seal(key, (unsigned char *)entry->identifier,
+                         entry->identifier_length, encoded, encoded_len,
+                         record);
+
+  OPENSSL_cleanse(encoded, encoded_len);
+  free(encoded);
+  return ok;
+}
+
+/**
+ * Unchanged records are copied over from the source file as they are, only
+ * new or changed passwords are sealed.
+ */
+static bool write_record(VaultKey *key, Entries *entries, Entry *entry,
+                         uint32_t record_length, FILE *db) {
+  unsigned char *record = malloc(record_length);
+  if (!record) {
+    last_error = ERR_OUT_OF_MEMORY;
+    return false;
+  }
+
+  bool ok;
+  if (entry->sealed) {
+    FILE *source = entry_source(entries, entry);
+    ok = source && fseek(source, entry->record_offset, SEEK_SET) == 0 &&
+         fread(record, 1, record_length, source) == record_length;
+    if (!ok) {
+      last_error = ERR_DB_CORRUPT;
+    }
+  } else {
+    ok = seal_password(key, entries->compression, entry, record_length,
+                       record);
+  }
+
+  if (ok && fwrite(record, 1, record_length, db) != record_length) {
+    last_error = ERR_DB_OPEN_FAILED;
+    ok = false;
+  }
+
+  free(record);
+  return ok;
+}
+
+/**
+ * Writes header and sealed index of the sorted entries to db.
+ */
+static bool write_index(VaultKey *key, unsigned char compression,
+                        Entry **sorted, uint64_t *offsets, uint32_t *lengths,
+                        int count, unsigned char *snapshot_id, FILE *db) {
+  unsigned char *index;
+  size_t index_len;
+  if (!payload_serialize_index(sorted, offsets, lengths, count, &index,
+                               &index_len)) {
+    return false;
+  }
+
+  unsigned char header[VAULT_HEADER_LENGTH];
+  size_t sealed_len = index_len + CRYPTO_SEAL_OVERHEAD;
+  build_header(key, sealed_len, compression, header);
+
+  unsigned char *sealed = malloc(sealed_len);
+  bool ok = sealed && crypto_seal(key, header, VAULT_HEADER_LENGTH, index,
+                                  index_len, sealed);
+  if (!sealed) {
+    last_error = ERR_OUT_OF_MEMORY;
+  }
+
+  bool written = ok &&
+                 fwrite(header, 1, VAULT_HEADER_LENGTH, db) ==
+                     VAULT_HEADER_LENGTH &&
+                 fwrite(sealed, 1, sealed_len, db) == sealed_len;
+  if (ok && !written) {
+    last_error = ERR_DB_OPEN_FAILED;
+    ok = false;
+  }
+
+  if (ok) {
+    memcpy(snapshot_id, sealed + sealed_len - ENTRIES_SNAPSHOT_ID_LENGTH,
+           ENTRIES_SNAPSHOT_ID_LENGTH);
+  }
+
+  OPENSSL_cleanse(index, index_len);
+  free(index);
+  free(sealed);
+  return ok;
+}
+
+/**
+ * Writes header, sealed index and records of the sorted entries to db.
+ */
+static bool write_database(VaultKey *key, Entries *entries, Entry **sorted,
+                           uint64_t *offsets, uint32_t *lengths, int count,
+                           unsigned char *snapshot_id, FILE *db) {
+  bool ok = write_index(key, entries->compression, sorted, offsets, lengths,
+                        count, snapshot_id, db);
+
+  for (int i = 0; ok && i < count; i++) {
+    ok = write_record(key, entries, sorted[i], lengths[i], db);
+  }
+
+  return ok;
+}
+
+/**
+ * Writes the sorted entries to a new database file at path, flushed to the
+ * disk.
+ */
+static bool write_file(VaultKey *key, Entries *entries, Entry **sorted,
+                       uint64_t *offsets, uint32_t *lengths, int count,
+                       unsigned char *snapshot_id, char *path) {
+  FILE *db = fopen(path, "wb");
+  bool ok = db != NULL;
+  if (!ok) {
+    last_error = ERR_DB_OPEN_FAILED;
+  }
+
+  ok = ok && write_database(key, entries, sorted, offsets, lengths, count,
+                            snapshot_id, db);
+  if (ok && !sync_file(db)) {
+    last_error = ERR_DB_OPEN_FAILED;
+    ok = false;
+  }
+
+  if (db && fclose(db) != 0 && ok) {
+    last_error = ERR_DB_OPEN_FAILED;
+    ok = false;
+  }
+
+  if (!ok && db) {
+    remove(path);
+  }
+
+  return ok;
+}
+
+/**
+ * Appends the pending changes to the journal as a single record, starting a
+ * new journal if the current one belongs to an older database.
+ */
+static bool append_journal(VaultKey *key, char *db_path, Entries *entries,
+                           unsigned char *plain, size_t plain_len) {
+  char journal_path[FS_MAX_PATH_LENGTH + 8];
+  get_journal_path(db_path, journal_path);
+
+  size_t sealed_len = plain_len + CRYPTO_SEAL_OVERHEAD;
+  unsigned char *record = malloc(4 + sealed_len);
+  if (!record) {
+    last_error = ERR_OUT_OF_MEMORY;
+    return false;
+  }
+
+  unsigned char aad[JOURNAL_AAD_LENGTH];
+  journal_aad(entries, entries->journal_records, aad);
+  write_u32(record, sealed_len);
+
+  bool ok = crypto_seal(key, aad, JOURNAL_AAD_LENGTH, plain, plain_len,
+                        record + 4);
+
+  bool fresh = entries->journal_records == 0;
+  FILE *journal = ok ? fopen(journal_path, fresh ? "wb" : "ab") : NULL;
+  if (ok && !journal) {
+    last_error = ERR_DB_OPEN_FAILED;
+    ok = false;
+  }
+
+  if (ok && fresh) {
+    unsigned char header[JOURNAL_HEADER_LENGTH];
+    memcpy(header, JOURNAL_MAGIC, JOURNAL_MAGIC_LENGTH);
+    memcpy(header + JOURNAL_MAGIC_LENGTH, entries->snapshot_id,
+           ENTRIES_SNAPSHOT_ID_LENGTH);
+    ok = fwrite(header, 1, JOURNAL_HEADER_LENGTH, journal) ==
+         JOURNAL_HEADER_LENGTH;
+  }
+
+  ok = ok && fwrite(record, 1, 4 + sealed_len, journal) == 4 + sealed_len &&
+       sync_file(journal);
+  if (journal && fclose(journal) != 0) {
+    ok = false;
+  }
+
+  if (journal && !ok) {
+    last_error = ERR_DB_OPEN_FAILED;
+  }
+
+  free(record);
+
+  if (ok && fresh) {
+    sync_directory(db_path);
+  }
+
+  if (ok) {
+    entries->journal_length =
+        (fresh ? JOURNAL_HEADER_LENGTH : entries->journal_length) + 4 +
+        sealed_len;
+    entries->journal_records++;
+  }
+
+  return ok;
+}
+
+/**
+ * Lists all entries, to be sorted by plan_records.
+ */
+static Entry **list_entries(Entries *entries) {
+  Entry **listed = malloc(entries->count * sizeof(Entry *) + 1);
+  if (!listed) {
+    last_error = ERR_OUT_OF_MEMORY;
+    return NULL;
+  }
+
+  for (int i = 0; i < entries->count; i++) {
+    listed[i] = &entries->items[i];
+  }
+
+  return listed;
+}
+
+/**
+ * Length of the record of an entry in a database with the given compression,
+ * for which passwords not sealed yet have to be encoded.
+ */
+static bool planned_length(unsigned char compression, Entry *entry,
+                           uint32_t *length) {
+  if (entry->sealed) {
+    *length = entry->record_length;
+    return true;
+  }
+
+  size_t password_len = strlen(entry->password);
+  if (compression == COMPRESS_NONE) {
+    *length = password_len + CRYPTO_SEAL_OVERHEAD;
+    return true;
+  }
+
+  unsigned char *encoded;
+  size_t encoded_len;
+  if (!encode_data(compression, (unsigned char *)entry->password,
+                   password_len, &encoded, &encoded_len)) {
+    return false;
+  }
+
+  OPENSSL_cleanse(encoded, encoded_len);
+  free(encoded);
+  *length = encoded_len + CRYPTO_SEAL_OVERHEAD;
+  return true;
+}
+
+/**
+ * Sorts the entries by identifier and lays their records out in that order,
+ * right after the index, which is where the next version of the database
+ * keeps them.
+ */
+static bool plan_records(Entry **sorted, int count, unsigned char compression,
+                         uint64_t **offsets_out, uint32_t **lengths_out) {
+  uint64_t *offsets = malloc(count * sizeof(uint64_t) + 1);
+  uint32_t *lengths = malloc(count * sizeof(uint32_t) + 1);
+
+  if (!offsets || !lengths) {
+    free(offsets);
+    free(lengths);
+    last_error = ERR_OUT_OF_MEMORY;
+    return false;
+  }
+
+  size_t index_len = payload_index_length(sorted, count);
+  uint64_t offset = VAULT_HEADER_LENGTH + index_len + CRYPTO_SEAL_OVERHEAD;
+
+  qsort(sorted, count, sizeof(Entry *), compare_identifiers);
+
+  for (int i = 0; i < count; i++) {
+    if (!planned_length(compression, sorted[i], &lengths[i])) {
+      free(offsets);
+      free(lengths);
+      return false;
+    }
+
+    offsets[i] = offset;
+    offset += lengths[i];
+  }
+
+  *offsets_out = offsets;
+  *lengths_out = lengths;
+  return true;
+}
+
+/**
+ * The database is written to a temporary file first, which is flushed to the
+ * disk and then replaces the previous version together with the journal.
+ * Afterwards the entries refer to the new file.
+ */
+static bool compact_database(VaultKey *key, char *db_path, Entries *entries) {
+  int count = entries->count;
+  Entry **sorted = list_entries(entries);
+  uint64_t *offsets;
+  uint32_t *lengths;
+  if (!sorted || !plan_records(sorted, count, entries->compression, &offsets,
+                               &lengths)) {
+    free(sorted);
+    return false;
+  }
+
+  char temp_path[FS_MAX_PATH_LENGTH + 4];
+  sprintf(temp_path, "%s.tmp", db_path);
+
+  unsigned char snapshot_id[ENTRIES_SNAPSHOT_ID_LENGTH];
+  bool ok = write_file(key, entries, sorted, offsets, lengths, count,
+                       snapshot_id, temp_path) &&
+            replace_file(temp_path, db_path);
+
+  // records now live in the new file
+  for (int i = 0; ok && i < count; i++) {
+    sorted[i]->sealed = true;
+    sorted[i]->record_offset = offsets[i];
+    sorted[i]->record_length = lengths[i];
+  }
+
+  if (ok) {
+    if (entries->source) {
+      fclose(entries->source);
+    }
+
+    entries->source = fopen(db_path, "rb");
+
+    // the journal no longer matches the database, so a crash before it is
+    // removed does no harm
+    char journal_path[FS_MAX_PATH_LENGTH + 8];
+    get_journal_path(db_path, journal_path);
+    remove(journal_path);
+
+    memcpy(entries->snapshot_id, snapshot_id, ENTRIES_SNAPSHOT_ID_LENGTH);
+    entries->journal_records = 0;
+    entries->journal_length = 0;
+    entries_clear_changes(entries);
+  }
+
+  free(sorted);
+  free(offsets);
+  free(lengths);
+  return ok;
+}
+
+/**
+ * Small changes to a database in the current format only go to the journal;
+ * everything else rewrites the database.
+ */
+static bool write_changes(VaultKey *key, char *db_path, Entries *entries) {
+  if (entries->source && entries->change_count > 0 &&
+      entries->journal_records < JOURNAL_MAX_RECORDS) {
+    unsigned char *plain, *record;
+    size_t plain_len, record_len;
+    if (!payload_serialize_changes(entries, &plain, &plain_len)) {
+      return false;
+    }
+
+    bool encoded = encode_data(entries->compression, plain, plain_len,
+                               &record, &record_len);
+    OPENSSL_cleanse(plain, plain_len);
+    free(plain);
+
+    if (!encoded) {
+      return false;
+    }
+
+    bool ok = true, journaled = false;
+    if (entries->journal_length + record_len <= JOURNAL_MAX_LENGTH) {
+      uint64_t trace = trace_begin();
+      ok = append_journal(key, db_path, entries, record, record_len);
+      trace_end("journal_append", trace);
+      journaled = true;
+    }
+
+    OPENSSL_cleanse(record, record_len);
+    free(record);
+
+    if (journaled) {
+      if (ok) {
+        entries_clear_changes(entries);
+      }
+
+      return ok;
+    }
+  }
+
+  uint64_t trace = trace_begin();
+  bool ok = compact_database(key, db_path, entries);
+  trace_end("compact", trace);
+  return ok;
+}
+
+/**
+ * Applies the pending changes of entries to target and logs them there to be
+ * written, all of them without a manifest, or only those of one shard.
+ */
+static bool apply_changes(Entries *entries, Manifest *manifest, int shard,
+                          Entries *target) {
+  bool ok = true;
+  for (int i = 0; ok && i < entries->change_count; i++) {
+    EntryChange *change = &entries->changes[i];
+    if (manifest && shard_of(manifest, change->identifier) != shard) {
+      continue;
+    }
+
+    EntryChange copy = *change;
+    copy.identifier = arena_strndup(&target->arena, change->identifier,
+                                    strlen(change->identifier));
+    copy.password = change->password
+                        ? arena_strndup(&target->arena, change->password,
+                                        strlen(change->password))
+                        : NULL;
+
+    ok = copy.identifier && (copy.password || !change->password) &&
+         entries_apply_change(target, &copy) &&
+         entries_log_change(target, &copy);
+  }
+
+  return ok;
+}
+
+/**
+ * Someone else saved the database since the entries were read: start over
+ * from the latest version and apply the pending changes to it again, so that
+ * neither writer loses an update.
+ */
+static bool rebase_changes(VaultKey *key, char *db_path, Entries *entries) {
+  Entries latest;
+  if (!load_database(key, db_path, &latest)) {
+    return false;
+  }
+
+  if (!apply_changes(entries, NULL, 0, &latest)) {
+    entries_free(&latest);
+    return false;
+  }
+
+  entries_free(entries);
+  *entries = latest;
+  return true;
+}
+
+/**
+ * Reads length bytes at offset without moving a position shared with other
+ * workers.
+ */
+static bool read_at(int fd, unsigned char *buffer, size_t length,
+                    uint64_t offset) {
+#ifdef _WIN32
+  // workers do not run in parallel here, see rekey_database
+  return _lseeki64(fd, offset, SEEK_SET) >= 0 &&
+         _read(fd, buffer, length) == (int)length;
+#else
+  while (length > 0) {
+    ssize_t count = pread(fd, buffer, length, offset);
+    if (count <= 0) {
+      return false;
+    }
+
+    buffer += count;
+    length -= count;
+    offset += count;
+  }
+
+  return true;
+#endif
+}
+
+static bool write_at(int fd, const unsigned char *buffer, size_t length,
+                     uint64_t offset) {
+#ifdef _WIN32
+  return _lseeki64(fd, offset, SEEK_SET) >= 0 &&
+         _write(fd, buffer, length) == (int)length;
+#else
+  while (length > 0) {
+    ssize_t count = pwrite(fd, buffer, length, offset);
+    if (count <= 0) {
+      return false;
+    }
+
+    buffer += count;
+    length -= count;
+    offset += count;
+  }
+
+  return true;
+#endif
+}
+
+// state shared by the workers sealing the records with the new key
+typedef struct RekeyJob {
+  VaultKey *key;
+  VaultKey *new_key;
+  Entry **sorted;
+  uint64_t *offsets;
+  uint32_t *lengths;
+  uint32_t max_length;
+  int count;
+  unsigned char compression;
+  int source;
+  int target;
+  // records an interrupted rekey already sealed are kept
+  bool resume;
+  atomic_int next;
+  atomic_bool failed;
+  atomic_int error;
+} RekeyJob;
+
+/**
+ * Seals the password of a single record with the new key and writes it to
+ * its place in the new file.
+ */
+static bool rekey_record(RekeyJob *job, int record, unsigned char *sealed,
+                         unsigned char *plain) {
+  Entry *entry = job->sorted[record];
+  uint32_t length = job->lengths[record];
+  unsigned char *identifier = (unsigned char *)entry->identifier;
+  size_t identifier_len = entry->identifier_length;
+
+  if (job->resume &&
+      read_at(job->target, sealed, length, job->offsets[record]) &&
+      crypto_open(job->new_key, identifier, identifier_len, sealed, length,
+                  plain)) {
+    return true;
+  }
+
+  // changes from the journal are not sealed yet
+  if (entry->password) {
+    if (!seal_password(job->new_key, job->compression, entry, length,
+                       sealed)) {
+      atomic_store(&job->error, last_error);
+      return false;
+    }
+  } else if (job->source < 0 ||
+             !read_at(job->source, sealed, length, entry->record_offset) ||
+             !crypto_open(job->key, identifier, identifier_len, sealed,
+                          length, plain)) {
+    atomic_store(&job->error, ERR_DB_CORRUPT);
+    return false;
+  } else if (!crypto_seal(job->new_key, identifier, identifier_len, plain,
+                          length - CRYPTO_SEAL_OVERHEAD, sealed)) {
+    atomic_store(&job->error, ERR_CRYPTO);
+    return false;
+  }
+
+  // sealed records keep their encoding, so their length stays the same
+  if (!write_at(job->target, sealed, length, job->offsets[record])) {
+    atomic_store(&job->error, ERR_DB_OPEN_FAILED);
+    return false;
+  }
+
+  return true;
+}
+
+/**
+ * Workers take the records in batches until none are left or one of them
+ * failed.
+ */
+static void rekey_records(void *context, int worker) {
+  (void)worker;
+  RekeyJob *job = context;
+
+  unsigned char *sealed = malloc(job->max_length);
+  unsigned char *plain = malloc(job->max_length);
+  if (!sealed || !plain) {
+    atomic_store(&job->error, ERR_OUT_OF_MEMORY);
+    atomic_store(&job->failed, true);
+  }
+
+  while (!atomic_load(&job->failed)) {
+    int first = atomic_fetch_add(&job->next, REKEY_BATCH);
+    int last = first + REKEY_BATCH < job->count ? first + REKEY_BATCH
+                                                : job->count;
+
+    for (int i = first; i < last; i++) {
+      if (!rekey_record(job, i, sealed, plain)) {
+        atomic_store(&job->failed, true);
+        break;
+      }
+    }
+
+    if (last >= job->count) {
+      break;
+    }
+  }
+
+  if (plain) {
+    OPENSSL_cleanse(plain, job->max_length);
+  }
+
+  free(sealed);
+  free(plain);
+}
+
+static bool same_kdf(KdfParams *first, KdfParams *second) {
+  return first->kdf == second->kdf && first->iterations == second->iterations &&
+         first->memory_mib == second->memory_mib &&
+         first->lanes == second->lanes;
+}
+
+/**
+ * Picks up the file of an interrupted rekey if it was started with the same
+ * master password and parameters for the same entries, deriving the new key
+ * with the salt recorded in it. Any other leftover file is removed.
+ */
+static bool resume_rekey(char *rekey_path, char *master_pwd, KdfParams *params,
+                         Entries *entries, Entry **sorted, uint64_t *offsets,
+                         uint32_t *lengths, VaultKey *new_key) {
+  FILE *partial = fopen(rekey_path, "rb");
+  if (!partial) {
+    return false;
+  }
+
+  // none of the reasons to start over is an error
+  PassError error = last_error;
+
+  unsigned char header[VAULT_HEADER_LENGTH];
+  VaultHeader parsed;
+  bool ok =
+      fread(header, 1, VAULT_HEADER_LENGTH, partial) == VAULT_HEADER_LENGTH &&
+      parse_header(header, VAULT_HEADER_LENGTH, &parsed) && !parsed.sharded &&
+      parsed.compression == entries->compression &&
+      same_kdf(&parsed.kdf, params) &&
+      crypto_derive_key(master_pwd, parsed.salt, parsed.salt_length,
+                        &parsed.kdf, false, new_key);
+
+  unsigned char *index = NULL, *sealed = NULL, *plain = NULL;
+  size_t index_len = 0;
+  ok = ok && payload_serialize_index(sorted, offsets, lengths, entries->count,
+                                     &index, &index_len);
+
+  // the same entries laid out the same way give the same index
+  size_t sealed_len = index_len + CRYPTO_SEAL_OVERHEAD;
+  ok = ok && parsed.index_length == sealed_len;
+  sealed = ok ? malloc(sealed_len) : NULL;
+  plain = ok ? malloc(index_len + 1) : NULL;
+  ok = ok && sealed && plain &&
+       fread(sealed, 1, sealed_len, partial) == sealed_len &&
+       crypto_open(new_key, header, VAULT_HEADER_LENGTH, sealed, sealed_len,
+                   plain) &&
+       memcmp(plain, index, index_len) == 0;
+
+  if (index) {
+    OPENSSL_cleanse(index, index_len);
+  }
+
+  if (plain) {
+    OPENSSL_cleanse(plain, index_len);
+  }
+
+  free(index);
+  free(sealed);
+  free(plain);
+  fclose(partial);
+
+  last_error = error;
+  if (!ok) {
+    remove(rekey_path);
+  }
+
+  return ok;
+}
+
+/**
+ * Replaces the database file with the manifest of a new layout, written to a
+ * temporary file first like the database itself.
+ */
+static bool write_manifest(VaultKey *key, char *db_path, Manifest *manifest) {
+  unsigned char header[MANIFEST_HEADER_LENGTH];
+  unsigned char sealed[MANIFEST_SEED_LENGTH + CRYPTO_SEAL_OVERHEAD];
+  build_header(key, sizeof(sealed), COMPRESS_NONE, header);
+  memcpy(header, MANIFEST_MAGIC, MANIFEST_MAGIC_LENGTH);
+  header[8] = MANIFEST_VERSION;
+  write_u32(header + VAULT_HEADER_LENGTH, manifest->shard_count);
+  write_u32(header + VAULT_HEADER_LENGTH + 4, manifest->generation);
+
+  if (!crypto_seal(key, header, MANIFEST_HEADER_LENGTH, manifest->seed,
+                   MANIFEST_SEED_LENGTH, sealed)) {
+    return false;
+  }
+
+  char temp_path[FS_MAX_PATH_LENGTH + 4];
+  sprintf(temp_path, "%s.tmp", db_path);
+
+  FILE *file = fopen(temp_path, "wb");
+  bool ok = file &&
+            fwrite(header, 1, MANIFEST_HEADER_LENGTH, file) ==
+                MANIFEST_HEADER_LENGTH &&
+            fwrite(sealed, 1, sizeof(sealed), file) == sizeof(sealed) &&
+            sync_file(file);
+  if (file && fclose(file) != 0) {
+    ok = false;
+  }
+
+  if (!ok) {
+    remove(temp_path);
+    last_error = ERR_DB_OPEN_FAILED;
+    return false;
+  }
+
+  return replace_file(temp_path, db_path);
+}
+
+/**
+ * Removes a shard together with its journal and lock file.
+ */
+static void remove_shard(char *db_path, Manifest *manifest, int shard) {
+  char shard_path[FS_MAX_PATH_LENGTH];
+  if (!get_shard_path(db_path, manifest, shard, shard_path)) {
+    return;
+  }
+
+  char path[FS_MAX_PATH_LENGTH + 8];
+  get_journal_path(shard_path, path);
+  remove(path);
+  sprintf(path, "%s.lock", shard_path);
+  remove(path);
+  remove(shard_path);
+}
+
+/**
+ * Groups the entries by the shard of the layout they belong to, or all of
+ * them into one group without shards; group i is grouped[first[i]] up to
+ * grouped[first[i + 1]].
+ */
+static bool group_entries(Entries *entries, Manifest *layout,
+                          Entry ***grouped_out, int **first_out) {
+  int groups = layout->shard_count > 0 ? layout->shard_count : 1;
+  Entry **grouped = malloc(entries->count * sizeof(Entry *) + 1);
+  int *group = malloc(entries->count * sizeof(int) + 1);
+  int *first = calloc(groups + 1, sizeof(int));
+  int *next = malloc(groups * sizeof(int));
+
+  bool ok = grouped && group && first && next;
+  if (ok) {
+    // counting sort
+    for (int i = 0; i < entries->count; i++) {
+      group[i] = layout->shard_count > 0
+                     ? shard_of(layout, entries->items[i].identifier)
+                     : 0;
+      first[group[i] + 1]++;
+    }
+
+    for (int i = 1; i <= groups; i++) {
+      first[i] += first[i - 1];
+    }
+
+    memcpy(next, first, groups * sizeof(int));
+    for (int i = 0; i < entries->count; i++) {
+      grouped[next[group[i]]++] = &entries->items[i];
+    }
+  } else {
+    free(grouped);
+    free(first);
+    last_error = ERR_OUT_OF_MEMORY;
+  }
+
+  free(group);
+  free(next);
+
+  *grouped_out = ok ? grouped : NULL;
+  *first_out = ok ? first : NULL;
+  return ok;
+}
+
+/**
+ * Writes all entries to a new layout of shard_count shards, or to a single
+ * database file for none, sealed with new_key and compressed as given, or as
+ * before for -1; records are copied as they are while neither changes. The
+ * shards of the new layout belong to the next generation, so they sit next to
+ * the current files until the manifest replacing the database file switches
+ * over to them at once. The files of the previous layout are removed
+ * afterwards. The exclusive lock on the database has to be held.
+ */
+static bool rewrite_layout(VaultKey *key, VaultKey *new_key, char *db_path,
+                           int shard_count, int compression) {
+  Manifest current;
+  if (!read_manifest(key, db_path, &current)) {
+    return false;
+  }
+
+  Entries entries;
+  bool ok = current.shard_count > 0
+                ? read_shards(key, db_path, &current, false, &entries)
+                : load_database(key, db_path, &entries);
+  if (!ok) {
+    return false;
+  }
+
+  bool recode = compression >= 0 && compression != entries.compression;
+  for (int i = 0; ok && (new_key != key || recode) && i < entries.count;
+       i++) {
+    ok = read_entry(key, &entries, i);
+    entries.items[i].sealed = false;
+  }
+
+  if (recode) {
+    entries.compression = compression;
+  }
+
+  Manifest layout = {
+      .shard_count = shard_count,
+      .generation = current.generation + 1,
+  };
+  if (ok && shard_count > 0 &&
+      RAND_bytes(layout.seed, MANIFEST_SEED_LENGTH) != 1) {
+    last_error = ERR_CRYPTO;
+    ok = false;
+  }
+
+  Entry **grouped = NULL;
+  int *first = NULL;
+  ok = ok && group_entries(&entries, &layout, &grouped, &first);
+
+  char temp_path[FS_MAX_PATH_LENGTH + 4];
+  sprintf(temp_path, "%s.tmp", db_path);
+
+  int groups = shard_count > 0 ? shard_count : 1;
+  int written = 0;
+  for (; ok && written < groups; written++) {
+    char path[FS_MAX_PATH_LENGTH + 4];
+    if (shard_count > 0 && !get_shard_path(db_path, &layout, written, path)) {
+      ok = false;
+      break;
+    } else if (shard_count == 0) {
+      strcpy(path, temp_path);
+    }
+
+    Entry **sorted = grouped + first[written];
+    int count = first[written + 1] - first[written];
+    uint64_t *offsets;
+    uint32_t *lengths;
+    if (!plan_records(sorted, count, entries.compression, &offsets,
+                      &lengths)) {
+      ok = false;
+      break;
+    }
+
+    unsigned char snapshot_id[ENTRIES_SNAPSHOT_ID_LENGTH];
+    ok = write_file(new_key, &entries, sorted, offsets, lengths, count,
+                    snapshot_id, path);
+    free(offsets);
+    free(lengths);
+
+    // a journal left behind by an earlier layout does not belong to the shard
+    char journal_path[FS_MAX_PATH_LENGTH + 8];
+    get_journal_path(path, journal_path);
+    remove(journal_path);
+  }
+
+#ifdef _WIN32
+  // the database file can not be replaced while it is open
+  if (ok && entries.source) {
+    fclose(entries.source);
+    entries.source = NULL;
+  }
+#endif
+
+  if (ok) {
+    ok = shard_count > 0 ? write_manifest(new_key, db_path, &layout)
+                         : replace_file(temp_path, db_path);
+  }
+
+  entries_free(&entries);
+  free(grouped);
+  free(first);
+
+  // whichever layout lost, its files go
+  Manifest *removed = ok ? &current : &layout;
+  for (int i = 0; i < (ok ? current.shard_count : written); i++) {
+    remove_shard(db_path, removed, i);
+  }
+
+  if (ok) {
+    char journal_path[FS_MAX_PATH_LENGTH + 8];
+    get_journal_path(db_path, journal_path);
+    remove(journal_path);
+  }
+
+  return ok;
+}
+
+/**
+ * Rewrites the whole database with a new key derived from the master
+ * password, sealing the records again on all cores. They go to a separate
+ * file, which replaces the database only once complete; an interrupted rekey
+ * leaves that file behind and is resumed by the next one with the same
+ * password. The database is read while holding the lock, so that no change
+ * made in the meantime gets lost.
+ */
+bool rekey_database(VaultKey *key, char *master_pwd, KdfParams *params,
+                    VaultKey *new_key) {
+  char db_path[FS_MAX_PATH_LENGTH];
+  bool path_ok = get_db_path(db_path);
+
+  if (!path_ok) {
+    return false;
+  }
+
+  uint64_t trace = trace_begin();
+  int lock = acquire_lock(db_path, true);
+  if (lock < 0) {
+    return false;
+  }
+
+  // shards are written anew as a whole, only a single database file can be
+  // resumed
+  Manifest manifest;
+  if (!read_manifest(key, db_path, &manifest)) {
+    release_lock(lock);
+    return false;
+  }
+
+  if (manifest.shard_count > 0) {
+    bool ok = crypto_new_key(master_pwd, params, new_key) &&
+              rewrite_layout(key, new_key, db_path, manifest.shard_count, -1);
+    release_lock(lock);
+    trace_end("rekey", trace);
+    return ok;
+  }
+
+  Entries entries;
+  if (!load_database(key, db_path, &entries)) {
+    release_lock(lock);
+    return false;
+  }
+
+  Entry **sorted = list_entries(&entries);
+  uint64_t *offsets = NULL;
+  uint32_t *lengths = NULL;
+  bool ok = sorted && plan_records(sorted, entries.count, entries.compression,
+                                   &offsets, &lengths);
+
+  char rekey_path[FS_MAX_PATH_LENGTH + 8];
+  get_rekey_path(db_path, rekey_path);
+
+  bool resume = ok && resume_rekey(rekey_path, master_pwd, params, &entries,
+                                   sorted, offsets, lengths, new_key);
+  ok = ok && (resume || crypto_new_key(master_pwd, params, new_key));
+
+  FILE *db = ok ? fopen(rekey_path, resume ? "r+b" : "wb") : NULL;
+  if (ok && !db) {
+    last_error = ERR_DB_OPEN_FAILED;
+    ok = false;
+  }
+
+  unsigned char snapshot_id[ENTRIES_SNAPSHOT_ID_LENGTH];
+  if (ok && !resume) {
+    ok = write_index(new_key, entries.compression, sorted, offsets, lengths,
+                     entries.count, snapshot_id, db);
+    if (ok && fflush(db) != 0) {
+      last_error = ERR_DB_OPEN_FAILED;
+      ok = false;
+    }
+  }
+
+  if (ok) {
+    RekeyJob job = {
+        .key = key,
+        .new_key = new_key,
+        .sorted = sorted,
+        .offsets = offsets,
+        .lengths = lengths,
+        .count = entries.count,
+        .compression = entries.compression,
+        .source = entries.source ? fileno(entries.source) : -1,
+        .target = fileno(db),
+        .resume = resume,
+    };
+    atomic_init(&job.next, 0);
+    atomic_init(&job.failed, false);
+    atomic_init(&job.error, ERR_DB_OPEN_FAILED);
+
+    for (int i = 0; i < entries.count; i++) {
+      job.max_length =
+          lengths[i] > job.max_length ? lengths[i] : job.max_length;
+    }
+
+#ifdef _WIN32
+    // without positional reads and writes the workers would have to take
+    // turns anyway
+    int workers = 1;
+#else
+    int workers = parallel_workers();
+#endif
+    int batches = (entries.count + REKEY_BATCH - 1) / REKEY_BATCH;
+    workers = workers < batches ? workers : batches;
+
+    // the error is thread local and workers pass theirs back through the job,
+    // but worker 0 runs on this thread and may leave its own behind
+    PassError error = last_error;
+    uint64_t records = trace_begin();
+    parallel_run(rekey_records, &job, workers);
+    trace_end("rekey_records", records);
+
+    ok = !atomic_load(&job.failed);
+    last_error = ok ? error : (PassError)atomic_load(&job.error);
+  }
+
+  if (ok && !sync_file(db)) {
+    last_error = ERR_DB_OPEN_FAILED;
+    ok = false;
+  }
+
+  if (db && fclose(db) != 0 && ok) {
+    last_error = ERR_DB_OPEN_FAILED;
+    ok = false;
+  }
+
+#ifdef _WIN32
+  // rename does not replace existing files on Windows
+  if (ok) {
+    fclose(entries.source);
+    entries.source = NULL;
+    remove(db_path);
+  }
+#endif
+
+  if (ok && rename(rekey_path, db_path) != 0) {
+    last_error = ERR_DB_OPEN_FAILED;
+    ok = false;
+  }
+
+  if (ok) {
+    sync_directory(db_path);
+
+    // the journal was folded into the new database
+    char journal_path[FS_MAX_PATH_LENGTH + 8];
+    get_journal_path(db_path, journal_path);
+    remove(journal_path);
+  }
+
+  free(sorted);
+  free(offsets);
+  free(lengths);
+  entries_free(&entries);
+  release_lock(lock);
+  trace_end("rekey", trace);
+  return ok;
+}
+
+/**
+ * Removes what an interrupted rekey left behind, leaving the database as it
+ * was before.
+ */
+bool discard_rekey(bool *discarded) {
+  char db_path[FS_MAX_PATH_LENGTH];
+  bool path_ok = get_db_path(db_path);
+
+  if (!path_ok) {
+    return false;
+  }
+
+  int lock = acquire_lock(db_path, true);
+  if (lock < 0) {
+    return false;
+  }
+
+  char rekey_path[FS_MAX_PATH_LENGTH + 8];
+  get_rekey_path(db_path, rekey_path);
+  *discarded = remove(rekey_path) == 0;
+
+  release_lock(lock);
+  return true;
+}
+
+/**
+ * Writes the pending changes to a database file, starting over from its
+ * latest version if it changed since the entries were read.
+ */
+static bool save_file(VaultKey *key, char *db_path, Entries *entries) {
+  // a database that does not exist yet has no identity either
+  VaultIdentity current;
+  if (!vault_identity(db_path, &current)) {
+    memset(&current, 0, sizeof(VaultIdentity));
+  }
+
+  bool ok = true;
+  if (memcmp(&current, &entries->identity, sizeof(VaultIdentity)) != 0) {
+    ok = rebase_changes(key, db_path, entries);
+  }
+
+  ok = ok && write_changes(key, db_path, entries);
+  if (ok && !vault_identity(db_path, &entries->identity)) {
+    last_error = ERR_DB_OPEN_FAILED;
+    ok = false;
+  }
+
+  return ok;
+}
+
+/**
+ * Writes the pending changes of a single shard to it, or the changes of
+ * merged entries to the latest version of each shard concerned, which then
+ * takes the place of the shard the entries were merged from.
+ */
+static bool save_shard(VaultKey *key, char *db_path, Manifest *manifest,
+                       int shard, Entries *entries, Entries *written) {
+  char shard_path[FS_MAX_PATH_LENGTH];
+  if (!get_shard_path(db_path, manifest, shard, shard_path)) {
+    return false;
+  }
+
+  int lock = acquire_lock(shard_path, true);
+  if (lock < 0) {
+    return false;
+  }
+
+  bool ok;
+  if (!entries->shards && entries->shard == shard) {
+    ok = save_file(key, shard_path, entries);
+  } else {
+    entries_free(written);
+    ok = load_database(key, shard_path, written) &&
+         apply_changes(entries, manifest, shard, written) &&
+         write_changes(key, shard_path, written);
+    if (ok && !vault_identity(shard_path, &written->identity)) {
+      last_error = ERR_DB_OPEN_FAILED;
+      ok = false;
+    }
+
+    written->shard = shard;
+  }
+
+  release_lock(lock);
+  return ok;
+}
+
+/**
+ * Writes the pending changes to the shards they belong to, each under its own
+ * lock. Merged entries are brought up to date with the shards written; other
+ * entries of a different layout, which was resharded after they were read,
+ * are replaced with the last shard written.
+ */
+static bool save_shards(VaultKey *key, char *db_path, Manifest *manifest,
+                        Entries *entries) {
+  bool *touched = calloc(manifest->shard_count, sizeof(bool));
+  if (!touched) {
+    last_error = ERR_OUT_OF_MEMORY;
+    return false;
+  }
+
+  for (int i = 0; i < entries->change_count; i++) {
+    touched[shard_of(manifest, entries->changes[i].identifier)] = true;
+  }
+
+  // merged entries of this very layout keep the shards they were read from
+  VaultIdentity current;
+  bool merged = entries->shards &&
+                entries->shard_count == manifest->shard_count &&
+                vault_identity(db_path, &current) &&
+                memcmp(&current.database, &entries->identity.database,
+                       sizeof(FileIdentity)) == 0;
+
+  Entries written;
+  entries_init(&written);
+
+  bool ok = true, replaced = false;
+  for (int shard = 0; ok && shard < manifest->shard_count; shard++) {
+    if (!touched[shard]) {
+      continue;
+    }
+
+    ok = save_shard(key, db_path, manifest, shard, entries, &written);
+    if (ok && merged) {
+      entries_free(&entries->shards[shard]);
+      entries->shards[shard] = written;
+      entries_init(&written);
+    } else if (ok && written.source) {
+      replaced = true;
+    }
+  }
+
+  free(touched);
+
+  // shards written before a failure have been replaced as well
+  if (merged) {
+    if (ok) {
+      entries_clear_changes(entries);
+    }
+
+    ok = merge_shards(entries) &&
+         merged_identity(db_path, entries, &entries->identity) && ok;
+  } else if (ok && replaced) {
+    entries_free(entries);
+    *entries = written;
+    entries_init(&written);
+  }
+
+  entries_free(&written);
+  return ok;
+}
+
+/**
+ * Writes the pending changes while holding the database lock. Afterwards the
+ * entries reflect the saved database, which includes changes made by others
+ * in the meantime.
+ */
+bool save_database(VaultKey *key, Entries *entries) {
+  char db_path[FS_MAX_PATH_LENGTH];
+  bool path_ok = get_db_path(db_path);
+
+  if (!path_ok) {
+    return false;
+  }
+
+  uint64_t trace = trace_begin();
+  Manifest manifest;
+  int lock = lock_database(key, db_path, true, &manifest);
+  if (lock < 0) {
+    return false;
+  }
+
+  bool ok = manifest.shard_count > 0
+                ? save_shards(key, db_path, &manifest, entries)
+                : save_file(key, db_path, entries);
+
+  release_lock(lock);
+  trace_end("save_database", trace);
+  return ok;
+}
+
+/**
+ * Splits the database into shard_count shards, or merges it back into a
+ * single database file for none, while nobody else is using it.
+ */
+bool reshard_database(VaultKey *key, int shard_count) {
+  char db_path[FS_MAX_PATH_LENGTH];
+  bool path_ok = get_db_path(db_path);
+
+  if (!path_ok) {
+    return false;
+  }
+
+  uint64_t trace = trace_begin();
+  int lock = acquire_lock(db_path, true);
+  if (lock < 0) {
+    return false;
+  }
+
+  bool ok = rewrite_layout(key, key, db_path, shard_count, -1);
+
+  release_lock(lock);
+  trace_end("reshard", trace);
+  return ok;
+}
+
+/**
+ * Rewrites the database with all records compressed as given, keeping its
+ * layout, while nobody else is using it.
+ */
+bool compress_database(VaultKey *key, unsigned char compression) {
+  char db_path[FS_MAX_PATH_LENGTH];
+  bool path_ok = get_db_path(db_path);
+
+  if (!path_ok) {
+    return false;
+  }
+
+  uint64_t trace = trace_begin();
+  int lock = acquire_lock(db_path, true);
+  if (lock < 0) {
+    return false;
+  }
+
+  Manifest manifest;
+  bool ok = read_manifest(key, db_path, &manifest) &&
+            rewrite_layout(key, key, db_path, manifest.shard_count,
+                           compression);
+
+  release_lock(lock);
+  trace_end("compress", trace);
+  return ok;
+}
@@ -1,10 +1,44 @@
+#pragma once
+
 #include <stdbool.h>
+#include <stdint.h>
 
 #include "common.h"
+#include "crypto.h"
+#include "entries.h"
+
+#define DATABASE_MAX_SHARDS 256
+
+// what `pass stats` reports about the database file
+typedef struct DatabaseInfo {
+  bool legacy;
+  const char *kdf;
+  uint32_t iterations;
+  int memory_mib;
+  int lanes;
+  int salt_length;
+  uint32_t index_length;
+  const char *compression;
+  long long database_size;
+  long long journal_size;
+  // zero for a single database file
+  int shards;
+} DatabaseInfo;
 
 bool openssl_valid();
 bool get_db_path(char *db_path);
 bool database_exists();
-bool create_database(char *master_pwd);
-bool read_database(char *master_pwd, Lines lines, int *lines_read);
-bool save_database(char *master_pwd, Lines lines, int num_lines);
+bool database_identity(VaultIdentity *identity);
+bool database_info(DatabaseInfo *info);
+bool create_database(char *master_pwd, VaultKey *key);
+bool unlock_database(char *master_pwd, VaultKey *key);
+bool read_database(VaultKey *key, Entries *entries);
+bool read_database_for(VaultKey *key, const char *identifier,
+                       Entries *entries);
+bool read_entry(VaultKey *key, Entries *entries, int entry_idx);
+bool save_database(VaultKey *key, Entries *entries);
+bool rekey_database(VaultKey *key, char *master_pwd, KdfParams *params,
+                    VaultKey *new_key);
+bool discard_rekey(bool *discarded);
+bool reshard_database(VaultKey *key, int shard_count);
+bool compress_database(VaultKey *key, unsigned char compression);
@@ -0,0 +1,442 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "compress.h"
+#include "entries.h"
+#include "error.h"
+
+#define ENTRIES_INITIAL_CAPACITY 64
+
+// index slots hold entry positions + 1, so that zero marks an empty slot
+#define INDEX_EMPTY 0
+
+static uint32_t hash_identifier(const char *identifier, size_t length) {
+  // FNV-1a
+  uint32_t hash = 2166136261u;
+  const unsigned char *ptr = (const unsigned char *)identifier;
+  for (size_t i = 0; i < length; i++) {
+    hash = (hash ^ ptr[i]) * 16777619u;
+  }
+
+  return hash;
+}
+
+static void index_insert(Entries *entries, int entry_idx) {
+  int mask = entries->index_size - 1;
+  int slot = entries->items[entry_idx].hash & mask;
+
+  // linear probing
+  while (entries->index[slot] != INDEX_EMPTY) {
+    slot = (slot + 1) & mask;
+  }
+
+  entries->index[slot] = entry_idx + 1;
+}
+
+/**
+ * Keeps the hash table at most half full, so probe sequences stay short.
+ */
+static bool index_reserve(Entries *entries, int count) {
+  if (count * 2 <= entries->index_size) {
+    return true;
+  }
+
+  int size =
+      entries->index_size ? entries->index_size : 2 * ENTRIES_INITIAL_CAPACITY;
+  while (count * 2 > size) {
+    size *= 2;
+  }
+
+  int *index = calloc(size, sizeof(int));
+  if (!index) {
+    last_error = ERR_OUT_OF_MEMORY;
+    return false;
+  }
+
+  free(entries->index);
+  entries->index = index;
+  entries->index_size = size;
+
+  for (int i = 0; i < entries->count; i++) {
+    index_insert(entries, i);
+  }
+
+  return true;
+}
+
+/**
+ * Returns the index slot referring to entry_idx.
+ */
+static int index_slot_of(Entries *entries, int entry_idx) {
+  int mask = entries->index_size - 1;
+  int slot = entries->items[entry_idx].hash & mask;
+
+  while (entries->index[slot] != entry_idx + 1) {
+    slot = (slot + 1) & mask;
+  }
+
+  return slot;
+}
+
+/**
+ * Empties the slot and moves later members of the probe sequence back, so
+ * that no tombstones are needed.
+ */
+static void index_delete_slot(Entries *entries, int slot) {
+  int mask = entries->index_size - 1;
+  int hole = slot;
+
+  for (int next = (hole + 1) & mask; entries->index[next] != INDEX_EMPTY;
+       next = (next + 1) & mask) {
+    int home = entries->items[entries->index[next] - 1].hash & mask;
+
+    // an entry may only move back if the hole lies between its home slot
+    // and its current slot
+    bool movable = hole <= next ? (home <= hole || home > next)
+                                : (home <= hole && home > next);
+    if (movable) {
+      entries->index[hole] = entries->index[next];
+      hole = next;
+    }
+  }
+
+  entries->index[hole] = INDEX_EMPTY;
+}
+
+void entries_init(Entries *entries) {
+  arena_init(&entries->arena);
+  entries->items = NULL;
+  entries->count = 0;
+  entries->capacity = 0;
+  entries->index = NULL;
+  entries->index_size = 0;
+  memset(entries->mru, 0, sizeof(entries->mru));
+  entries->source = NULL;
+  memset(&entries->identity, 0, sizeof(VaultIdentity));
+  memset(entries->snapshot_id, 0, ENTRIES_SNAPSHOT_ID_LENGTH);
+  entries->compression = COMPRESS_NONE;
+  entries->journal_records = 0;
+  entries->journal_length = 0;
+  entries->changes = NULL;
+  entries->change_count = 0;
+  entries->change_capacity = 0;
+  entries->shard = -1;
+  entries->shards = NULL;
+  entries->shard_count = 0;
+}
+
+/**
+ * Makes room for count entries in total, so that appending them neither moves
+ * the list nor rebuilds the hash table again.
+ */
+bool entries_reserve(Entries *entries, int count) {
+  if (count > entries->capacity) {
+    Entry *items = realloc(entries->items, count * sizeof(Entry));
+    if (!items) {
+      last_error = ERR_OUT_OF_MEMORY;
+      return false;
+    }
+
+    entries->items = items;
+    entries->capacity = count;
+  }
+
+  return index_reserve(entries, count);
+}
+
+/**
+ * Appends an entry referencing the given strings, which must outlive the
+ * entry - usually they are allocated from the same arena.
+ */
+bool entries_append(Entries *entries, char *identifier, char *password) {
+  return entries_append_view(entries, identifier, strlen(identifier),
+                             password);
+}
+
+/**
+ * Appends an entry for an identifier whose length is known already, as it is
+ * for identifiers parsed from a payload.
+ */
+bool entries_append_view(Entries *entries, char *identifier,
+                         size_t identifier_length, char *password) {
+  if (entries->count == entries->capacity) {
+    int capacity = entries->capacity ? entries->capacity * 2
+                                     : ENTRIES_INITIAL_CAPACITY;
+    if (!entries_reserve(entries, capacity)) {
+      return false;
+    }
+  }
+
+  if (!index_reserve(entries, entries->count + 1)) {
+    return false;
+  }
+
+  int entry_idx = entries->count++;
+  Entry *entry = &entries->items[entry_idx];
+  entry->identifier = identifier;
+  entry->identifier_length = identifier_length;
+  entry->password = password;
+  entry->hash = hash_identifier(identifier, identifier_length);
+  entry->sealed = false;
+  entry->shard = 0;
+  entry->created = 0;
+  entry->modified = 0;
+  entry->accessed = 0;
+  entry->access_count = 0;
+
+  index_insert(entries, entry_idx);
+  return true;
+}
+
+static bool entry_matches(Entry *entry, const char *identifier, size_t length,
+                          uint32_t hash) {
+  return entry->hash == hash && entry->identifier_length == length &&
+         memcmp(entry->identifier, identifier, length) == 0;
+}
+
+/**
+ * Moves the recently found entry at position pos one place up, so that the
+ * often found ones gather at the front while the others are replaced.
+ */
+static void mru_promote(Entries *entries, int pos) {
+  if (pos == 0) {
+    return;
+  }
+
+  int entry = entries->mru[pos];
+  uint32_t hash = entries->mru_hashes[pos];
+  entries->mru[pos] = entries->mru[pos - 1];
+  entries->mru_hashes[pos] = entries->mru_hashes[pos - 1];
+  entries->mru[pos - 1] = entry;
+  entries->mru_hashes[pos - 1] = hash;
+}
+
+/**
+ * Adds an entry found in the hash table to the recently found ones, taking
+ * the first free place or else the last one.
+ */
+static void mru_insert(Entries *entries, int entry_idx) {
+  int pos = ENTRIES_MRU_SIZE - 1;
+  while (pos > 0 && entries->mru[pos - 1] == 0) {
+    pos--;
+  }
+
+  entries->mru[pos] = entry_idx + 1;
+  entries->mru_hashes[pos] = entries->items[entry_idx].hash;
+}
+
+/**
+ * Replaces the reference to entry_idx among the recently found entries with
+ * replacement_idx, or drops it if replacement_idx < 0.
+ */
+static void mru_replace(Entries *entries, int entry_idx, int replacement_idx) {
+  for (int i = 0; i < ENTRIES_MRU_SIZE; i++) {
+    if (entries->mru[i] != entry_idx + 1) {
+      continue;
+    }
+
+    if (replacement_idx >= 0) {
+      entries->mru[i] = replacement_idx + 1;
+      return;
+    }
+
+    int rest = ENTRIES_MRU_SIZE - 1 - i;
+    memmove(entries->mru + i, entries->mru + i + 1, rest * sizeof(int));
+    memmove(entries->mru_hashes + i, entries->mru_hashes + i + 1,
+            rest * sizeof(uint32_t));
+    entries->mru[ENTRIES_MRU_SIZE - 1] = 0;
+    return;
+  }
+}
+
+/**
+ * Lookups of skewed access patterns mostly end among the few recently found
+ * entries, without touching the hash table.
+ */
+int entries_find(Entries *entries, const char *identifier) {
+  if (entries->index_size == 0) {
+    return -1;
+  }
+
+  size_t length = strlen(identifier);
+  uint32_t hash = hash_identifier(identifier, length);
+
+  for (int i = 0; i < ENTRIES_MRU_SIZE && entries->mru[i]; i++) {
+    int entry_idx = entries->mru[i] - 1;
+    if (entries->mru_hashes[i] == hash &&
+        entry_matches(&entries->items[entry_idx], identifier, length, hash)) {
+      mru_promote(entries, i);
+      return entry_idx;
+    }
+  }
+
+  int mask = entries->index_size - 1;
+  for (int slot = hash & mask; entries->index[slot] != INDEX_EMPTY;
+       slot = (slot + 1) & mask) {
+    int entry_idx = entries->index[slot] - 1;
+    if (entry_matches(&entries->items[entry_idx], identifier, length, hash)) {
+      mru_insert(entries, entry_idx);
+      return entry_idx;
+    }
+  }
+
+  return -1;
+}
+
+/**
+ * Starts the recently found entries off with the most frequently used ones,
+ * so that a freshly read database has its hot entries at hand.
+ */
+void entries_rank_hot(Entries *entries) {
+  memset(entries->mru, 0, sizeof(entries->mru));
+
+  int ranked = 0;
+  for (int i = 0; i < entries->count; i++) {
+    uint32_t count = entries->items[i].access_count;
+    if (count == 0 || (ranked == ENTRIES_MRU_SIZE &&
+                       count <= entries->items[entries->mru[ranked - 1] - 1]
+                                    .access_count)) {
+      continue;
+    }
+
+    // insertion into the list, which is ordered by access count
+    int pos = ranked < ENTRIES_MRU_SIZE ? ranked++ : ranked - 1;
+    while (pos > 0 &&
+           entries->items[entries->mru[pos - 1] - 1].access_count < count) {
+      entries->mru[pos] = entries->mru[pos - 1];
+      entries->mru_hashes[pos] = entries->mru_hashes[pos - 1];
+      pos--;
+    }
+    entries->mru[pos] = i + 1;
+    entries->mru_hashes[pos] = entries->items[i].hash;
+  }
+}
+
+/**
+ * Removes the entry in constant time by moving the last entry into its place.
+ */
+void entries_remove(Entries *entries, int entry_idx) {
+  index_delete_slot(entries, index_slot_of(entries, entry_idx));
+  mru_replace(entries, entry_idx, -1);
+
+  int last_idx = --entries->count;
+  if (entry_idx != last_idx) {
+    entries->index[index_slot_of(entries, last_idx)] = entry_idx + 1;
+    entries->items[entry_idx] = entries->items[last_idx];
+    mru_replace(entries, last_idx, entry_idx);
+  }
+}
+
+/**
+ * Remembers a change to be written with the next save; the strings must live
+ * in the entries arena. Accesses to an entry which has not been saved since
+ * it was last accessed are merged into a single change.
+ */
+bool entries_log_change(Entries *entries, const EntryChange *change) {
+  if (!change->password && change->accesses > 0) {
+    for (int i = entries->change_count - 1; i >= 0; i--) {
+      EntryChange *logged = &entries->changes[i];
+      if (strcmp(logged->identifier, change->identifier) != 0) {
+        continue;
+      }
+
+      if (logged->password || logged->accesses == 0) {
+        break;
+      }
+
+      logged->time = change->time;
+      logged->accesses += change->accesses;
+      return true;
+    }
+  }
+
+  if (entries->change_count == entries->change_capacity) {
+    int capacity = entries->change_capacity ? entries->change_capacity * 2
+                                            : ENTRIES_INITIAL_CAPACITY;
+    EntryChange *changes =
+        realloc(entries->changes, capacity * sizeof(EntryChange));
+    if (!changes) {
+      last_error = ERR_OUT_OF_MEMORY;
+      return false;
+    }
+
+    entries->changes = changes;
+    entries->change_capacity = capacity;
+  }
+
+  entries->changes[entries->change_count++] = *change;
+  return true;
+}
+
+void entries_clear_changes(Entries *entries) { entries->change_count = 0; }
+
+/**
+ * Removes all entries, keeping the storage for the next ones.
+ */
+void entries_clear(Entries *entries) {
+  entries->count = 0;
+  memset(entries->mru, 0, sizeof(entries->mru));
+  if (entries->index) {
+    memset(entries->index, 0, entries->index_size * sizeof(int));
+  }
+}
+
+/**
+ * Applies a logged change, replacing or adding the entry, removing it when
+ * there is no password, or counting the accesses to it; the strings must live
+ * in the entries arena.
+ */
+bool entries_apply_change(Entries *entries, const EntryChange *change) {
+  int entry_idx = entries_find(entries, change->identifier);
+  Entry *entry = entry_idx >= 0 ? &entries->items[entry_idx] : NULL;
+
+  if (!change->password && change->accesses > 0) {
+    if (entry) {
+      entry->accessed =
+          change->time > entry->accessed ? change->time : entry->accessed;
+      entry->access_count += change->accesses;
+    }
+
+    return true;
+  }
+
+  if (!change->password) {
+    if (entry) {
+      entries_remove(entries, entry_idx);
+    }
+
+    return true;
+  }
+
+  if (!entry) {
+    if (!entries_append(entries, change->identifier, change->password)) {
+      return false;
+    }
+
+    entry = &entries->items[entries->count - 1];
+    entry->created = change->time;
+  }
+
+  entry->password = change->password;
+  entry->sealed = false;
+  entry->modified = change->time;
+  return true;
+}
+
+void entries_free(Entries *entries) {
+  arena_free(&entries->arena);
+  free(entries->items);
+  free(entries->index);
+  free(entries->changes);
+
+  if (entries->source) {
+    fclose(entries->source);
+  }
+
+  for (int i = 0; i < entries->shard_count; i++) {
+    entries_free(&entries->shards[i]);
+  }
+  free(entries->shards);
+
+  entries_init(entries);
+}
@@ -0,0 +1,102 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "arena.h"
+
+#define ENTRIES_SNAPSHOT_ID_LENGTH 16
+// recently found entries, which lookups check before the hash table
+#define ENTRIES_MRU_SIZE 8
+
+typedef struct FileIdentity {
+  unsigned long long inode;
+  long long size;
+  long long mtime_sec;
+  long mtime_nsec;
+} FileIdentity;
+
+// identifies a particular version of the database file and its journal
+typedef struct VaultIdentity {
+  FileIdentity database;
+  FileIdentity journal;
+} VaultIdentity;
+
+typedef struct Entry {
+  char *identifier;
+  // NULL until the sealed record has been opened
+  char *password;
+  uint32_t hash;
+  // location of the sealed record within the source database file, valid as
+  // long as the password has not been changed
+  bool sealed;
+  // shard holding the record, when the entries of all shards are merged
+  uint16_t shard;
+  uint64_t record_offset;
+  uint32_t record_length;
+  // known from the payload the identifier was parsed from, so that it is
+  // never measured again
+  uint32_t identifier_length;
+  // usage, in seconds since the epoch, or 0 when unknown
+  uint32_t created;
+  uint32_t modified;
+  uint32_t accessed;
+  uint32_t access_count;
+} Entry;
+
+// a change that has not been written to the database yet, made at time;
+// deletions have no password, and neither have accesses, which count how
+// often the entry was used since
+typedef struct EntryChange {
+  char *identifier;
+  char *password;
+  uint32_t time;
+  uint32_t accesses;
+} EntryChange;
+
+// growable list of password entries; strings live in the arena, and an
+// open-addressing hash table maps identifiers to their position in the list
+typedef struct Entries {
+  Arena arena;
+  Entry *items;
+  int count;
+  int capacity;
+  int *index;
+  int index_size;
+  // entry positions + 1, most often found first, or 0, and their hashes
+  int mru[ENTRIES_MRU_SIZE];
+  uint32_t mru_hashes[ENTRIES_MRU_SIZE];
+  // database file the entries were read from, and the journal of changes
+  // applied on top of it
+  FILE *source;
+  VaultIdentity identity;
+  unsigned char snapshot_id[ENTRIES_SNAPSHOT_ID_LENGTH];
+  // how the records and journal of the database file are compressed
+  unsigned char compression;
+  int journal_records;
+  long journal_length;
+  EntryChange *changes;
+  int change_count;
+  int change_capacity;
+  // shard of a sharded database the entries were read from, or -1; entries
+  // merged from all shards keep each of them in shards
+  int shard;
+  struct Entries *shards;
+  int shard_count;
+} Entries;
+
+void entries_init(Entries *entries);
+bool entries_reserve(Entries *entries, int count);
+bool entries_append(Entries *entries, char *identifier, char *password);
+bool entries_append_view(Entries *entries, char *identifier,
+                         size_t identifier_length, char *password);
+int entries_find(Entries *entries, const char *identifier);
+void entries_remove(Entries *entries, int entry_idx);
+void entries_rank_hot(Entries *entries);
+bool entries_log_change(Entries *entries, const EntryChange *change);
+void entries_clear_changes(Entries *entries);
+void entries_clear(Entries *entries);
+bool entries_apply_change(Entries *entries, const EntryChange *change);
+void entries_free(Entries *entries);
@@ -2,7 +2,7 @@
 
 #include "error.h"
 
-PassError last_error;
+_Thread_local PassError last_error;
 
 void print_error() {
   switch (last_error) {
@@ -40,9 +40,45 @@ void print_error() {
                     "version 3.0.\n");
     break;
 
-  case ERR_PASSWD_INVALID:
-    fprintf(stderr, "Provided secret is invalid. It may not contain reserved "
-                    "pipe character '|'.\n");
+  case ERR_CRYPTO:
+    fprintf(stderr, "Unable to encrypt or decrypt database contents.\n");
+    break;
+
+  case ERR_AGENT:
+    fprintf(stderr, "Unable to communicate with the password agent.\n");
+    break;
+
+  case ERR_OUT_OF_MEMORY:
+    fprintf(stderr, "Out of memory.\n");
+    break;
+
+  case ERR_DB_CORRUPT:
+    fprintf(stderr, "Database file is corrupted.\n");
+    break;
+
+  case ERR_BATCH_INPUT:
+    fprintf(stderr, "Unable to read batch commands.\n");
+    break;
+
+  case ERR_TRANSFER_FILE:
+    fprintf(stderr, "Unable to read or write the import/export file.\n");
+    break;
+
+  case ERR_IMPORT_FORMAT:
+    fprintf(stderr, "Import file is malformed.\n");
+    break;
+
+  case ERR_IMPORT_CONFLICT:
+    fprintf(stderr, "Imported entry already exists in the database.\n");
+    break;
+
+  case ERR_KDF_UNSUPPORTED:
+    fprintf(stderr, "Key derivation function is not supported; Argon2id "
+                    "requires OpenSSL 3.2 or later.\n");
+    break;
+
+  case ERR_WORDLIST:
+    fprintf(stderr, "Unable to read a word list for passphrases.\n");
     break;
   }
 }
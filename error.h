@@ -7,9 +7,20 @@ typedef enum PassError {
   ERR_PASSWD_GENERATION,
   ERR_SHARED_MEM,
   ERR_OPENSSL_INVALID,
-  ERR_PASSWD_INVALID,
+  ERR_CRYPTO,
+  ERR_AGENT,
+  ERR_OUT_OF_MEMORY,
+  ERR_DB_CORRUPT,
+  ERR_BATCH_INPUT,
+  ERR_TRANSFER_FILE,
+  ERR_IMPORT_FORMAT,
+  ERR_IMPORT_CONFLICT,
+  ERR_KDF_UNSUPPORTED,
+  ERR_WORDLIST,
 } PassError;
 
-extern PassError last_error;
+// per thread, so that workers of a parallel task do not race on it; they
+// hand their error to the thread which started them
+extern _Thread_local PassError last_error;
 
 void print_error();
@@ -0,0 +1,314 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(_WIN32)
+#include <openssl/rand.h>
+#elif defined(__linux__)
+#include <errno.h>
+#include <sys/random.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "common.h"
+#include "error.h"
+#include "generator.h"
+#include "trace.h"
+
+// random bytes fetched from the kernel at a time; getentropy does not hand
+// out more than this
+#define RANDOM_POOL_SIZE 256
+
+// words of the list used for passphrases, which are easy to type
+#define WORD_MIN_LENGTH 3
+#define WORD_MAX_LENGTH 10
+#define WORDLIST_DEFAULT "/usr/share/dict/words"
+
+static const char *const CLASS_CHARACTERS[] = {
+    "abcdefghijklmnopqrstuvwxyz",
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZ",
+    "0123456789",
+    // no quotes, backslash, comma or space, which get in the way of shells
+    // and files
+    "!#$%&()*+-./:;<=>?@[]^_{|}~",
+};
+
+#define CLASS_COUNT 4
+
+/**
+ * Random bytes are fetched in bulk and handed out one by one; every byte is
+ * wiped once used, so the pool never holds a password that was generated.
+ */
+static unsigned char pool[RANDOM_POOL_SIZE];
+static size_t pool_used = RANDOM_POOL_SIZE;
+
+static bool fill_pool() {
+#if defined(_WIN32)
+  bool ok = RAND_bytes(pool, RANDOM_POOL_SIZE) == 1;
+#elif defined(__linux__)
+  size_t filled = 0;
+  while (filled < RANDOM_POOL_SIZE) {
+    ssize_t count = getrandom(pool + filled, RANDOM_POOL_SIZE - filled, 0);
+    if (count < 0 && errno != EINTR) {
+      break;
+    }
+
+    filled += count > 0 ? count : 0;
+  }
+
+  bool ok = filled == RANDOM_POOL_SIZE;
+#else
+  bool ok = getentropy(pool, RANDOM_POOL_SIZE) == 0;
+#endif
+
+  if (!ok) {
+    last_error = ERR_PASSWD_GENERATION;
+    return false;
+  }
+
+  pool_used = 0;
+  return true;
+}
+
+static bool random_bytes(unsigned char *out, size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    if (pool_used == RANDOM_POOL_SIZE && !fill_pool()) {
+      return false;
+    }
+
+    out[i] = pool[pool_used];
+    pool[pool_used++] = 0;
+  }
+
+  return true;
+}
+
+/**
+ * Draws a number below bound without bias: draws falling into the incomplete
+ * last round of the range are rejected and drawn again.
+ */
+static bool random_below(uint32_t bound, uint32_t *value) {
+  if (bound <= 256) {
+    uint32_t limit = 256 - 256 % bound;
+    unsigned char byte;
+    do {
+      if (!random_bytes(&byte, 1)) {
+        return false;
+      }
+    } while (byte >= limit);
+
+    *value = byte % bound;
+    return true;
+  }
+
+  uint32_t limit = UINT32_MAX - UINT32_MAX % bound;
+  uint32_t draw;
+  do {
+    unsigned char bytes[4];
+    if (!random_bytes(bytes, 4)) {
+      return false;
+    }
+
+    draw = (uint32_t)bytes[0] | (uint32_t)bytes[1] << 8 |
+           (uint32_t)bytes[2] << 16 | (uint32_t)bytes[3] << 24;
+    memset(bytes, 0, 4);
+  } while (draw >= limit);
+
+  *value = draw % bound;
+  return true;
+}
+
+void generator_default_policy(PasswordPolicy *policy) {
+  memset(policy, 0, sizeof(PasswordPolicy));
+  policy->length = GENERATE_DEFAULT_LENGTH;
+  policy->classes = GENERATE_LOWER | GENERATE_UPPER | GENERATE_DIGITS;
+}
+
+/**
+ * Parses character classes given as letters, l(ower), u(pper), d(igits) and
+ * s(ymbols), such as "luds".
+ */
+bool generator_classes(const char *names, unsigned *classes) {
+  *classes = 0;
+  for (const char *name = names; *name != '\0'; name++) {
+    const char *position = strchr("luds", *name);
+    if (!position) {
+      return false;
+    }
+
+    *classes |= 1u << (position - "luds");
+  }
+
+  return *classes != 0;
+}
+
+static bool usable_word(const char *word, size_t length) {
+  if (length < WORD_MIN_LENGTH || length > WORD_MAX_LENGTH) {
+    return false;
+  }
+
+  for (size_t i = 0; i < length; i++) {
+    if (word[i] < 'a' || word[i] > 'z') {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+/**
+ * Reads the word list, one word per line, keeping only short words of lower
+ * case letters; names and possessives of dictionary files are left out.
+ */
+static bool load_words(PasswordPolicy *policy) {
+  const char *path = policy->wordlist ? policy->wordlist : WORDLIST_DEFAULT;
+  FILE *file = fopen(path, "rb");
+  if (!file) {
+    last_error = ERR_WORDLIST;
+    return false;
+  }
+
+  fseek(file, 0, SEEK_END);
+  long size = ftell(file);
+  fseek(file, 0, SEEK_SET);
+
+  char *data = size >= 0 ? malloc(size + 1) : NULL;
+  bool ok = data && fread(data, 1, size, file) == (size_t)size;
+  fclose(file);
+
+  if (!ok) {
+    free(data);
+    last_error = data ? ERR_WORDLIST : ERR_OUT_OF_MEMORY;
+    return false;
+  }
+
+  data[size] = '\n';
+
+  // at most one word per two bytes
+  char **words = malloc((size / 2 + 1) * sizeof(char *));
+  if (!words) {
+    free(data);
+    last_error = ERR_OUT_OF_MEMORY;
+    return false;
+  }
+
+  int count = 0;
+  for (char *line = data, *end = data + size; line <= end;) {
+    char *newline = memchr(line, '\n', end - line + 1);
+    size_t length = newline - line;
+    if (length > 0 && line[length - 1] == '\r') {
+      length--;
+    }
+
+    if (usable_word(line, length)) {
+      line[length] = '\0';
+      words[count++] = line;
+    }
+
+    line = newline + 1;
+  }
+
+  // a list this short makes for guessable passphrases
+  if (count < 2) {
+    free(words);
+    free(data);
+    last_error = ERR_WORDLIST;
+    return false;
+  }
+
+  policy->word_data = data;
+  policy->words = words;
+  policy->word_count = count;
+  return true;
+}
+
+static bool generate_passphrase(PasswordPolicy *policy, char *password) {
+  if (!policy->words && !load_words(policy)) {
+    return false;
+  }
+
+  char *end = password;
+  for (int i = 0; i < policy->length; i++) {
+    uint32_t word;
+    if (!random_below(policy->word_count, &word)) {
+      return false;
+    }
+
+    if (i > 0) {
+      *end++ = '-';
+    }
+
+    size_t length = strlen(policy->words[word]);
+    memcpy(end, policy->words[word], length);
+    end += length;
+  }
+
+  *end = '\0';
+  return true;
+}
+
+/**
+ * Passwords missing one of the classes are thrown away as a whole, which
+ * keeps all passwords that have every class equally likely.
+ */
+static bool generate_characters(PasswordPolicy *policy, char *password) {
+  char alphabet[128];
+  size_t alphabet_len = 0;
+  int class_count = 0;
+  for (int i = 0; i < CLASS_COUNT; i++) {
+    if (policy->classes & (1u << i)) {
+      size_t length = strlen(CLASS_CHARACTERS[i]);
+      memcpy(alphabet + alphabet_len, CLASS_CHARACTERS[i], length);
+      alphabet_len += length;
+      class_count++;
+    }
+  }
+
+  if (alphabet_len == 0 || policy->length < class_count) {
+    last_error = ERR_PASSWD_GENERATION;
+    return false;
+  }
+
+  unsigned found;
+  do {
+    found = 0;
+    for (int i = 0; i < policy->length; i++) {
+      uint32_t index;
+      if (!random_below(alphabet_len, &index)) {
+        return false;
+      }
+
+      password[i] = alphabet[index];
+      for (int c = 0; c < CLASS_COUNT; c++) {
+        if (strchr(CLASS_CHARACTERS[c], password[i])) {
+          found |= 1u << c;
+        }
+      }
+    }
+  } while (found != policy->classes);
+
+  password[policy->length] = '\0';
+  return true;
+}
+
+/**
+ * Generates a password following the policy into a buffer of
+ * PASSWD_MAX_LENGTH bytes.
+ */
+bool generate_password(PasswordPolicy *policy, char *password) {
+  uint64_t trace = trace_begin();
+  bool ok = policy->passphrase ? generate_passphrase(policy, password)
+                               : generate_characters(policy, password);
+  trace_end("generate", trace);
+  return ok;
+}
+
+void generator_policy_free(PasswordPolicy *policy) {
+  free(policy->words);
+  free(policy->word_data);
+  policy->words = NULL;
+  policy->word_data = NULL;
+  policy->word_count = 0;
+}
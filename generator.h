@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stdbool.h>
+
+// character classes of generated passwords
+#define GENERATE_LOWER 1
+#define GENERATE_UPPER 2
+#define GENERATE_DIGITS 4
+#define GENERATE_SYMBOLS 8
+
+#define GENERATE_DEFAULT_LENGTH 20
+#define GENERATE_MAX_LENGTH 128
+#define GENERATE_DEFAULT_WORDS 6
+#define GENERATE_MAX_WORDS 16
+
+// how passwords are generated: length characters drawn from the classes,
+// each of which occurs at least once, or length words from a word list
+typedef struct PasswordPolicy {
+  int length;
+  unsigned classes;
+  // passphrases only; the list is read on first use
+  bool passphrase;
+  const char *wordlist;
+  char *word_data;
+  char **words;
+  int word_count;
+} PasswordPolicy;
+
+void generator_default_policy(PasswordPolicy *policy);
+bool generator_classes(const char *names, unsigned *classes);
+bool generate_password(PasswordPolicy *policy, char *password);
+void generator_policy_free(PasswordPolicy *policy);
@@ -5,8 +5,12 @@
 #include "error.h"
 #include "inout.h"
 
+/**
+ * Options may appear anywhere; the other arguments are moved to the front of
+ * the remaining argv, in order, where they are found as args.arguments.
+ */
 InputArgs parse_command_line(int argc, char **argv) {
-  InputArgs args = {CMD_NONE, NULL};
+  InputArgs args = {CMD_NONE, NULL, {NULL}, 0, NULL, 0};
 
   if (argc < 2) {
     return args;
@@ -20,44 +24,201 @@ InputArgs parse_command_line(int argc, char **argv) {
     args.command = CMD_DEL_PASSWD;
   } else if (strcmp(argv[1], "list") == 0) {
     args.command = CMD_LIST_PASSWD;
+  } else if (strcmp(argv[1], "agent") == 0) {
+    args.command = CMD_AGENT;
+  } else if (strcmp(argv[1], "batch") == 0) {
+    args.command = CMD_BATCH;
+  } else if (strcmp(argv[1], "import") == 0) {
+    args.command = CMD_IMPORT;
+  } else if (strcmp(argv[1], "export") == 0) {
+    args.command = CMD_EXPORT;
+  } else if (strcmp(argv[1], "find") == 0) {
+    args.command = CMD_FIND;
+  } else if (strcmp(argv[1], "stats") == 0) {
+    args.command = CMD_STATS;
+  } else if (strcmp(argv[1], "tune") == 0) {
+    args.command = CMD_TUNE;
+  } else if (strcmp(argv[1], "rekey") == 0) {
+    args.command = CMD_REKEY;
+  } else if (strcmp(argv[1], "reshard") == 0) {
+    args.command = CMD_RESHARD;
+  } else if (strcmp(argv[1], "complete") == 0) {
+    args.command = CMD_COMPLETE;
+  } else if (strcmp(argv[1], "compress") == 0) {
+    args.command = CMD_COMPRESS;
   } else {
     args.command = CMD_COPY_PASSWD;
-    args.identifier = argv[1];
   }
 
-  if (argc > 2) {
-    args.identifier = argv[2];
+  int first = args.command == CMD_COPY_PASSWD ? 1 : 2;
+  int count = first;
+  for (int i = first; i < argc; i++) {
+    if (strncmp(argv[i], "--", 2) != 0) {
+      argv[count++] = argv[i];
+    } else if (args.option_count < INPUT_MAX_OPTIONS) {
+      args.options[args.option_count++] = argv[i] + 2;
+    } else {
+      args.command = CMD_NONE;
+    }
+  }
+
+  args.arguments = argv + first;
+  args.argument_count = count - first;
+  if (args.argument_count > 0) {
+    args.identifier = args.arguments[0];
   }
 
   return args;
 }
 
-bool ask_override_entry() {
-  char ok;
-  printf("Overwrite existing password in the database? (Y/N): ");
-  scanf("%c", &ok);
+/**
+ * Returns the value of the --name=value option, or NULL if not given.
+ */
+char *find_option(InputArgs *args, const char *name) {
+  size_t name_len = strlen(name);
+  for (int i = 0; i < args->option_count; i++) {
+    char *option = args->options[i];
+    if (strncmp(option, name, name_len) == 0 && option[name_len] == '=') {
+      return option + name_len + 1;
+    }
+  }
 
-  return ok == 'Y' || ok == 'y';
+  return NULL;
 }
 
-bool clipboard_copy(char *string) {
-#ifdef _WIN32
-  FILE *cpy = popen("clip", "w");
-#else
-  FILE *cpy = popen("pbcopy", "w");
-#endif
+/**
+ * Tells whether the --name flag was given.
+ */
+bool has_option(InputArgs *args, const char *name) {
+  for (int i = 0; i < args->option_count; i++) {
+    if (strcmp(args->options[i], name) == 0) {
+      return true;
+    }
+  }
+
+  return false;
+}
 
-  if (!cpy) {
-    last_error = ERR_CLIPBOARD_COPY;
-    return false;
+static char *skip_spaces(char *ptr) {
+  while (*ptr == ' ' || *ptr == '\t') {
+    ptr++;
   }
 
-  fprintf(cpy, "%s", string);
-  pclose(cpy);
-  return true;
+  return ptr;
 }
 
-void print_columns(Lines strings, int num_strings) {
+/**
+ * Cuts the next word off the line, returning NULL if there is none.
+ */
+static char *next_word(char **line) {
+  char *word = skip_spaces(*line);
+  if (*word == '\0') {
+    return NULL;
+  }
+
+  char *end = word;
+  while (*end != '\0' && *end != ' ' && *end != '\t') {
+    end++;
+  }
+
+  *line = *end != '\0' ? end + 1 : end;
+  *end = '\0';
+  return word;
+}
+
+/**
+ * Parses one line of batch input, `<command> <identifier> [password]`, where
+ * command is one of add, put, del or get and the password of put is the rest
+ * of the line. The line is split in place; lines that are not understood
+ * yield CMD_NONE.
+ */
+InputArgs parse_batch_line(char *line, char **secret) {
+  InputArgs args = {CMD_NONE, NULL, {NULL}, 0, NULL, 0};
+  *secret = NULL;
+
+  char *name = next_word(&line);
+  char *identifier = next_word(&line);
+  if (!name || !identifier) {
+    return args;
+  }
+
+  Command command = CMD_NONE;
+  if (strcmp(name, "add") == 0) {
+    command = CMD_ADD_PASSWD;
+  } else if (strcmp(name, "put") == 0) {
+    command = CMD_PUT_PASSWD;
+  } else if (strcmp(name, "del") == 0) {
+    command = CMD_DEL_PASSWD;
+  } else if (strcmp(name, "get") == 0) {
+    command = CMD_COPY_PASSWD;
+  }
+
+  // only put takes a password, which may contain spaces
+  line = skip_spaces(line);
+  if ((command == CMD_PUT_PASSWD) != (*line != '\0')) {
+    return args;
+  }
+
+  args.command = command;
+  args.identifier = identifier;
+  *secret = command == CMD_PUT_PASSWD ? line : NULL;
+  return args;
+}
+
+/**
+ * Reads a whole line of any length without the line break, or returns NULL at
+ * the end of the input.
+ */
+char *read_line(FILE *in) {
+  size_t capacity = 128, length = 0;
+  char *line = malloc(capacity);
+
+  while (line && fgets(line + length, capacity - length, in)) {
+    length += strlen(line + length);
+    if (length > 0 && line[length - 1] == '\n') {
+      break;
+    }
+
+    if (length + 1 == capacity) {
+      char *grown = malloc(capacity * 2);
+      if (grown) {
+        memcpy(grown, line, length + 1);
+      }
+
+      // the line may hold a password
+      memset(line, 0, capacity);
+      free(line);
+      line = grown;
+      capacity *= 2;
+    }
+  }
+
+  if (!line) {
+    last_error = ERR_OUT_OF_MEMORY;
+    return NULL;
+  }
+
+  if (length == 0) {
+    free(line);
+    return NULL;
+  }
+
+  while (length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r')) {
+    line[--length] = '\0';
+  }
+
+  return line;
+}
+
+bool ask_override_entry() {
+  char ok;
+  printf("Overwrite existing password in the database? (Y/N): ");
+  scanf("%c", &ok);
+
+  return ok == 'Y' || ok == 'y';
+}
+
+void print_columns(char **strings, int num_strings) {
   int col_size = num_strings < 10 ? 1 : num_strings < 20 ? 2 : 3;
   for (int i = 0; i < num_strings; i++) {
     if (col_size > 1) {
@@ -77,16 +238,50 @@ void print_columns(Lines strings, int num_strings) {
 }
 
 void print_help() {
-  printf("usage: pass <command> [identifier]\n\n");
+  printf("usage: pass <command> [identifier...]\n\n");
   printf("where command is one of the following:\n");
   printf("%8s\t%s\n", "add",
-         "Create a new, random password entry in the database with identifier");
+         "Create new, random password entries with the given identifiers "
+         "[--length=N] [--classes=luds] [--words=N] [--wordlist=FILE]");
   printf("%8s\t%s\n", "del", "Remove an existing entry from the database");
   printf("%8s\t%s\n", "put",
          "Store your own password entry under the identifier");
-  printf("%8s\t%s\n", "list", "List all entries in the database");
+  printf("%8s\t%s\n", "list",
+         "List all entries in the database [--recent] [--frequent]");
+  printf("%8s\t%s\n", "find",
+         "List entries matching a pattern, best matches first "
+         "[--match=substring|prefix|glob|fuzzy]");
+  printf("%8s\t%s\n", "agent",
+         "Keep the unlocked database in a background agent for fast access");
+  printf("%8s\t%s\n", "batch",
+         "Run add, put, del and get commands read from a file or stdin");
+  printf("%8s\t%s\n", "import",
+         "Add entries from a CSV or JSON file or stdin "
+         "[--format=csv|json] [--conflict=skip|overwrite|fail]");
+  printf("%8s\t%s\n", "export",
+         "Write all entries to a CSV or JSON file or stdout "
+         "[--format=csv|json]");
+  printf("%8s\t%s\n", "stats",
+         "Show database and key cache statistics [--format=json]");
+  printf("%8s\t%s\n", "tune",
+         "Pick the key derivation for an unlock time on this machine "
+         "[--target-ms=N] [--kdf=pbkdf2|argon2id]");
+  printf("%8s\t%s\n", "complete",
+         "Print the identifiers starting with a prefix, for shell completion");
+  printf("%8s\t%s\n", "rekey",
+         "Change the master password, resuming an interrupted change "
+         "[--abort]");
+  printf("%8s\t%s\n", "reshard",
+         "Split the database into N shard files, or merge them back into "
+         "one with 1");
+  printf("%8s\t%s\n", "compress",
+         "Compress the stored passwords with deflate, or store them as they "
+         "are with none");
   printf("\n");
   printf("If no command is given, the password associated with identifier will "
          "be copied to your clipboard.\n");
   printf("\n");
+  printf("Set PASS_TRACE=1, or PASS_TRACE=json, to print the time spent in "
+         "each phase to stderr.\n");
+  printf("\n");
 }
@@ -1,23 +1,46 @@
 #include <stdbool.h>
+#include <stdio.h>
 
 #include "common.h"
 
 typedef enum Command {
   CMD_ADD_PASSWD,
+  CMD_AGENT,
+  CMD_BATCH,
+  CMD_COMPLETE,
+  CMD_COMPRESS,
   CMD_COPY_PASSWD,
   CMD_DEL_PASSWD,
+  CMD_EXPORT,
+  CMD_FIND,
+  CMD_IMPORT,
   CMD_NONE,
   CMD_LIST_PASSWD,
   CMD_PUT_PASSWD,
+  CMD_REKEY,
+  CMD_RESHARD,
+  CMD_STATS,
+  CMD_TUNE,
 } Command;
 
+#define INPUT_MAX_OPTIONS 8
+
 typedef struct InputArgs {
   Command command;
   char *identifier;
+  // --name=value arguments
+  char *options[INPUT_MAX_OPTIONS];
+  int option_count;
+  // all arguments which are not options, starting with the identifier
+  char **arguments;
+  int argument_count;
 } InputArgs;
 
 InputArgs parse_command_line(int argc, char **argv);
+InputArgs parse_batch_line(char *line, char **secret);
+char *find_option(InputArgs *args, const char *name);
+bool has_option(InputArgs *args, const char *name);
+char *read_line(FILE *in);
 bool ask_override_entry();
-bool clipboard_copy(char *string);
-void print_columns(Lines strings, int num_strings);
+void print_columns(char **strings, int num_strings);
 void print_help();
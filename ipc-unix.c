@@ -1,3 +1,7 @@
+#include <errno.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdatomic.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/shm.h>
@@ -13,21 +17,76 @@
 #define CLEAR_CACHED_MASTER_PWD_INTERVAL 180
 #endif
 
-master_pwd_cache *get_shared_memory() {
+#define SHARED_MEMORY_PROJECT_ID 'p'
+#define IDENTIFIER_INDEX_PROJECT_ID 'i'
+
+// the identifier index is allocated with room to grow, and at least this big
+#define IDENTIFIER_INDEX_MIN_CAPACITY (64 * 1024)
+
+// a reader gives up after this many snapshots changed under it
+#define IDENTIFIER_INDEX_READ_ATTEMPTS 1000
+
+// a read is written right away after waiting this often for the cached reads
+#define CACHED_ACCESS_LOCK_ATTEMPTS 1000
+
+/**
+ * Identifiers of the unlocked database, published for shell completion; it
+ * never holds any secret. The single writer makes the sequence odd while it
+ * changes the names, so readers take consistent snapshots without locking by
+ * retrying until the sequence is even and unchanged across their copy.
+ */
+typedef struct IdentifierIndex {
+  atomic_uint sequence;
+  // process holding the sequence odd, which others take over once it is gone
+  pid_t writer;
+  uint32_t length;
+  VaultIdentity identity;
+  // identifiers, each terminated by a new line
+  char names[];
+} IdentifierIndex;
+
+static key_t shared_memory_key(int project_id) {
   char db_path[FS_MAX_PATH_LENGTH];
   bool path_ok = get_db_path(db_path);
 
   if (!path_ok) {
-    return NULL;
+    return -1;
   }
 
-  key_t key = ftok(db_path, 0);
+  // the database file is replaced on every save, so the key is derived from
+  // the directory it lives in
+  char *separator = strrchr(db_path, '/');
+  if (separator) {
+    *separator = '\0';
+  }
+
+  key_t key = ftok(separator ? db_path : ".", project_id);
   if (key < 0) {
     last_error = ERR_SHARED_MEM;
+  }
+
+  return key;
+}
+
+master_pwd_cache *get_shared_memory() {
+  key_t key = shared_memory_key(SHARED_MEMORY_PROJECT_ID);
+  if (key < 0) {
     return NULL;
   }
 
-  int shared_block_id = shmget(key, sizeof(master_pwd_cache), 0644 | IPC_CREAT);
+  int shared_block_id = shmget(key, sizeof(master_pwd_cache), 0600 | IPC_CREAT);
+
+  // a segment left behind by a version with a smaller cache can not be
+  // resized; drop it, together with the key it holds
+  if (shared_block_id < 0 && errno == EINVAL) {
+    int stale_id = shmget(key, 0, 0600);
+    if (stale_id >= 0) {
+      shmctl(stale_id, IPC_RMID, NULL);
+    }
+
+    shared_block_id = shmget(key, sizeof(master_pwd_cache), 0600 | IPC_CREAT);
+  }
+
   if (shared_block_id < 0) {
     last_error = ERR_SHARED_MEM;
     return NULL;
@@ -44,9 +103,10 @@ master_pwd_cache *get_shared_memory() {
 
 /*+
  * The master password daemon runs as a standalone process and caches the
- * correctly entered master password for up three minutes, before clearing it.
+ * key derived from the correctly entered master password for up three
+ * minutes, before clearing it.
  */
-void run_master_password_daemon(master_pwd_cache *cache) {
+void run_master_password_daemon(master_pwd_cache *cache, CacheExpiry expiry) {
   // parent
   pid_t pid = fork();
   if (pid > 0) {
@@ -65,11 +125,345 @@ void run_master_password_daemon(master_pwd_cache *cache) {
   close(STDERR_FILENO);
 
   sleep(CLEAR_CACHED_MASTER_PWD_INTERVAL);
-  memset(cache->master_password, 0, PASSWD_MAX_LENGTH);
-  cache->password_available = false;
+  expiry(cache);
+  crypto_wipe_key(&cache->key);
+  cache->key_available = false;
+  clear_identifiers();
 
   detach_shared_memory(cache);
   exit(EXIT_SUCCESS);
 }
 
 void detach_shared_memory(master_pwd_cache *cache) { shmdt(cache); }
+
+/**
+ * Makes this process the only one changing the cached reads, taking them
+ * over from a process which died halfway.
+ */
+static bool lock_accesses(master_pwd_cache *cache) {
+  int self = getpid();
+  for (int attempt = 0; attempt < CACHED_ACCESS_LOCK_ATTEMPTS; attempt++) {
+    int owner = 0;
+    if (atomic_compare_exchange_strong(&cache->accesses_owner, &owner, self)) {
+      return true;
+    }
+
+    if (kill(owner, 0) != 0 && errno == ESRCH &&
+        atomic_compare_exchange_strong(&cache->accesses_owner, &owner, self)) {
+      return true;
+    }
+
+    sched_yield();
+  }
+
+  return false;
+}
+
+static void unlock_accesses(master_pwd_cache *cache) {
+  atomic_store(&cache->accesses_owner, 0);
+}
+
+/**
+ * Keeps a read of the entry with the cached key. Returns false if it could
+ * not be kept, as the cache is full or the identifier too long, in which
+ * case the caller writes it out itself.
+ */
+bool cache_access(master_pwd_cache *cache, const char *identifier,
+                  uint32_t time) {
+  size_t length = strlen(identifier);
+  if (length >= CACHE_ACCESS_IDENTIFIER_LENGTH || !lock_accesses(cache)) {
+    return false;
+  }
+
+  // a cache left behind by a run which died halfway may be out of range
+  int count = cache->access_count;
+  count = count < 0 || count > CACHE_MAX_ACCESSES ? 0 : count;
+
+  int i = 0;
+  while (i < count && strcmp(cache->accesses[i].identifier, identifier) != 0) {
+    i++;
+  }
+
+  bool kept = i < CACHE_MAX_ACCESSES;
+  if (kept && i == count) {
+    memcpy(cache->accesses[i].identifier, identifier, length + 1);
+    cache->accesses[i].count = 0;
+    count++;
+  }
+
+  if (kept) {
+    cache->accesses[i].time = time;
+    cache->accesses[i].count++;
+  }
+
+  cache->access_count = count;
+  unlock_accesses(cache);
+  return kept;
+}
+
+/**
+ * Copies the cached reads, which stay in the cache, and returns how many
+ * there are.
+ */
+int copy_cached_accesses(master_pwd_cache *cache, CachedAccess *accesses) {
+  if (!lock_accesses(cache)) {
+    return 0;
+  }
+
+  int count = cache->access_count;
+  count = count < 0 || count > CACHE_MAX_ACCESSES ? 0 : count;
+  memcpy(accesses, cache->accesses, count * sizeof(CachedAccess));
+
+  unlock_accesses(cache);
+  return count;
+}
+
+/**
+ * Moves the cached reads the filter accepts, or all of them without one, out
+ * of the cache, so that only one write saves each of them.
+ */
+int take_cached_accesses(master_pwd_cache *cache, AccessFilter filter,
+                         void *context, CachedAccess *accesses) {
+  if (!lock_accesses(cache)) {
+    return 0;
+  }
+
+  int count = cache->access_count;
+  count = count < 0 || count > CACHE_MAX_ACCESSES ? 0 : count;
+
+  int taken = 0, kept = 0;
+  for (int i = 0; i < count; i++) {
+    CachedAccess *access = &cache->accesses[i];
+    if (!filter || filter(access->identifier, context)) {
+      accesses[taken++] = *access;
+    } else {
+      cache->accesses[kept++] = *access;
+    }
+  }
+
+  memset(&cache->accesses[kept], 0, (count - kept) * sizeof(CachedAccess));
+  cache->access_count = kept;
+  unlock_accesses(cache);
+  return taken;
+}
+
+/**
+ * Attaches the index with the given shmget id; its capacity follows from the
+ * size of the segment.
+ */
+static IdentifierIndex *attach_index(int id, int flags, size_t *capacity) {
+  struct shmid_ds info;
+  if (id < 0 || shmctl(id, IPC_STAT, &info) != 0 ||
+      info.shm_segsz < sizeof(IdentifierIndex)) {
+    return NULL;
+  }
+
+  IdentifierIndex *index = shmat(id, NULL, flags);
+  if (index == (void *)-1) {
+    return NULL;
+  }
+
+  *capacity = info.shm_segsz - sizeof(IdentifierIndex);
+  return index;
+}
+
+static int identifier_index_id() {
+  key_t key = shared_memory_key(IDENTIFIER_INDEX_PROJECT_ID);
+  return key >= 0 ? shmget(key, 0, 0600) : -1;
+}
+
+/**
+ * Attaches the identifier index for writing, creating it with at least the
+ * given capacity, or replacing it if it is smaller. Readers still attached to
+ * a replaced index keep their copy until they detach.
+ */
+static IdentifierIndex *attach_identifier_index(size_t needed,
+                                                size_t *capacity) {
+  key_t key = shared_memory_key(IDENTIFIER_INDEX_PROJECT_ID);
+  if (key < 0) {
+    return NULL;
+  }
+
+  int id = shmget(key, 0, 0600);
+  IdentifierIndex *index = attach_index(id, 0, capacity);
+  if (index && *capacity >= needed) {
+    return index;
+  }
+
+  if (index) {
+    shmdt(index);
+    shmctl(id, IPC_RMID, NULL);
+  }
+
+  size_t size = needed * 2 > IDENTIFIER_INDEX_MIN_CAPACITY
+                    ? needed * 2
+                    : IDENTIFIER_INDEX_MIN_CAPACITY;
+
+  // another writer may have won the race for a new index; a fresh segment is
+  // zeroed, which is an empty index
+  id = shmget(key, sizeof(IdentifierIndex) + size,
+              0600 | IPC_CREAT | IPC_EXCL);
+  if (id < 0 && errno == EEXIST) {
+    id = shmget(key, 0, 0600);
+  }
+
+  index = attach_index(id, 0, capacity);
+  if (index && *capacity < needed) {
+    shmdt(index);
+    return NULL;
+  }
+
+  return index;
+}
+
+/**
+ * Makes the sequence odd for this process, taking it over from a writer
+ * which died halfway. Fails if another writer is active.
+ */
+static bool begin_index_write(IdentifierIndex *index, unsigned *sequence) {
+  unsigned current = atomic_load(&index->sequence);
+  if (current & 1) {
+    if (index->writer <= 0 || kill(index->writer, 0) == 0 || errno != ESRCH) {
+      return false;
+    }
+
+    // stays odd, now held by this process
+    if (!atomic_compare_exchange_strong(&index->sequence, &current,
+                                        current + 2)) {
+      return false;
+    }
+
+    current += 1;
+  } else if (!atomic_compare_exchange_strong(&index->sequence, &current,
+                                             current + 1)) {
+    return false;
+  }
+
+  index->writer = getpid();
+  atomic_thread_fence(memory_order_release);
+  *sequence = current;
+  return true;
+}
+
+static void end_index_write(IdentifierIndex *index, unsigned sequence) {
+  index->writer = 0;
+  atomic_store_explicit(&index->sequence, sequence + 2, memory_order_release);
+}
+
+/**
+ * Publishes the identifiers of the entries, unless the index already holds
+ * this version of the database or someone else is publishing right now.
+ */
+bool publish_identifiers(Entries *entries) {
+  size_t length = 0;
+  for (int i = 0; i < entries->count; i++) {
+    length += strlen(entries->items[i].identifier) + 1;
+  }
+
+  size_t capacity;
+  IdentifierIndex *index = attach_identifier_index(length, &capacity);
+  if (!index) {
+    last_error = ERR_SHARED_MEM;
+    return false;
+  }
+
+  unsigned sequence;
+  bool current = index->length == length &&
+                 memcmp(&index->identity, &entries->identity,
+                        sizeof(VaultIdentity)) == 0;
+  if (!current && begin_index_write(index, &sequence)) {
+    char *ptr = index->names;
+    for (int i = 0; i < entries->count; i++) {
+      size_t id_length = strlen(entries->items[i].identifier);
+      memcpy(ptr, entries->items[i].identifier, id_length);
+      ptr[id_length] = '\n';
+      ptr += id_length + 1;
+    }
+
+    index->length = length;
+    index->identity = entries->identity;
+    end_index_write(index, sequence);
+  }
+
+  shmdt(index);
+  return true;
+}
+
+bool identifiers_published(VaultIdentity *identity) {
+  size_t capacity;
+  IdentifierIndex *index =
+      attach_index(identifier_index_id(), SHM_RDONLY, &capacity);
+  if (!index) {
+    return false;
+  }
+
+  bool published =
+      !(atomic_load(&index->sequence) & 1) &&
+      memcmp(&index->identity, identity, sizeof(VaultIdentity)) == 0;
+  shmdt(index);
+  return published;
+}
+
+/**
+ * Empties the index once the database is locked again.
+ */
+void clear_identifiers() {
+  size_t capacity;
+  IdentifierIndex *index = attach_index(identifier_index_id(), 0, &capacity);
+  unsigned sequence;
+  if (index && begin_index_write(index, &sequence)) {
+    memset(index->names, 0,
+           index->length <= capacity ? index->length : capacity);
+    index->length = 0;
+    memset(&index->identity, 0, sizeof(VaultIdentity));
+    end_index_write(index, sequence);
+  }
+
+  if (index) {
+    shmdt(index);
+  }
+}
+
+/**
+ * Copies a consistent snapshot of the published identifiers, each terminated
+ * by a new line, without taking any lock. Returns NULL if there is none.
+ */
+char *read_identifiers(size_t *length) {
+  size_t capacity;
+  IdentifierIndex *index =
+      attach_index(identifier_index_id(), SHM_RDONLY, &capacity);
+  if (!index) {
+    return NULL;
+  }
+
+  char *names = malloc(capacity + 1);
+  bool ok = false;
+
+  for (int attempt = 0;
+       names && !ok && attempt < IDENTIFIER_INDEX_READ_ATTEMPTS; attempt++) {
+    unsigned before =
+        atomic_load_explicit(&index->sequence, memory_order_acquire);
+    if (before & 1) {
+      sched_yield();
+      continue;
+    }
+
+    // the length may be torn while a writer is busy, but stays in bounds
+    *length = index->length <= capacity ? index->length : capacity;
+    memcpy(names, index->names, *length);
+
+    atomic_thread_fence(memory_order_acquire);
+    ok = atomic_load_explicit(&index->sequence, memory_order_relaxed) ==
+         before;
+  }
+
+  shmdt(index);
+
+  if (!ok || *length == 0) {
+    free(names);
+    return NULL;
+  }
+
+  names[*length] = '\0';
+  return names;
+}
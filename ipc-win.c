@@ -1,4 +1,5 @@
 #include <stdlib.h>
+#include <string.h>
 
 #include "ipc.h"
 
@@ -6,10 +7,35 @@ master_pwd_cache *get_shared_memory() {
   master_pwd_cache *cache =
       (master_pwd_cache *)malloc(sizeof(master_pwd_cache));
 
-  cache->password_available = false;
+  memset(cache, 0, sizeof(master_pwd_cache));
   return cache;
 }
 
-void run_master_password_daemon(master_pwd_cache *cache) { return; }
+void run_master_password_daemon(master_pwd_cache *cache, CacheExpiry expiry) {
+  return;
+}
 
 void detach_shared_memory(master_pwd_cache *cache) { free(cache); }
+
+// the cache does not outlive the run, so reads are written right away
+bool cache_access(master_pwd_cache *cache, const char *identifier,
+                  uint32_t time) {
+  return false;
+}
+
+int copy_cached_accesses(master_pwd_cache *cache, CachedAccess *accesses) {
+  return 0;
+}
+
+int take_cached_accesses(master_pwd_cache *cache, AccessFilter filter,
+                         void *context, CachedAccess *accesses) {
+  return 0;
+}
+
+bool publish_identifiers(Entries *entries) { return true; }
+
+bool identifiers_published(VaultIdentity *identity) { return true; }
+
+void clear_identifiers() { return; }
+
+char *read_identifiers(size_t *length) { return NULL; }
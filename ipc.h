@@ -1,12 +1,54 @@
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 #include "common.h"
+#include "crypto.h"
+#include "database.h"
+
+// only the derived key is cached, together with the identity of the database
+// file it was derived for; a changed file requires the master password again
+// reads of entries kept with the cached key, which the next write of the
+// database saves along with its own changes
+#define CACHE_MAX_ACCESSES 64
+#define CACHE_ACCESS_IDENTIFIER_LENGTH 128
+
+typedef struct CachedAccess {
+  char identifier[CACHE_ACCESS_IDENTIFIER_LENGTH];
+  // time of the last read
+  uint32_t time;
+  uint32_t count;
+} CachedAccess;
+
+// decides which cached reads are taken over by a write
+typedef bool (*AccessFilter)(const char *identifier, void *context);
 
 typedef struct master_pwd_cache {
-  bool password_available;
-  char master_password[PASSWD_MAX_LENGTH];
+  bool key_available;
+  VaultKey key;
+  VaultIdentity identity;
+  // reported by `pass stats`
+  unsigned long cache_hits;
+  unsigned long cache_misses;
+  uint64_t kdf_ns;
+  // process changing the cached reads, 0 while nobody does
+  atomic_int accesses_owner;
+  int access_count;
+  CachedAccess accesses[CACHE_MAX_ACCESSES];
 } master_pwd_cache;
 
+// run in the daemon before it drops the cached key
+typedef void (*CacheExpiry)(master_pwd_cache *cache);
+
 master_pwd_cache *get_shared_memory();
-void run_master_password_daemon(master_pwd_cache *cache);
+void run_master_password_daemon(master_pwd_cache *cache, CacheExpiry expiry);
 void detach_shared_memory(master_pwd_cache *cache);
+bool cache_access(master_pwd_cache *cache, const char *identifier,
+                  uint32_t time);
+int copy_cached_accesses(master_pwd_cache *cache, CachedAccess *accesses);
+int take_cached_accesses(master_pwd_cache *cache, AccessFilter filter,
+                         void *context, CachedAccess *accesses);
+bool publish_identifiers(Entries *entries);
+bool identifiers_published(VaultIdentity *identity);
+void clear_identifiers();
+char *read_identifiers(size_t *length);
@@ -1,23 +1,67 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "agent.h"
+#include "clipboard.h"
+#include "compress.h"
+#include "crypto.h"
 #include "database.h"
 #include "error.h"
+#include "generator.h"
 #include "inout.h"
 #include "ipc.h"
 #include "password.h"
+#include "search.h"
+#include "trace.h"
+#include "transfer.h"
 
-master_pwd_cache *create_initial_database();
-master_pwd_cache *ensure_master_password();
-void add_new_password(master_pwd_cache *cache, char *identifier);
-void set_user_provided_password(master_pwd_cache *cache, char *identifier);
-void delete_password(master_pwd_cache *cache, char *identifier);
-void retrieve_password(master_pwd_cache *cache, char *identifier);
-void list_passwords(master_pwd_cache *cache);
+// unlock time `pass tune` aims for if none is given
+#define TUNE_DEFAULT_TARGET_MS 500
+#define TUNE_MAX_TARGET_MS 60000
+
+master_pwd_cache *create_initial_database(VaultKey *key);
+master_pwd_cache *ensure_master_password(VaultKey *key);
+bool generate_options(InputArgs *args, PasswordPolicy *rules);
+void add_new_password(VaultKey *key, char *identifier, PasswordPolicy *rules);
+void add_new_passwords(VaultKey *key, char **identifiers, int count,
+                       PasswordPolicy *rules);
+void set_user_provided_password(VaultKey *key, char *identifier);
+void delete_password(VaultKey *key, char *identifier);
+void retrieve_password(VaultKey *key, char *identifier);
+void list_passwords(VaultKey *key, EntryOrder order);
+void print_matches(char **identifiers, int num_identifiers, char *pattern,
+                   SearchMode mode);
+void find_passwords(VaultKey *key, char *pattern, SearchMode mode);
+void start_agent(VaultKey *key);
+void run_batch(VaultKey *key, char *path, PasswordPolicy *rules);
+bool transfer_options(InputArgs *args, TransferFormat *format,
+                      ConflictPolicy *policy);
+void import_passwords(VaultKey *key, char *path, TransferFormat format,
+                      ConflictPolicy policy);
+void export_passwords(VaultKey *key, char *path, TransferFormat format);
+void show_stats(VaultKey *key, master_pwd_cache *cache, bool json);
+bool tune_options(InputArgs *args, unsigned char *kdf, uint32_t *target_ms);
+void tune_database(VaultKey *key, unsigned char kdf, uint32_t target_ms);
+void change_master_password(VaultKey *key);
+void abort_rekey();
+bool reshard_options(InputArgs *args, int *shard_count);
+bool list_options(InputArgs *args, EntryOrder *order);
+void reshard_vault(VaultKey *key, int shard_count);
+bool compress_options(InputArgs *args, unsigned char *compression);
+void compress_vault(VaultKey *key, unsigned char compression);
+void complete_identifiers(char *prefix);
+void publish_completion(Entries *entries);
+void run_agent_command(InputArgs args, PasswordPolicy *rules);
+void save_cached_accesses(master_pwd_cache *cache);
+
+// key cache of this run, which keeps the reads of entries until a write
+static master_pwd_cache *key_cache;
 
 int main(int argc, char **argv) {
+  trace_init();
   InputArgs args = parse_command_line(argc, argv);
 
   // handle invalid command-line inputs
@@ -46,57 +90,211 @@ int main(int argc, char **argv) {
     return EXIT_FAILURE;
   }
 
-  // check if identifier is in correct format
-  if (args.identifier && !check_password_identifier(args.identifier)) {
+  if (args.command == CMD_FIND && !args.identifier) {
+    print_help();
+    return EXIT_FAILURE;
+  }
+
+  // completion neither unlocks nor decrypts anything, and must be quick
+  if (args.command == CMD_COMPLETE) {
+    complete_identifiers(args.identifier ? args.identifier : "");
+    return EXIT_SUCCESS;
+  }
+
+  // check if identifier is in correct format; batch, import and export take
+  // a file name instead, and find a pattern
+  bool takes_file = args.command == CMD_BATCH || args.command == CMD_IMPORT ||
+                    args.command == CMD_EXPORT;
+  if (!takes_file && args.command != CMD_FIND && args.identifier &&
+      !check_password_identifier(args.identifier)) {
     print_error();
     return EXIT_FAILURE;
   }
 
+  // add takes any number of identifiers
+  for (int i = 1; args.command == CMD_ADD_PASSWD && i < args.argument_count;
+       i++) {
+    if (!check_password_identifier(args.arguments[i])) {
+      print_error();
+      return EXIT_FAILURE;
+    }
+  }
+
+  TransferFormat format;
+  ConflictPolicy policy;
+  SearchMode match;
+  unsigned char kdf;
+  uint32_t target_ms;
+  int shard_count;
+  unsigned char compression;
+  EntryOrder order;
+  PasswordPolicy rules;
+  if (!transfer_options(&args, &format, &policy) ||
+      !search_mode(find_option(&args, "match"), args.identifier, &match) ||
+      !tune_options(&args, &kdf, &target_ms) ||
+      !reshard_options(&args, &shard_count) ||
+      !compress_options(&args, &compression) ||
+      !list_options(&args, &order) || !generate_options(&args, &rules)) {
+    print_help();
+    return EXIT_FAILURE;
+  }
+
+  // a running agent already holds the unlocked database; bulk commands are
+  // applied to the database directly, so that they are written at once
+  bool add_many = args.command == CMD_ADD_PASSWD && args.argument_count > 1;
+  bool direct = args.command == CMD_AGENT || args.command == CMD_STATS ||
+                args.command == CMD_TUNE || args.command == CMD_REKEY ||
+                args.command == CMD_RESHARD || args.command == CMD_COMPRESS ||
+                takes_file || add_many;
+  uint64_t trace = trace_begin();
+  bool use_agent = !direct && agent_available();
+  trace_end("agent_probe", trace);
+
+  if (use_agent) {
+    run_agent_command(args, &rules);
+    generator_policy_free(&rules);
+
+    if (last_error) {
+      print_error();
+      return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+  }
+
+  // a running agent needs no master password; asking for it would cache
+  // whatever was typed, as nothing reads the database to check it
+  if (args.command == CMD_AGENT && agent_available()) {
+    printf("Agent is already running.\n");
+    generator_policy_free(&rules);
+    return EXIT_SUCCESS;
+  }
+
+  if (args.command == CMD_REKEY && has_option(&args, "abort")) {
+    abort_rekey();
+
+    if (last_error) {
+      print_error();
+      return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+  }
+
   // check for requirements - OpenSSL > 3
-  if (!openssl_valid()) {
+  trace = trace_begin();
+  bool openssl_ok = openssl_valid();
+  trace_end("openssl_valid", trace);
+
+  if (!openssl_ok) {
     print_error();
     return EXIT_FAILURE;
   }
 
-  // initialization
-  master_pwd_cache *cache =
-      database_exists() ? ensure_master_password() : create_initial_database();
+  // initialization; the key is used from a private copy, so that concurrent
+  // runs never see a half-written key in the cache
+  VaultKey key;
+  trace = trace_begin();
+  master_pwd_cache *cache = database_exists() ? ensure_master_password(&key)
+                                              : create_initial_database(&key);
+  trace_end("unlock", trace);
 
   if (!cache) {
+    crypto_wipe_key(&key);
     print_error();
     return EXIT_FAILURE;
   }
+  key_cache = cache;
 
+  trace = trace_begin();
   switch (args.command) {
   case CMD_ADD_PASSWD:
-    add_new_password(cache, args.identifier);
+    if (add_many) {
+      add_new_passwords(&key, args.arguments, args.argument_count, &rules);
+    } else {
+      add_new_password(&key, args.identifier, &rules);
+    }
     break;
 
   case CMD_PUT_PASSWD:
-    set_user_provided_password(cache, args.identifier);
+    set_user_provided_password(&key, args.identifier);
     break;
 
   case CMD_DEL_PASSWD:
-    delete_password(cache, args.identifier);
+    delete_password(&key, args.identifier);
     break;
 
   case CMD_COPY_PASSWD:
-    retrieve_password(cache, args.identifier);
+    retrieve_password(&key, args.identifier);
     break;
 
   case CMD_LIST_PASSWD:
-    list_passwords(cache);
+    list_passwords(&key, order);
+    break;
+
+  case CMD_FIND:
+    find_passwords(&key, args.identifier, match);
+    break;
+
+  case CMD_AGENT:
+    start_agent(&key);
+    break;
+
+  case CMD_BATCH:
+    run_batch(&key, args.identifier, &rules);
+    break;
+
+  case CMD_IMPORT:
+    import_passwords(&key, args.identifier, format, policy);
+    break;
+
+  case CMD_EXPORT:
+    export_passwords(&key, args.identifier, format);
+    break;
+
+  case CMD_STATS:
+    show_stats(&key, cache, format == FORMAT_JSON);
+    break;
+
+  case CMD_TUNE:
+    tune_database(&key, kdf, target_ms);
+    break;
+
+  case CMD_REKEY:
+    change_master_password(&key);
+    break;
+
+  case CMD_RESHARD:
+    reshard_vault(&key, shard_count);
+    break;
+
+  case CMD_COMPRESS:
+    compress_vault(&key, compression);
     break;
 
   default: {}
   }
+  trace_end("command", trace);
+  generator_policy_free(&rules);
 
-  // cache the master password for a while; run a daemon which will bust the
+  // cache the derived key for a while; run a daemon which will bust the
   // cache after some time
   bool pwd_ok = last_error != ERR_DB_MASTER_PWD;
-  if (!cache->password_available && pwd_ok) {
-    cache->password_available = true;
-    run_master_password_daemon(cache);
+  if (pwd_ok) {
+    // the command may have rewritten the database
+    memcpy(&cache->key, &key, sizeof(VaultKey));
+    database_identity(&cache->identity);
+
+    if (trace_total("kdf") > 0) {
+      cache->kdf_ns = trace_total("kdf");
+    }
+  }
+
+  crypto_wipe_key(&key);
+
+  if (!cache->key_available && pwd_ok) {
+    cache->key_available = true;
+    run_master_password_daemon(cache, save_cached_accesses);
   }
 
   // cleanup
@@ -110,164 +308,1210 @@ int main(int argc, char **argv) {
   return EXIT_SUCCESS;
 }
 
-master_pwd_cache *create_initial_database() {
-  char init_master_pwd[PASSWD_MAX_LENGTH];
-  obtain_master_password(init_master_pwd, true);
-  if (!create_database(init_master_pwd)) {
+master_pwd_cache *create_initial_database(VaultKey *key) {
+  char *init_master_pwd = obtain_master_password("Master password: ", true);
+  if (!init_master_pwd) {
     return NULL;
   }
 
-  printf("Database created\n");
+  bool created = create_database(init_master_pwd, key);
+  free_password(init_master_pwd);
 
-  // prepare master password cache store
-  master_pwd_cache *cache = get_shared_memory();
-  if (!cache) {
+  if (!created) {
     return NULL;
   }
 
-  // copy initial password to cache
-  memcpy(cache->master_password, init_master_pwd, PASSWD_MAX_LENGTH);
-  memset(init_master_pwd, 0, PASSWD_MAX_LENGTH);
+  printf("Database created\n");
 
-  return cache;
+  // prepare master password cache store, the initial key is copied to it
+  // once the command has completed
+  return get_shared_memory();
 }
 
-master_pwd_cache *ensure_master_password() {
+master_pwd_cache *ensure_master_password(VaultKey *key) {
   master_pwd_cache *cache = get_shared_memory();
   if (!cache) {
     return NULL;
   }
 
-  if (!cache->password_available) {
-    obtain_master_password(cache->master_password, false);
+  VaultIdentity identity;
+  if (!database_identity(&identity)) {
+    detach_shared_memory(cache);
+    return NULL;
+  }
+
+  // cached key is only good for the database file it was derived from
+  if (cache->key_available &&
+      memcmp(&cache->identity, &identity, sizeof(VaultIdentity)) == 0) {
+    memcpy(key, &cache->key, sizeof(VaultKey));
+    cache->cache_hits++;
+    return cache;
+  }
+
+  cache->cache_misses++;
+
+  char *master_pwd = obtain_master_password("Master password: ", false);
+  bool unlocked = master_pwd && unlock_database(master_pwd, key);
+  free_password(master_pwd);
+
+  if (!unlocked) {
+    detach_shared_memory(cache);
+    return NULL;
   }
 
   return cache;
 }
 
-void copy_password_to_clipboard(Line entry) {
-  Line password;
-  password_from_entry(password, entry);
+// what the process serving the clipboard inherits besides the password
+typedef struct {
+  VaultKey *key;
+  Entries *entries;
+} ClipboardSource;
+
+/**
+ * Wipes the key, the decrypted entries and the key cache from the process
+ * serving the clipboard, which keeps only its own copy of the password.
+ */
+static void release_clipboard_source(void *context) {
+  ClipboardSource *source = context;
+  if (source->key) {
+    crypto_wipe_key(source->key);
+  }
+
+  if (source->entries) {
+    entries_free(source->entries);
+  }
 
-  if (clipboard_copy(password)) {
+  if (key_cache) {
+    detach_shared_memory(key_cache);
+    key_cache = NULL;
+  }
+}
+
+/**
+ * A password which could not be copied is reported, but the command itself
+ * still succeeded. The key and entries, either of which may be NULL, are
+ * released in the process left serving the clipboard.
+ */
+void copy_password_to_clipboard(char *password, VaultKey *key,
+                                Entries *entries) {
+  ClipboardSource source = {.key = key, .entries = entries};
+  if (clipboard_copy(password, release_clipboard_source, &source)) {
     printf("Password copied to clipboard.\n");
+  } else {
+    print_error();
   }
 }
 
-void add_new_password(master_pwd_cache *cache, char *identifier) {
-  Lines entries;
-  int num_entries;
-  if (!read_database(cache->master_password, entries, &num_entries)) {
+static bool has_entry(const char *identifier, void *context) {
+  return find_password_entry(context, (char *)identifier) >= 0;
+}
+
+/**
+ * Saves the entries together with the reads of them kept in the key cache,
+ * which are then removed from it. The reads of entries the command did not
+ * read, such as those of other shards, are left for another write.
+ */
+static bool save_entries(VaultKey *key, Entries *entries) {
+  CachedAccess accesses[CACHE_MAX_ACCESSES];
+  int count =
+      key_cache ? take_cached_accesses(key_cache, has_entry, entries, accesses)
+                : 0;
+
+  for (int i = 0; i < count; i++) {
+    touch_entry(entries, find_password_entry(entries, accesses[i].identifier),
+                accesses[i].time, accesses[i].count);
+  }
+
+  return save_database(key, entries);
+}
+
+/**
+ * Keeps a read of the entry in the key cache, or logs it to be saved with the
+ * entries when the cache can not keep it.
+ */
+static bool record_access(Entries *entries, int entry_idx) {
+  uint32_t now = (uint32_t)time(NULL);
+  return (key_cache &&
+          cache_access(key_cache, entries->items[entry_idx].identifier, now)) ||
+         touch_entry(entries, entry_idx, now, 1);
+}
+
+/**
+ * Writes the reads kept in the key cache before the key is dropped, from the
+ * daemon which drops it.
+ */
+void save_cached_accesses(master_pwd_cache *cache) {
+  if (cache->access_count == 0) {
+    return;
+  }
+
+  VaultKey key;
+  memcpy(&key, &cache->key, sizeof(VaultKey));
+
+  Entries entries;
+  if (read_database(&key, &entries)) {
+    save_entries(&key, &entries);
+    entries_free(&entries);
+  }
+
+  // reads of entries deleted in the meantime
+  CachedAccess accesses[CACHE_MAX_ACCESSES];
+  take_cached_accesses(cache, NULL, NULL, accesses);
+  crypto_wipe_key(&key);
+}
+
+void add_new_password(VaultKey *key, char *identifier, PasswordPolicy *rules) {
+  Entries entries;
+  if (!read_database_for(key, identifier, &entries)) {
     return;
   }
 
   // check for existing entry and ask to override it
-  int entry_idx = find_password_entry(entries, num_entries, identifier);
+  int entry_idx = find_password_entry(&entries, identifier);
   bool entry_found = entry_idx >= 0;
 
   if (entry_found && !ask_override_entry()) {
     // can't do much if user does not confirm
+    entries_free(&entries);
     return;
   }
 
-  char new_password[PASSWD_MAX_LENGTH]; // final password is > 15 chars
-  if (!generate_random_password(new_password, 15)) {
+  // generated where the entry keeps it, which is wiped with the entries
+  char *new_password = arena_alloc(&entries.arena, PASSWD_MAX_LENGTH);
+  if (!new_password || !generate_password(rules, new_password)) {
+    entries_free(&entries);
     return;
   }
 
-  int new_entry_idx = entry_idx >= 0 ? entry_idx : num_entries++;
-  create_entry(entries[new_entry_idx], identifier, new_password);
+  int new_entry_idx =
+      create_entry(&entries, entry_idx, identifier, new_password);
 
   // save updated database
-  if (!save_database(cache->master_password, entries, num_entries)) {
+  if (new_entry_idx >= 0 && save_entries(key, &entries)) {
+    copy_password_to_clipboard(new_password, key, &entries);
+  }
+
+  publish_completion(&entries);
+  entries_free(&entries);
+}
+
+/**
+ * Generates passwords for all identifiers and saves them with a single write.
+ * Existing entries are left alone, as asking for each would defeat the
+ * purpose; the passwords are not shown, but can be copied one by one.
+ */
+void add_new_passwords(VaultKey *key, char **identifiers, int count,
+                       PasswordPolicy *rules) {
+  Entries entries;
+  if (!read_database(key, &entries)) {
     return;
   }
 
-  copy_password_to_clipboard(entries[new_entry_idx]);
+  bool *created = calloc(count, sizeof(bool));
+  bool ok = created != NULL;
+  if (!ok) {
+    last_error = ERR_OUT_OF_MEMORY;
+  }
+
+  for (int i = 0; ok && i < count; i++) {
+    if (find_password_entry(&entries, identifiers[i]) >= 0) {
+      continue;
+    }
+
+    char *new_password = arena_alloc(&entries.arena, PASSWD_MAX_LENGTH);
+    ok = new_password && generate_password(rules, new_password) &&
+         create_entry(&entries, -1, identifiers[i], new_password) >= 0;
+    created[i] = ok;
+  }
+
+  ok = ok && save_entries(key, &entries);
+
+  for (int i = 0; ok && i < count; i++) {
+    printf(created[i] ? "Entry \"%s\" created.\n"
+                      : "Entry \"%s\" already exists, skipped.\n",
+           identifiers[i]);
+  }
+
+  free(created);
+  publish_completion(&entries);
+  entries_free(&entries);
 }
 
-void set_user_provided_password(master_pwd_cache *cache, char *identifier) {
-  Lines entries;
-  int num_entries;
-  if (!read_database(cache->master_password, entries, &num_entries)) {
+void set_user_provided_password(VaultKey *key, char *identifier) {
+  Entries entries;
+  if (!read_database_for(key, identifier, &entries)) {
     return;
   }
 
   // check for existing entry and ask to override it
-  int entry_idx = find_password_entry(entries, num_entries, identifier);
+  int entry_idx = find_password_entry(&entries, identifier);
   bool entry_found = entry_idx >= 0;
 
   if (entry_found && !ask_override_entry()) {
     // can't do much if user does not confirm
+    entries_free(&entries);
     return;
   }
 
-  char new_password[PASSWD_MAX_LENGTH];
-  if (!obtain_user_password(new_password)) {
+  char *new_password = obtain_user_password();
+  if (!new_password) {
+    entries_free(&entries);
     return;
   }
 
-  int new_entry_idx = entry_idx >= 0 ? entry_idx : num_entries++;
-  create_entry(entries[new_entry_idx], identifier, new_password);
+  int new_entry_idx =
+      create_entry(&entries, entry_idx, identifier, new_password);
+  free_password(new_password);
 
   // save updated database
-  if (!save_database(cache->master_password, entries, num_entries)) {
-    return;
+  if (new_entry_idx >= 0) {
+    save_entries(key, &entries);
   }
+
+  publish_completion(&entries);
+  entries_free(&entries);
 }
 
-void delete_password(master_pwd_cache *cache, char *identifier) {
-  Lines entries;
-  int num_entries;
-  if (!read_database(cache->master_password, entries, &num_entries)) {
+void delete_password(VaultKey *key, char *identifier) {
+  Entries entries;
+  if (!read_database_for(key, identifier, &entries)) {
     return;
   }
 
   // check for existing entry
-  int entry_idx = find_password_entry(entries, num_entries, identifier);
+  int entry_idx = find_password_entry(&entries, identifier);
   if (entry_idx < 0) {
     printf("No entry found for key \"%s\".\n", identifier);
+    entries_free(&entries);
     return;
   }
 
-  num_entries--;
-
-  // shift back all entries by one, removing the found entry
-  for (int i = entry_idx; i < num_entries; i++) {
-    memcpy(entries[i], entries[i + 1], sizeof(Line));
-  }
-
   // save updated database
-  if (save_database(cache->master_password, entries, num_entries)) {
+  if (delete_entry(&entries, entry_idx) &&
+      save_entries(key, &entries)) {
     printf("Password removed from database.\n");
   }
+
+  publish_completion(&entries);
+  entries_free(&entries);
 }
 
-void retrieve_password(master_pwd_cache *cache, char *identifier) {
-  Lines entries;
-  int num_entries;
-  if (!read_database(cache->master_password, entries, &num_entries)) {
+void retrieve_password(VaultKey *key, char *identifier) {
+  Entries entries;
+  if (!read_database_for(key, identifier, &entries)) {
     return;
   }
 
   // find existing entry
-  int entry_idx = find_password_entry(entries, num_entries, identifier);
+  int entry_idx = find_password_entry(&entries, identifier);
   if (entry_idx < 0) {
     printf("No entry found for key \"%s\".\n", identifier);
+  } else if (read_entry(key, &entries, entry_idx)) {
+    copy_password_to_clipboard(entries.items[entry_idx].password, key,
+                               &entries);
+
+    // the read is kept in the key cache until the next write, and only
+    // written now if it can not be kept; failing to record it does not fail
+    // the command
+    PassError previous_error = last_error;
+    if (record_access(&entries, entry_idx) && entries.change_count > 0) {
+      save_entries(key, &entries);
+    }
+    last_error = previous_error;
+  }
+
+  publish_completion(&entries);
+  entries_free(&entries);
+}
+
+void list_passwords(VaultKey *key, EntryOrder order) {
+  Entries entries;
+  if (!read_database(key, &entries)) {
+    return;
+  }
+
+  // reads not written yet count as well, without being saved
+  CachedAccess accesses[CACHE_MAX_ACCESSES];
+  int count = order != ORDER_STORED && key_cache
+                  ? copy_cached_accesses(key_cache, accesses)
+                  : 0;
+  for (int i = 0; i < count; i++) {
+    int entry_idx = find_password_entry(&entries, accesses[i].identifier);
+    if (entry_idx >= 0) {
+      Entry *entry = &entries.items[entry_idx];
+      entry->accessed = accesses[i].time > entry->accessed ? accesses[i].time
+                                                           : entry->accessed;
+      entry->access_count += accesses[i].count;
+    }
+  }
+
+  char **identifiers = ordered_identifiers(&entries, order);
+  if (!identifiers) {
+    entries_free(&entries);
+    return;
+  }
+
+  print_columns(identifiers, entries.count);
+  free(identifiers);
+  publish_completion(&entries);
+  entries_free(&entries);
+}
+
+/**
+ * Prints the identifiers matching the pattern, one per line, best ones first.
+ */
+void print_matches(char **identifiers, int num_identifiers, char *pattern,
+                   SearchMode mode) {
+  SearchIndex index;
+  if (!search_index_init(&index, identifiers, num_identifiers)) {
+    return;
+  }
+
+  SearchMatch *matches;
+  int found = search_identifiers(&index, pattern, mode, &matches);
+  if (found == 0) {
+    printf("No entries found for \"%s\".\n", pattern);
+  }
+
+  for (int i = 0; i < found; i++) {
+    printf("%s\n", identifiers[matches[i].index]);
+  }
+
+  if (found >= 0) {
+    free(matches);
+  }
+
+  search_index_free(&index);
+}
+
+void find_passwords(VaultKey *key, char *pattern, SearchMode mode) {
+  Entries entries;
+  if (!read_database(key, &entries)) {
+    return;
+  }
+
+  char **identifiers = malloc(entries.count * sizeof(char *) + 1);
+  if (!identifiers) {
+    last_error = ERR_OUT_OF_MEMORY;
+    entries_free(&entries);
+    return;
+  }
+
+  for (int i = 0; i < entries.count; i++) {
+    identifiers[i] = entries.items[i].identifier;
+  }
+
+  print_matches(identifiers, entries.count, pattern, mode);
+  free(identifiers);
+  publish_completion(&entries);
+  entries_free(&entries);
+}
+
+void start_agent(VaultKey *key) {
+  if (agent_available()) {
+    printf("Agent is already running.\n");
+    return;
+  }
+
+  if (run_agent(key)) {
+    printf("Agent started.\n");
+  }
+}
+
+bool transfer_options(InputArgs *args, TransferFormat *format,
+                      ConflictPolicy *policy) {
+  return transfer_format(find_option(args, "format"), args->identifier,
+                         format) &&
+         conflict_policy(find_option(args, "conflict"), policy);
+}
+
+/**
+ * Imports all entries from the file, or stdin, saving the database once
+ * at the end; nothing is written if any of the records can not be imported.
+ */
+void import_passwords(VaultKey *key, char *path, TransferFormat format,
+                      ConflictPolicy policy) {
+  bool from_file = path && strcmp(path, "-") != 0;
+  FILE *in = from_file ? fopen(path, "r") : stdin;
+  if (!in) {
+    last_error = ERR_TRANSFER_FILE;
+    return;
+  }
+
+  Entries entries;
+  if (!read_database(key, &entries)) {
+    if (from_file) {
+      fclose(in);
+    }
     return;
   }
 
-  copy_password_to_clipboard(entries[entry_idx]);
+  ImportStats stats;
+  bool ok = import_entries(&entries, in, format, policy, &stats);
+  if (from_file) {
+    fclose(in);
+  }
+
+  if (!ok) {
+    fprintf(stderr, "Import stopped at record %d.\n", stats.records);
+  } else if (entries.change_count == 0 || save_entries(key, &entries)) {
+    printf("Imported %d entries, skipped %d existing.\n", stats.imported,
+           stats.skipped);
+  }
+
+  publish_completion(&entries);
+  entries_free(&entries);
+}
+
+void export_passwords(VaultKey *key, char *path, TransferFormat format) {
+  bool to_file = path && strcmp(path, "-") != 0;
+  Entries entries;
+  if (!read_database(key, &entries)) {
+    return;
+  }
+
+  FILE *out = to_file ? open_export_file(path) : stdout;
+  if (out) {
+    export_entries(key, &entries, out, format);
+  }
+
+  if (to_file && out && fclose(out) != 0) {
+    last_error = ERR_TRANSFER_FILE;
+  }
+
+  entries_free(&entries);
 }
 
-void list_passwords(master_pwd_cache *cache) {
-  Lines entries;
-  int num_entries;
-  if (!read_database(cache->master_password, entries, &num_entries)) {
+/**
+ * Reports the size of the database, its key derivation and the use of the
+ * key cache, as text or as a JSON object.
+ */
+void show_stats(VaultKey *key, master_pwd_cache *cache, bool json) {
+  DatabaseInfo info;
+  Entries entries;
+  if (!database_info(&info) || !read_database(key, &entries)) {
     return;
   }
 
-  Lines identifiers;
-  entries_to_identifiers(identifiers, entries, num_entries);
-  print_columns(identifiers, num_entries);
+  // the last derivation is this run's own, unless the key came from the cache
+  uint64_t kdf_ns = trace_total("kdf") ? trace_total("kdf") : cache->kdf_ns;
+
+  if (json) {
+    printf("{\"entries\": %d, \"format\": \"%s\", \"database_bytes\": %lld, "
+           "\"index_bytes\": %u, \"journal_bytes\": %lld, "
+           "\"journal_records\": %d, \"kdf\": \"%s\", "
+           "\"kdf_iterations\": %u, \"kdf_memory_mib\": %d, "
+           "\"kdf_lanes\": %d, \"kdf_salt_bytes\": %d, "
+           "\"kdf_ms\": %.3f, \"cache_hits\": %lu, \"cache_misses\": %lu, "
+           "\"shards\": %d, \"compression\": \"%s\"}\n",
+           entries.count, info.legacy ? "legacy" : "current",
+           info.database_size, info.index_length, info.journal_size,
+           entries.journal_records, info.kdf, info.iterations,
+           info.memory_mib, info.lanes, info.salt_length, kdf_ns / 1e6,
+           cache->cache_hits, cache->cache_misses, info.shards,
+           info.compression);
+  } else {
+    printf("%-16s %d\n", "entries", entries.count);
+    printf("%-16s %s\n", "format", info.legacy ? "legacy" : "current");
+    printf("%-16s %d\n", "shards", info.shards);
+    printf("%-16s %s\n", "compression", info.compression);
+    printf("%-16s %lld\n", "database bytes", info.database_size);
+    printf("%-16s %u\n", "index bytes", info.index_length);
+    printf("%-16s %lld\n", "journal bytes", info.journal_size);
+    printf("%-16s %d\n", "journal records", entries.journal_records);
+    printf("%-16s %s\n", "kdf", info.kdf);
+    printf("%-16s %u\n", "kdf iterations", info.iterations);
+    if (info.lanes > 0) {
+      printf("%-16s %d\n", "kdf memory MiB", info.memory_mib);
+      printf("%-16s %d\n", "kdf lanes", info.lanes);
+    }
+    printf("%-16s %d\n", "kdf salt bytes", info.salt_length);
+    printf("%-16s %.3f\n", "kdf ms", kdf_ns / 1e6);
+    printf("%-16s %lu\n", "cache hits", cache->cache_hits);
+    printf("%-16s %lu\n", "cache misses", cache->cache_misses);
+  }
+
+  entries_free(&entries);
+}
+
+/**
+ * Reads the target unlock time, either as --target-ms=N or as the argument
+ * following --target-ms, and the key derivation function, which is Argon2id
+ * where OpenSSL provides it.
+ */
+bool tune_options(InputArgs *args, unsigned char *kdf, uint32_t *target_ms) {
+  char *name = find_option(args, "kdf");
+  char *target = find_option(args, "target-ms");
+  if (!target && args->command == CMD_TUNE) {
+    target = args->identifier;
+  }
+
+  if (!name) {
+    *kdf = crypto_kdf_supported(CRYPTO_KDF_ARGON2ID) ? CRYPTO_KDF_ARGON2ID
+                                                     : CRYPTO_KDF_PBKDF2_SHA256;
+  } else if (strcmp(name, "pbkdf2") == 0) {
+    *kdf = CRYPTO_KDF_PBKDF2_SHA256;
+  } else if (strcmp(name, "argon2id") == 0) {
+    *kdf = CRYPTO_KDF_ARGON2ID;
+  } else {
+    return false;
+  }
+
+  char *end = NULL;
+  long value = target ? strtol(target, &end, 10) : TUNE_DEFAULT_TARGET_MS;
+  if ((end && *end != '\0') || value <= 0 || value > TUNE_MAX_TARGET_MS) {
+    return false;
+  }
+
+  *target_ms = value;
+  return true;
+}
+
+/**
+ * Reads how new passwords are generated: --length=N characters of the
+ * --classes given as letters (l, u, d, s), or a passphrase of --words=N
+ * words taken from --wordlist=FILE.
+ */
+bool generate_options(InputArgs *args, PasswordPolicy *rules) {
+  generator_default_policy(rules);
+  char *length = find_option(args, "length");
+  char *classes = find_option(args, "classes");
+  char *words = find_option(args, "words");
+  rules->wordlist = find_option(args, "wordlist");
+  rules->passphrase = words || rules->wordlist;
+
+  if (rules->passphrase && (length || classes)) {
+    return false;
+  }
+
+  if (classes && !generator_classes(classes, &rules->classes)) {
+    return false;
+  }
+
+  // every class needs a place of its own
+  int class_count = 0;
+  for (unsigned rest = rules->classes; rest; rest >>= 1) {
+    class_count += rest & 1;
+  }
+
+  char *count = rules->passphrase ? words : length;
+  int min = rules->passphrase ? 1 : class_count;
+  int max = rules->passphrase ? GENERATE_MAX_WORDS : GENERATE_MAX_LENGTH;
+  if (rules->passphrase) {
+    rules->length = GENERATE_DEFAULT_WORDS;
+  }
+
+  if (count) {
+    char *end;
+    long value = strtol(count, &end, 10);
+    if (*end != '\0' || value < min || value > max) {
+      return false;
+    }
+
+    rules->length = value;
+  }
+
+  return rules->length >= min;
+}
+
+/**
+ * Benchmarks the key derivation on this machine, then rewrites the database
+ * with a new key derived with the parameters taking about the target time.
+ * The master password is asked for again, as only the key is cached.
+ */
+void tune_database(VaultKey *key, unsigned char kdf, uint32_t target_ms) {
+  KdfParams params;
+  uint64_t derive_ns;
+  if (!crypto_tune_kdf(kdf, target_ms, &params, &derive_ns)) {
+    return;
+  }
+
+  if (params.kdf == CRYPTO_KDF_ARGON2ID) {
+    printf("%s: %u passes, %u MiB, %u lanes, %.0f ms\n",
+           crypto_kdf_name(params.kdf), params.iterations, params.memory_mib,
+           params.lanes, derive_ns / 1e6);
+  } else {
+    printf("%s: %u iterations, %.0f ms\n", crypto_kdf_name(params.kdf),
+           params.iterations, derive_ns / 1e6);
+  }
+
+  char *master_pwd = obtain_master_password("Master password: ", false);
+  if (!master_pwd) {
+    return;
+  }
+
+  VaultKey current, tuned;
+  bool ok = unlock_database(master_pwd, &current);
+
+  // the password has to be the one the database is encrypted with
+  if (ok && memcmp(current.key, key->key, CRYPTO_KEY_LENGTH) != 0) {
+    last_error = ERR_DB_MASTER_PWD;
+    ok = false;
+  }
+
+  if (ok && rekey_database(key, master_pwd, &params, &tuned)) {
+    memcpy(key, &tuned, sizeof(VaultKey));
+    printf("Database key derivation updated.\n");
+  }
+
+  free_password(master_pwd);
+  crypto_wipe_key(&current);
+  crypto_wipe_key(&tuned);
+}
+
+/**
+ * Re-encrypts the database with a key derived from a new master password,
+ * keeping the key derivation parameters. The current master password is asked
+ * for first, as the cached key alone must not be enough to lock the owner out.
+ * The new key replaces the cached one, so a running agent stops serving the
+ * database once it notices the change.
+ */
+void change_master_password(VaultKey *key) {
+  char *current_pwd = obtain_master_password("Master password: ", false);
+  if (!current_pwd) {
+    return;
+  }
+
+  VaultKey current;
+  bool ok = unlock_database(current_pwd, &current);
+  free_password(current_pwd);
+
+  // the password has to be the one the database is encrypted with
+  if (ok && memcmp(current.key, key->key, CRYPTO_KEY_LENGTH) != 0) {
+    last_error = ERR_DB_MASTER_PWD;
+    ok = false;
+  }
+
+  crypto_wipe_key(&current);
+  if (!ok) {
+    return;
+  }
+
+  char *master_pwd = obtain_master_password("New master password: ", true);
+  if (!master_pwd) {
+    return;
+  }
+
+  VaultKey new_key;
+  KdfParams params = key->kdf;
+  if (rekey_database(key, master_pwd, &params, &new_key)) {
+    memcpy(key, &new_key, sizeof(VaultKey));
+    printf("Master password changed.\n");
+  }
+
+  free_password(master_pwd);
+  crypto_wipe_key(&new_key);
+}
+
+/**
+ * Rolls back an interrupted `pass rekey`, which needs no master password as
+ * the database itself was never touched.
+ */
+void abort_rekey() {
+  bool discarded;
+  if (!discard_rekey(&discarded)) {
+    return;
+  }
+
+  printf(discarded ? "Interrupted rekey rolled back.\n"
+                   : "No interrupted rekey found.\n");
+}
+
+/**
+ * `list --recent` lists the most recently used entries first, and `list
+ * --frequent` the most frequently used ones.
+ */
+bool list_options(InputArgs *args, EntryOrder *order) {
+  *order = ORDER_STORED;
+  if (args->command != CMD_LIST_PASSWD) {
+    return true;
+  }
+
+  bool recent = has_option(args, "recent");
+  bool frequent = has_option(args, "frequent");
+  *order = recent ? ORDER_RECENT : frequent ? ORDER_FREQUENT : ORDER_STORED;
+  return !(recent && frequent);
+}
+
+/**
+ * Reads the number of shards for `pass reshard`, where 1 stands for a single
+ * database file.
+ */
+bool reshard_options(InputArgs *args, int *shard_count) {
+  if (args->command != CMD_RESHARD) {
+    return true;
+  }
+
+  char *end = NULL;
+  long value = args->identifier ? strtol(args->identifier, &end, 10) : 0;
+  if (!end || *end != '\0' || value < 1 || value > DATABASE_MAX_SHARDS) {
+    return false;
+  }
+
+  *shard_count = value > 1 ? value : 0;
+  return true;
+}
+
+void reshard_vault(VaultKey *key, int shard_count) {
+  if (!reshard_database(key, shard_count)) {
+    return;
+  }
+
+  if (shard_count > 0) {
+    printf("Database split into %d shards.\n", shard_count);
+  } else {
+    printf("Database merged into a single file.\n");
+  }
+}
+
+/**
+ * Reads the compression for `pass compress`, deflate or none.
+ */
+bool compress_options(InputArgs *args, unsigned char *compression) {
+  if (args->command != CMD_COMPRESS) {
+    return true;
+  }
+
+  return args->identifier && compress_by_name(args->identifier, compression);
+}
+
+void compress_vault(VaultKey *key, unsigned char compression) {
+  if (!compress_database(key, compression)) {
+    return;
+  }
+
+  if (compression == COMPRESS_NONE) {
+    printf("Database stored without compression.\n");
+  } else {
+    printf("Database compressed with %s.\n", compress_name(compression));
+  }
+}
+
+/**
+ * Prints the identifiers starting with the prefix, one per line, from the
+ * index published by the unlocked session, or else from a running agent.
+ * Nothing is printed while the database is locked.
+ */
+void complete_identifiers(char *prefix) {
+  size_t length;
+  char *names = read_identifiers(&length);
+  if (!names && agent_available()) {
+    AgentStatus status;
+    if (!agent_request(AGENT_OP_LIST, NULL, NULL, &status, &names, &length) ||
+        status != AGENT_OK) {
+      free(names);
+      names = NULL;
+    }
+  }
+
+  if (!names) {
+    return;
+  }
+
+  size_t prefix_len = strlen(prefix);
+  for (char *line = names, *end; (end = strchr(line, '\n')); line = end + 1) {
+    if ((size_t)(end - line) >= prefix_len &&
+        strncmp(line, prefix, prefix_len) == 0) {
+      fwrite(line, 1, end - line + 1, stdout);
+    }
+  }
+
+  free(names);
+}
+
+/**
+ * Publishes the identifiers of the entries the command has read for shell
+ * completion, unless this version already is; a single shard holds only some
+ * of them. Failing to do so is not an error of the command.
+ */
+void publish_completion(Entries *entries) {
+  if (entries->shard >= 0) {
+    return;
+  }
+
+  PassError previous_error = last_error;
+  uint64_t trace = trace_begin();
+  if (!identifiers_published(&entries->identity)) {
+    publish_identifiers(entries);
+  }
+  trace_end("publish", trace);
+
+  last_error = previous_error;
+}
+
+// outcome of a single batch command, reported once the batch is saved
+typedef struct BatchResult {
+  const char *status;
+  const char *command;
+  char *identifier;
+  char *password;
+} BatchResult;
+
+static const char *batch_command_name(Command command) {
+  switch (command) {
+  case CMD_ADD_PASSWD:
+    return "add";
+  case CMD_PUT_PASSWD:
+    return "put";
+  case CMD_DEL_PASSWD:
+    return "del";
+  case CMD_COPY_PASSWD:
+    return "get";
+  default:
+    return "-";
+  }
+}
+
+/**
+ * Applies a single batch command to the entries, without asking before
+ * existing entries are overwritten. Returns false only if the whole batch has
+ * to be abandoned.
+ */
+static bool apply_batch_command(VaultKey *key, Entries *entries, char *line,
+                                PasswordPolicy *rules, Arena *output,
+                                BatchResult *result) {
+  char *secret;
+  InputArgs args = parse_batch_line(line, &secret);
+
+  result->status = "invalid";
+  result->command = batch_command_name(args.command);
+  result->identifier = NULL;
+  result->password = NULL;
+
+  if (args.command == CMD_NONE) {
+    return true;
+  }
+
+  // a bad line is reported in the results, not as an error of the batch
+  PassError previous_error = last_error;
+  if (!check_password_identifier(args.identifier)) {
+    last_error = previous_error;
+    return true;
+  }
+
+  result->identifier =
+      arena_strndup(output, args.identifier, strlen(args.identifier));
+  if (!result->identifier) {
+    return false;
+  }
+
+  int entry_idx = find_password_entry(entries, args.identifier);
+  if (entry_idx < 0 && (args.command == CMD_DEL_PASSWD ||
+                        args.command == CMD_COPY_PASSWD)) {
+    result->status = "not_found";
+    return true;
+  }
+
+  bool ok = true;
+
+  switch (args.command) {
+  case CMD_ADD_PASSWD:
+  case CMD_PUT_PASSWD:
+    if (args.command == CMD_ADD_PASSWD) {
+      secret = arena_alloc(&entries->arena, PASSWD_MAX_LENGTH);
+      ok = secret && generate_password(rules, secret);
+    }
+
+    entry_idx =
+        ok ? create_entry(entries, entry_idx, args.identifier, secret) : -1;
+    ok = entry_idx >= 0;
+
+    // generated passwords are reported back, as there is no clipboard
+    if (ok && args.command == CMD_ADD_PASSWD) {
+      char *password = entries->items[entry_idx].password;
+      result->password = arena_strndup(output, password, strlen(password));
+      ok = result->password != NULL;
+    }
+    break;
+
+  case CMD_DEL_PASSWD:
+    ok = delete_entry(entries, entry_idx);
+    break;
+
+  default:
+    ok = read_entry(key, entries, entry_idx);
+    if (ok) {
+      char *password = entries->items[entry_idx].password;
+      result->password = arena_strndup(output, password, strlen(password));
+      ok = result->password != NULL && record_access(entries, entry_idx);
+    }
+  }
+
+  if (!ok) {
+    return false;
+  }
+
+  result->status = "ok";
+  return true;
+}
+
+/**
+ * Runs the commands read from path, or stdin, against a single copy of the
+ * database, which is saved once at the end. Results are kept aside, as saving
+ * may replace the entries, and printed only after that, one tab separated
+ * line per command:
+ *
+ *   <ok|not_found|invalid> <command> <identifier> [password]
+ *
+ * Blank lines and lines starting with '#' are skipped.
+ */
+void run_batch(VaultKey *key, char *path, PasswordPolicy *rules) {
+  FILE *in = path ? fopen(path, "r") : stdin;
+  if (!in) {
+    last_error = ERR_BATCH_INPUT;
+    return;
+  }
+
+  Entries entries;
+  if (!read_database(key, &entries)) {
+    if (path) {
+      fclose(in);
+    }
+    return;
+  }
+
+  Arena output;
+  arena_init(&output);
+  BatchResult *results = NULL;
+  int count = 0, capacity = 0;
+  bool ok = true;
+  char *line;
+
+  while (ok && (line = read_line(in))) {
+    char *start = line + strspn(line, " \t");
+
+    if (*start != '\0' && *start != '#') {
+      if (count == capacity) {
+        capacity = capacity ? capacity * 2 : 64;
+        BatchResult *grown = realloc(results, capacity * sizeof(BatchResult));
+        if (!grown) {
+          last_error = ERR_OUT_OF_MEMORY;
+          ok = false;
+        } else {
+          results = grown;
+        }
+      }
+
+      ok = ok && apply_batch_command(key, &entries, start, rules, &output,
+                                     &results[count++]);
+    }
+
+    // lines may hold passwords
+    memset(line, 0, strlen(line));
+    free(line);
+  }
+
+  if (ok && !feof(in)) {
+    if (ferror(in)) {
+      last_error = ERR_BATCH_INPUT;
+    }
+    ok = false;
+  }
+
+  if (path) {
+    fclose(in);
+  }
+
+  if (ok && entries.change_count > 0) {
+    ok = save_entries(key, &entries);
+  }
+
+  for (int i = 0; ok && i < count; i++) {
+    BatchResult *result = &results[i];
+    printf("%s\t%s\t%s", result->status, result->command,
+           result->identifier ? result->identifier : "-");
+    if (result->password) {
+      printf("\t%s", result->password);
+    }
+    printf("\n");
+  }
+
+  free(results);
+  arena_free(&output);
+  publish_completion(&entries);
+  entries_free(&entries);
+}
+
+/**
+ * Stores a password generated following the rules, or the user's own if
+ * there are none.
+ */
+void agent_store_password(char *identifier, PasswordPolicy *rules) {
+  bool generate = rules != NULL;
+  AgentStatus status;
+  if (!agent_request(AGENT_OP_FIND, identifier, NULL, &status, NULL, NULL)) {
+    return;
+  }
+
+  if (status == AGENT_OK && !ask_override_entry()) {
+    // can't do much if user does not confirm
+    return;
+  }
+
+  Arena generated;
+  arena_init(&generated);
+
+  char *new_password = generate
+                           ? arena_alloc(&generated, PASSWD_MAX_LENGTH)
+                           : obtain_user_password();
+  if (!new_password ||
+      (generate && !generate_password(rules, new_password))) {
+    arena_free(&generated);
+    return;
+  }
+
+  bool sent = agent_request(AGENT_OP_PUT, identifier, new_password, &status,
+                            NULL, NULL);
+  if (sent && status != AGENT_OK) {
+    last_error = ERR_AGENT;
+  } else if (sent && generate) {
+    copy_password_to_clipboard(new_password, NULL, NULL);
+  }
+
+  if (generate) {
+    arena_free(&generated);
+  } else {
+    free_password(new_password);
+  }
+}
+
+void agent_retrieve_password(char *identifier) {
+  AgentStatus status;
+  char *password;
+  size_t password_len;
+  if (!agent_request(AGENT_OP_GET, identifier, NULL, &status, &password,
+                     &password_len)) {
+    return;
+  }
+
+  if (status == AGENT_NOT_FOUND) {
+    printf("No entry found for key \"%s\".\n", identifier);
+  } else if (status != AGENT_OK) {
+    last_error = ERR_AGENT;
+  } else {
+    copy_password_to_clipboard(password, NULL, NULL);
+  }
+
+  memset(password, 0, password_len);
+  free(password);
+}
+
+void agent_delete_password(char *identifier) {
+  AgentStatus status;
+  if (!agent_request(AGENT_OP_DEL, identifier, NULL, &status, NULL, NULL)) {
+    return;
+  }
+
+  if (status == AGENT_NOT_FOUND) {
+    printf("No entry found for key \"%s\".\n", identifier);
+  } else if (status != AGENT_OK) {
+    last_error = ERR_AGENT;
+  } else {
+    printf("Password removed from database.\n");
+  }
+}
+
+/**
+ * Fetches the identifiers from the agent, which are returned as pointers into
+ * the list; both are to be freed by the caller.
+ */
+char **agent_identifiers(AgentOp op, char **list, int *num_identifiers) {
+  AgentStatus status;
+  size_t list_len;
+  if (!agent_request(op, NULL, NULL, &status, list, &list_len)) {
+    return NULL;
+  }
+
+  if (status != AGENT_OK) {
+    last_error = ERR_AGENT;
+    free(*list);
+    return NULL;
+  }
+
+  // one identifier per line
+  *num_identifiers = 0;
+  for (size_t i = 0; i < list_len; i++) {
+    *num_identifiers += (*list)[i] == '\n';
+  }
+
+  char **identifiers = malloc(*num_identifiers * sizeof(char *) + 1);
+  if (!identifiers) {
+    last_error = ERR_OUT_OF_MEMORY;
+    free(*list);
+    return NULL;
+  }
+
+  *num_identifiers = 0;
+  for (char *id = strtok(*list, "\n"); id; id = strtok(NULL, "\n")) {
+    identifiers[(*num_identifiers)++] = id;
+  }
+
+  return identifiers;
+}
+
+void agent_list_passwords(EntryOrder order) {
+  AgentOp op = order == ORDER_RECENT     ? AGENT_OP_LIST_RECENT
+               : order == ORDER_FREQUENT ? AGENT_OP_LIST_FREQUENT
+                                         : AGENT_OP_LIST;
+  char *list;
+  int num_identifiers;
+  char **identifiers = agent_identifiers(op, &list, &num_identifiers);
+  if (!identifiers) {
+    return;
+  }
+
+  print_columns(identifiers, num_identifiers);
+  free(identifiers);
+  free(list);
+}
+
+void agent_find_passwords(char *pattern, SearchMode mode) {
+  char *list;
+  int num_identifiers;
+  char **identifiers =
+      agent_identifiers(AGENT_OP_LIST, &list, &num_identifiers);
+  if (!identifiers) {
+    return;
+  }
+
+  print_matches(identifiers, num_identifiers, pattern, mode);
+  free(identifiers);
+  free(list);
+}
+
+void run_agent_command(InputArgs args, PasswordPolicy *rules) {
+  switch (args.command) {
+  case CMD_ADD_PASSWD:
+    agent_store_password(args.identifier, rules);
+    break;
+
+  case CMD_PUT_PASSWD:
+    agent_store_password(args.identifier, NULL);
+    break;
+
+  case CMD_DEL_PASSWD:
+    agent_delete_password(args.identifier);
+    break;
+
+  case CMD_COPY_PASSWD:
+    agent_retrieve_password(args.identifier);
+    break;
+
+  case CMD_LIST_PASSWD: {
+    EntryOrder order;
+    list_options(&args, &order);
+    agent_list_passwords(order);
+    break;
+  }
+
+  case CMD_FIND: {
+    SearchMode mode;
+    search_mode(find_option(&args, "match"), args.identifier, &mode);
+    agent_find_passwords(args.identifier, mode);
+    break;
+  }
+
+  default: {}
+  }
 }
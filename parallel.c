@@ -0,0 +1,165 @@
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#endif
+
+#include <stdlib.h>
+
+#include "parallel.h"
+
+// upper bound for the number of workers of a single task
+#define PARALLEL_MAX_WORKERS 64
+
+typedef struct Worker {
+  ParallelTask task;
+  void *context;
+  int number;
+} Worker;
+
+/**
+ * Number of workers to use for work spread over all cores.
+ */
+int parallel_workers() {
+#ifdef _WIN32
+  SYSTEM_INFO info;
+  GetSystemInfo(&info);
+  int count = info.dwNumberOfProcessors;
+#else
+  long count = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+
+  return count < 1                      ? 1
+         : count > PARALLEL_MAX_WORKERS ? PARALLEL_MAX_WORKERS
+                                        : (int)count;
+}
+
+#ifdef _WIN32
+static DWORD WINAPI run_worker(LPVOID argument) {
+  Worker *worker = argument;
+  worker->task(worker->context, worker->number);
+  return 0;
+}
+#else
+static void *run_worker(void *argument) {
+  Worker *worker = argument;
+  worker->task(worker->context, worker->number);
+  return NULL;
+}
+#endif
+
+/**
+ * Runs the task on the given number of workers and waits for all of them to
+ * finish. The calling thread is worker 0; workers whose thread can not be
+ * started are left out.
+ */
+void parallel_run(ParallelTask task, void *context, int workers) {
+  workers = workers < 1                      ? 1
+            : workers > PARALLEL_MAX_WORKERS ? PARALLEL_MAX_WORKERS
+                                             : workers;
+
+  Worker state[PARALLEL_MAX_WORKERS];
+#ifdef _WIN32
+  HANDLE threads[PARALLEL_MAX_WORKERS];
+#else
+  pthread_t threads[PARALLEL_MAX_WORKERS];
+#endif
+  bool started[PARALLEL_MAX_WORKERS] = {false};
+
+  for (int i = 1; i < workers; i++) {
+    state[i] = (Worker){task, context, i};
+#ifdef _WIN32
+    threads[i] = CreateThread(NULL, 0, run_worker, &state[i], 0, NULL);
+    started[i] = threads[i] != NULL;
+#else
+    started[i] = pthread_create(&threads[i], NULL, run_worker, &state[i]) == 0;
+#endif
+  }
+
+  task(context, 0);
+
+  for (int i = 1; i < workers; i++) {
+    if (!started[i]) {
+      continue;
+    }
+
+#ifdef _WIN32
+    WaitForSingleObject(threads[i], INFINITE);
+    CloseHandle(threads[i]);
+#else
+    pthread_join(threads[i], NULL);
+#endif
+  }
+}
+
+/**
+ * Gives the processor to other threads, for workers waiting on each other.
+ */
+void parallel_yield() {
+#ifdef _WIN32
+  SwitchToThread();
+#else
+  sched_yield();
+#endif
+}
+
+void parallel_queue_init(ParallelQueue *queue) {
+  atomic_init(&queue->head, 0);
+  atomic_init(&queue->tail, 0);
+}
+
+/**
+ * Only of use to the pushing worker, as a queue which is not full stays so
+ * until it pushes again.
+ */
+bool parallel_queue_full(ParallelQueue *queue) {
+  size_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+  size_t head = atomic_load_explicit(&queue->head, memory_order_acquire);
+  return tail - head == PARALLEL_QUEUE_CAPACITY;
+}
+
+/**
+ * Adds a value at the tail of the queue, unless it is full.
+ */
+bool parallel_queue_push(ParallelQueue *queue, size_t value) {
+  size_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+  size_t head = atomic_load_explicit(&queue->head, memory_order_acquire);
+  if (tail - head == PARALLEL_QUEUE_CAPACITY) {
+    return false;
+  }
+
+  queue->values[tail % PARALLEL_QUEUE_CAPACITY] = value;
+  atomic_store_explicit(&queue->tail, tail + 1, memory_order_release);
+  return true;
+}
+
+/**
+ * Reads the value at the head of the queue without taking it, unless the
+ * queue is empty. Everything the pushing worker wrote before the push is
+ * visible afterwards, and stays in place until the value is popped.
+ */
+bool parallel_queue_peek(ParallelQueue *queue, size_t *value) {
+  size_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+  size_t tail = atomic_load_explicit(&queue->tail, memory_order_acquire);
+  if (head == tail) {
+    return false;
+  }
+
+  *value = queue->values[head % PARALLEL_QUEUE_CAPACITY];
+  return true;
+}
+
+/**
+ * Takes the value at the head of the queue, unless it is empty.
+ */
+bool parallel_queue_pop(ParallelQueue *queue, size_t *value) {
+  if (!parallel_queue_peek(queue, value)) {
+    return false;
+  }
+
+  size_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+  atomic_store_explicit(&queue->head, head + 1, memory_order_release);
+  return true;
+}
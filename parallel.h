@@ -0,0 +1,29 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// capacity of a queue between two workers, a power of 2
+#define PARALLEL_QUEUE_CAPACITY 8
+
+// work done by each worker; workers share their work through the context,
+// so running fewer of them only takes longer
+typedef void (*ParallelTask)(void *context, int worker);
+
+// bounded queue of values passed from one worker to another, without locks;
+// only one worker may push and only one may pop at a time
+typedef struct ParallelQueue {
+  size_t values[PARALLEL_QUEUE_CAPACITY];
+  atomic_size_t head;
+  atomic_size_t tail;
+} ParallelQueue;
+
+int parallel_workers();
+void parallel_run(ParallelTask task, void *context, int workers);
+void parallel_yield();
+void parallel_queue_init(ParallelQueue *queue);
+bool parallel_queue_full(ParallelQueue *queue);
+bool parallel_queue_push(ParallelQueue *queue, size_t value);
+bool parallel_queue_peek(ParallelQueue *queue, size_t *value);
+bool parallel_queue_pop(ParallelQueue *queue, size_t *value);
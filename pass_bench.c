@@ -0,0 +1,866 @@
+#include <openssl/rand.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "compress.h"
+#include "crypto.h"
+#include "database.h"
+#include "error.h"
+#include "generator.h"
+#include "password.h"
+#include "payload.h"
+#include "search.h"
+#include "trace.h"
+
+/**
+ * Benchmarks the database code paths on synthetic vaults. Each vault is
+ * generated in a temporary directory, which is also used as the home
+ * directory, so that get_db_path points into it for debug and release
+ * builds alike. The master password prompt and the clipboard are left out;
+ * "cold" runs derive the key from the master password first, as a run
+ * without a cached key would, "cached" runs start from the derived key.
+ *
+ * usage: pass_bench [--quick] [--baseline=file] [--threshold=ratio]
+ *                   [--write-baseline=file]
+ *
+ * Password generation is measured on its own, with a synthetic word list
+ * for passphrases, and so is parsing the decrypted index. A vault of text
+ * notes is read and written stored as is and compressed with deflate, with
+ * the bytes written for each.
+ *
+ * With a baseline, the run fails if the median latency of any measurement
+ * exceeds its baseline by more than the threshold, 0.5 (50 %) by default.
+ */
+#define BENCH_MASTER_PWD "benchmark master password"
+#define BENCH_MAX_RESULTS 128
+#define BENCH_FIND_BATCH 1000
+#define BENCH_GENERATE_BATCH 1000
+#define BENCH_WORDLIST_SIZE 7776
+#define BENCH_IDENTIFIER_LENGTH 32
+// room for the name of a file in the benchmark directory
+#define BENCH_PATH_LENGTH (FS_MAX_PATH_LENGTH + 16)
+
+typedef struct BenchVault {
+  int size;
+  int secret_length;
+  // samples of the cached and cold runs
+  int iterations;
+  int cold_iterations;
+  // secrets are text made of words instead of random characters
+  bool notes;
+} BenchVault;
+
+typedef struct BenchResult {
+  char name[64];
+  int samples;
+  double p50_us;
+  double p99_us;
+  double ops_per_sec;
+} BenchResult;
+
+static const BenchVault full_vaults[] = {
+    {.size = 100,
+     .secret_length = 32,
+     .iterations = 200,
+     .cold_iterations = 10},
+    {.size = 1000,
+     .secret_length = 32,
+     .iterations = 200,
+     .cold_iterations = 10},
+    {.size = 10000,
+     .secret_length = 32,
+     .iterations = 100,
+     .cold_iterations = 5},
+    {.size = 10000,
+     .secret_length = 1024,
+     .iterations = 100,
+     .cold_iterations = 5},
+    {.size = 100000,
+     .secret_length = 32,
+     .iterations = 20,
+     .cold_iterations = 3},
+};
+
+static const BenchVault quick_vaults[] = {
+    {.size = 100,
+     .secret_length = 32,
+     .iterations = 50,
+     .cold_iterations = 3},
+    {.size = 1000,
+     .secret_length = 32,
+     .iterations = 50,
+     .cold_iterations = 3},
+    {.size = 10000,
+     .secret_length = 32,
+     .iterations = 20,
+     .cold_iterations = 2},
+};
+
+static const BenchVault full_notes = {.size = 1000,
+                                      .secret_length = 2048,
+                                      .iterations = 50,
+                                      .cold_iterations = 0,
+                                      .notes = true};
+static const BenchVault quick_notes = {.size = 1000,
+                                       .secret_length = 2048,
+                                       .iterations = 20,
+                                       .cold_iterations = 0,
+                                       .notes = true};
+
+static BenchResult results[BENCH_MAX_RESULTS];
+static int result_count;
+static char bench_dir[FS_MAX_PATH_LENGTH];
+
+static void fail(const char *what) {
+  fprintf(stderr, "pass_bench: %s failed\n", what);
+  print_error();
+  exit(EXIT_FAILURE);
+}
+
+static void identifier_of(int number, char *identifier) {
+  snprintf(identifier, BENCH_IDENTIFIER_LENGTH, "entry-%07d", number);
+}
+
+static void random_secret(char *secret, int length) {
+  static const char alphabet[] =
+      "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+  RAND_bytes((unsigned char *)secret, length);
+  for (int i = 0; i < length; i++) {
+    secret[i] = alphabet[(unsigned char)secret[i] % 64];
+  }
+
+  secret[length] = '\0';
+}
+
+/**
+ * Fills the secret with words and line breaks, which compress about as well
+ * as the notes people keep next to their passwords.
+ */
+static void note_secret(char *secret, int length) {
+  static const char *words[] = {
+      "account", "server",  "login",  "backup", "recovery", "code",
+      "the",     "for",     "and",    "with",   "port",     "host",
+      "user",    "admin",   "key",    "phone",  "pin",      "expires",
+      "email",   "address", "bank",   "card",   "number",   "token",
+      "ssh",     "root",    "vpn",    "wifi",   "router",   "network",
+      "office",  "home",    "shared", "old",    "new",      "primary"};
+  int word_count = sizeof(words) / sizeof(words[0]);
+
+  int at = 0;
+  while (at < length) {
+    const char *word = words[(unsigned)rand() % word_count];
+    int word_len = (int)strlen(word);
+    if (at + word_len + 1 > length) {
+      break;
+    }
+
+    memcpy(secret + at, word, word_len);
+    at += word_len;
+    secret[at++] = (unsigned)rand() % 12 == 0 ? '\n' : ' ';
+  }
+
+  memset(secret + at, '.', length - at);
+  secret[length] = '\0';
+}
+
+static void vault_secret(const BenchVault *vault, char *secret) {
+  if (vault->notes) {
+    note_secret(secret, vault->secret_length);
+  } else {
+    random_secret(secret, vault->secret_length);
+  }
+}
+
+static void remove_vault() {
+  static const char *suffixes[] = {"", ".journal", ".lock", ".tmp", NULL};
+  char db_path[FS_MAX_PATH_LENGTH];
+  get_db_path(db_path);
+
+  for (const char **suffix = suffixes; *suffix; suffix++) {
+    char path[FS_MAX_PATH_LENGTH + 16];
+    snprintf(path, sizeof(path), "%s%s", db_path, *suffix);
+    remove(path);
+  }
+}
+
+/**
+ * Writes a fresh vault of the given size in a single save.
+ */
+static void generate_vault(const BenchVault *vault, VaultKey *key) {
+  remove_vault();
+
+  if (!crypto_new_key(BENCH_MASTER_PWD, NULL, key)) {
+    fail("key derivation");
+  }
+
+  char *secret = malloc(vault->secret_length + 1);
+  Entries entries;
+  entries_init(&entries);
+
+  for (int i = 0; i < vault->size; i++) {
+    char identifier[BENCH_IDENTIFIER_LENGTH];
+    identifier_of(i, identifier);
+    vault_secret(vault, secret);
+
+    if (create_entry(&entries, -1, identifier, secret) < 0) {
+      fail("generating entries");
+    }
+  }
+
+  if (!save_database(key, &entries)) {
+    fail("saving the generated vault");
+  }
+
+  entries_free(&entries);
+  free(secret);
+}
+
+static int compare_samples(const void *a, const void *b) {
+  uint64_t first = *(const uint64_t *)a, second = *(const uint64_t *)b;
+  return first < second ? -1 : first > second;
+}
+
+static void record_result(const char *name, uint64_t *samples, int count,
+                          int ops_per_sample) {
+  if (result_count == BENCH_MAX_RESULTS) {
+    return;
+  }
+
+  uint64_t total = 0;
+  for (int i = 0; i < count; i++) {
+    total += samples[i];
+  }
+
+  qsort(samples, count, sizeof(uint64_t), compare_samples);
+  int p99_idx = count * 99 / 100 < count ? count * 99 / 100 : count - 1;
+
+  BenchResult *result = &results[result_count++];
+  snprintf(result->name, sizeof(result->name), "%s", name);
+  result->samples = count;
+  result->p50_us = samples[count / 2] / 1e3 / ops_per_sample;
+  result->p99_us = samples[p99_idx] / 1e3 / ops_per_sample;
+  result->ops_per_sec =
+      total > 0 ? (double)count * ops_per_sample * 1e9 / total : 0;
+
+  printf("%-28s %8d %12.3f %12.3f %12.0f\n", result->name, result->samples,
+         result->p50_us, result->p99_us, result->ops_per_sec);
+}
+
+static void bench_list(VaultKey *key) {
+  Entries entries;
+  if (!read_database(key, &entries)) {
+    fail("list");
+  }
+
+  size_t total = 0;
+  for (int i = 0; i < entries.count; i++) {
+    total += strlen(entries.items[i].identifier);
+  }
+
+  if (total == 0 && entries.count > 0) {
+    fail("list");
+  }
+
+  entries_free(&entries);
+}
+
+static void bench_get(VaultKey *key, int number) {
+  char identifier[BENCH_IDENTIFIER_LENGTH];
+  identifier_of(number, identifier);
+
+  Entries entries;
+  if (!read_database(key, &entries)) {
+    fail("get");
+  }
+
+  int entry_idx = find_password_entry(&entries, identifier);
+  if (entry_idx < 0 || !read_entry(key, &entries, entry_idx)) {
+    fail("get");
+  }
+
+  entries_free(&entries);
+}
+
+static void bench_add(VaultKey *key, int number, const BenchVault *vault) {
+  char identifier[BENCH_IDENTIFIER_LENGTH];
+  identifier_of(number, identifier);
+  char *secret = malloc(vault->secret_length + 1);
+  vault_secret(vault, secret);
+
+  Entries entries;
+  if (!read_database(key, &entries)) {
+    fail("add");
+  }
+
+  int entry_idx = find_password_entry(&entries, identifier);
+  if (create_entry(&entries, entry_idx, identifier, secret) < 0 ||
+      !save_database(key, &entries)) {
+    fail("add");
+  }
+
+  entries_free(&entries);
+  free(secret);
+}
+
+static void bench_del(VaultKey *key, int number) {
+  char identifier[BENCH_IDENTIFIER_LENGTH];
+  identifier_of(number, identifier);
+
+  Entries entries;
+  if (!read_database(key, &entries)) {
+    fail("del");
+  }
+
+  int entry_idx = find_password_entry(&entries, identifier);
+  if (entry_idx < 0 || !delete_entry(&entries, entry_idx) ||
+      !save_database(key, &entries)) {
+    fail("del");
+  }
+
+  entries_free(&entries);
+}
+
+typedef enum BenchOp {
+  OP_LIST,
+  OP_GET,
+  OP_ADD,
+  OP_DEL,
+} BenchOp;
+
+static const char *op_names[] = {"list", "get", "add", "del"};
+
+/**
+ * Measures one operation, cold or cached. Added entries get numbers past the
+ * end of the vault, so that del removes exactly what add has added.
+ */
+static void bench_op(const BenchVault *vault, VaultKey *key, BenchOp op,
+                     bool cold) {
+  int count = cold ? vault->cold_iterations : vault->iterations;
+  uint64_t *samples = malloc(count * sizeof(uint64_t));
+  int first_added = vault->size + (cold ? vault->iterations : 0);
+
+  for (int i = 0; i < count; i++) {
+    uint64_t start = trace_clock();
+
+    VaultKey unlocked;
+    VaultKey *used = key;
+    if (cold) {
+      if (!unlock_database(BENCH_MASTER_PWD, &unlocked)) {
+        fail("unlock");
+      }
+
+      used = &unlocked;
+    }
+
+    switch (op) {
+    case OP_LIST:
+      bench_list(used);
+      break;
+    case OP_GET:
+      bench_get(used, (int)((unsigned)rand() % vault->size));
+      break;
+    case OP_ADD:
+      bench_add(used, first_added + i, vault);
+      break;
+    case OP_DEL:
+      bench_del(used, first_added + i);
+      break;
+    }
+
+    samples[i] = trace_clock() - start;
+    if (cold) {
+      crypto_wipe_key(&unlocked);
+    }
+  }
+
+  char name[64];
+  snprintf(name, sizeof(name), "%d/%d %s %s", vault->size,
+           vault->secret_length, op_names[op], cold ? "cold" : "cached");
+  record_result(name, samples, count, 1);
+  free(samples);
+}
+
+/**
+ * Hash table lookups on a loaded vault, measured in batches, as a single
+ * lookup is below the resolution of the clock. Hot lookups go to one of four
+ * entries seven times out of eight, like the use of a real vault.
+ */
+static void bench_find(const BenchVault *vault, VaultKey *key, bool hot) {
+  Entries entries;
+  if (!read_database(key, &entries)) {
+    fail("find");
+  }
+
+  int count = vault->iterations;
+  uint64_t *samples = malloc(count * sizeof(uint64_t));
+  char(*identifiers)[BENCH_IDENTIFIER_LENGTH] =
+      malloc(BENCH_FIND_BATCH * BENCH_IDENTIFIER_LENGTH);
+
+  for (int i = 0; i < BENCH_FIND_BATCH; i++) {
+    bool skewed = hot && (unsigned)rand() % 8 != 0;
+    identifier_of((int)((unsigned)rand() % (skewed ? 4 : vault->size)),
+                  identifiers[i]);
+  }
+
+  for (int i = 0; i < count; i++) {
+    uint64_t start = trace_clock();
+    for (int j = 0; j < BENCH_FIND_BATCH; j++) {
+      if (entries_find(&entries, identifiers[j]) < 0) {
+        fail("find");
+      }
+    }
+    samples[i] = trace_clock() - start;
+  }
+
+  char name[64];
+  snprintf(name, sizeof(name), "%d/%d find %s", vault->size,
+           vault->secret_length, hot ? "hot" : "cached");
+  record_result(name, samples, count, BENCH_FIND_BATCH);
+
+  free(identifiers);
+  free(samples);
+  entries_free(&entries);
+}
+
+/**
+ * `pass find` on a loaded vault, with one pattern per kind of matching.
+ */
+static void bench_search(const BenchVault *vault, VaultKey *key) {
+  static const char *patterns[] = {"00042", "entry-00001", "*4?2", "e042"};
+  static const char *mode_names[] = {"substring", "prefix", "glob", "fuzzy"};
+
+  Entries entries;
+  if (!read_database(key, &entries)) {
+    fail("search");
+  }
+
+  char **identifiers = malloc(entries.count * sizeof(char *) + 1);
+  for (int i = 0; i < entries.count; i++) {
+    identifiers[i] = entries.items[i].identifier;
+  }
+
+  SearchIndex index;
+  if (!search_index_init(&index, identifiers, entries.count)) {
+    fail("search");
+  }
+
+  int count = vault->iterations;
+  uint64_t *samples = malloc(count * sizeof(uint64_t));
+
+  for (SearchMode mode = SEARCH_SUBSTRING; mode <= SEARCH_FUZZY; mode++) {
+    for (int i = 0; i < count; i++) {
+      SearchMatch *matches;
+      uint64_t start = trace_clock();
+      if (search_identifiers(&index, patterns[mode], mode, &matches) < 0) {
+        fail("search");
+      }
+      samples[i] = trace_clock() - start;
+      free(matches);
+    }
+
+    char name[64];
+    snprintf(name, sizeof(name), "%d/%d search %s", vault->size,
+             vault->secret_length, mode_names[mode]);
+    record_result(name, samples, count, 1);
+  }
+
+  free(samples);
+  search_index_free(&index);
+  free(identifiers);
+  entries_free(&entries);
+}
+
+/**
+ * Builds the text payload of legacy databases, one identifier|password line
+ * per entry, with generated secrets.
+ */
+static unsigned char *text_payload(Entries *entries, int secret_length,
+                                   size_t *length) {
+  *length = 0;
+  for (int i = 0; i < entries->count; i++) {
+    *length += strlen(entries->items[i].identifier) + secret_length + 2;
+  }
+
+  unsigned char *payload = malloc(*length + 1);
+  char *secret = malloc(secret_length + 1);
+  if (!payload || !secret) {
+    fail("parse");
+  }
+
+  char *ptr = (char *)payload;
+  for (int i = 0; i < entries->count; i++) {
+    random_secret(secret, secret_length);
+    ptr += sprintf(ptr, "%s|%s\n", entries->items[i].identifier, secret);
+  }
+
+  free(secret);
+  return payload;
+}
+
+/**
+ * Parsing the decrypted index of the loaded vault, and the same entries in
+ * the text format of legacy databases.
+ */
+static void bench_parse(const BenchVault *vault, VaultKey *key) {
+  static const char *kind_names[] = {"index", "text"};
+
+  Entries entries;
+  if (!read_database(key, &entries)) {
+    fail("parse");
+  }
+
+  int size = entries.count;
+  Entry **sorted = malloc(size * sizeof(Entry *) + 1);
+  uint64_t *record_offsets = malloc(size * sizeof(uint64_t) + 1);
+  uint32_t *record_lengths = malloc(size * sizeof(uint32_t) + 1);
+  if (!sorted || !record_offsets || !record_lengths) {
+    fail("parse");
+  }
+
+  for (int i = 0; i < size; i++) {
+    sorted[i] = &entries.items[i];
+    record_offsets[i] = entries.items[i].record_offset;
+    record_lengths[i] = entries.items[i].record_length;
+  }
+
+  unsigned char *payloads[2];
+  size_t payload_lengths[2];
+  if (!payload_serialize_index(sorted, record_offsets, record_lengths, size,
+                               &payloads[0], &payload_lengths[0])) {
+    fail("parse");
+  }
+  payloads[1] = text_payload(&entries, vault->secret_length,
+                             &payload_lengths[1]);
+
+  int count = vault->iterations;
+  uint64_t *samples = malloc(count * sizeof(uint64_t));
+
+  for (int kind = 0; kind < 2; kind++) {
+    for (int i = 0; i < count; i++) {
+      Entries parsed;
+      entries_init(&parsed);
+
+      uint64_t start = trace_clock();
+      if (!payload_parse(&parsed, payloads[kind], payload_lengths[kind]) ||
+          parsed.count != size) {
+        fail("parse");
+      }
+      samples[i] = trace_clock() - start;
+
+      entries_free(&parsed);
+    }
+
+    char name[64];
+    snprintf(name, sizeof(name), "%d/%d parse %s", vault->size,
+             vault->secret_length, kind_names[kind]);
+    record_result(name, samples, count, 1);
+    free(payloads[kind]);
+  }
+
+  free(samples);
+  free(record_lengths);
+  free(record_offsets);
+  free(sorted);
+  entries_free(&entries);
+}
+
+/**
+ * Writes a word list of distinct five letter words, as large as the common
+ * diceware lists.
+ */
+static void write_wordlist(char *path) {
+  snprintf(path, BENCH_PATH_LENGTH, "%s/words", bench_dir);
+  FILE *out = fopen(path, "w");
+  if (!out) {
+    fail("writing the word list");
+  }
+
+  for (int i = 0; i < BENCH_WORDLIST_SIZE; i++) {
+    char word[6];
+    for (int j = 0, rest = i; j < 5; j++, rest /= 26) {
+      word[j] = 'a' + rest % 26;
+    }
+    word[5] = '\0';
+    fprintf(out, "%s\n", word);
+  }
+
+  fclose(out);
+}
+
+/**
+ * Password generation with the default and a long policy and passphrases,
+ * measured in batches.
+ */
+static void bench_generate(int iterations) {
+  char wordlist[BENCH_PATH_LENGTH];
+  write_wordlist(wordlist);
+
+  PasswordPolicy policies[3];
+  const char *names[] = {"generate default", "generate luds64",
+                         "generate words6"};
+  generator_default_policy(&policies[0]);
+  generator_default_policy(&policies[1]);
+  policies[1].length = 64;
+  policies[1].classes = GENERATE_LOWER | GENERATE_UPPER | GENERATE_DIGITS |
+                        GENERATE_SYMBOLS;
+  generator_default_policy(&policies[2]);
+  policies[2].passphrase = true;
+  policies[2].wordlist = wordlist;
+  policies[2].length = GENERATE_DEFAULT_WORDS;
+
+  uint64_t *samples = malloc(iterations * sizeof(uint64_t));
+  char password[PASSWD_MAX_LENGTH];
+
+  for (int p = 0; p < 3; p++) {
+    // the word list is read before measuring
+    if (!generate_password(&policies[p], password)) {
+      fail("generate");
+    }
+
+    for (int i = 0; i < iterations; i++) {
+      uint64_t start = trace_clock();
+      for (int j = 0; j < BENCH_GENERATE_BATCH; j++) {
+        if (!generate_password(&policies[p], password)) {
+          fail("generate");
+        }
+      }
+      samples[i] = trace_clock() - start;
+    }
+
+    record_result(names[p], samples, iterations, BENCH_GENERATE_BATCH);
+    generator_policy_free(&policies[p]);
+  }
+
+  remove(wordlist);
+  free(samples);
+}
+
+static long long journal_size() {
+  DatabaseInfo info;
+  if (!database_info(&info)) {
+    fail("database info");
+  }
+
+  return info.journal_size;
+}
+
+/**
+ * Get and add on a vault of notes, stored as is and then compressed with
+ * deflate. Next to the latencies, the size of the database and the journal
+ * bytes appended by each add show how much less is read and written.
+ */
+static void bench_compression(const BenchVault *vault) {
+  static const unsigned char compressions[] = {COMPRESS_NONE,
+                                               COMPRESS_DEFLATE};
+
+  VaultKey key;
+  generate_vault(vault, &key);
+
+  int count = vault->iterations;
+  uint64_t *samples = malloc(count * sizeof(uint64_t));
+  int first_added = vault->size;
+
+  for (int c = 0; c < 2; c++) {
+    const char *compression = compress_name(compressions[c]);
+    if (compressions[c] != COMPRESS_NONE &&
+        !compress_database(&key, compressions[c])) {
+      fail("compress");
+    }
+
+    DatabaseInfo info;
+    if (!database_info(&info)) {
+      fail("database info");
+    }
+
+    char name[64];
+    for (int i = 0; i < count; i++) {
+      uint64_t start = trace_clock();
+      bench_get(&key, (int)((unsigned)rand() % vault->size));
+      samples[i] = trace_clock() - start;
+    }
+    snprintf(name, sizeof(name), "%d/%d notes get %s", vault->size,
+             vault->secret_length, compression);
+    record_result(name, samples, count, 1);
+
+    // the journal is folded back now and then, which shrinks it
+    long long appended = 0;
+    for (int i = 0; i < count; i++) {
+      long long before = journal_size();
+      uint64_t start = trace_clock();
+      bench_add(&key, first_added++, vault);
+      samples[i] = trace_clock() - start;
+
+      long long after = journal_size();
+      appended += after > before ? after - before : 0;
+    }
+    snprintf(name, sizeof(name), "%d/%d notes add %s", vault->size,
+             vault->secret_length, compression);
+    record_result(name, samples, count, 1);
+
+    printf("  %s: database %lld bytes, %lld journal bytes per add\n",
+           compression, info.database_size, appended / count);
+  }
+
+  free(samples);
+  crypto_wipe_key(&key);
+  remove_vault();
+}
+
+static void run_vault(const BenchVault *vault) {
+  VaultKey key;
+  generate_vault(vault, &key);
+
+  bench_find(vault, &key, false);
+  bench_find(vault, &key, true);
+  bench_search(vault, &key);
+  bench_parse(vault, &key);
+  for (BenchOp op = OP_LIST; op <= OP_DEL; op++) {
+    bench_op(vault, &key, op, false);
+  }
+  for (BenchOp op = OP_LIST; op <= OP_DEL; op++) {
+    bench_op(vault, &key, op, true);
+  }
+
+  crypto_wipe_key(&key);
+  remove_vault();
+}
+
+static bool write_baseline(const char *path) {
+  FILE *out = fopen(path, "w");
+  if (!out) {
+    fprintf(stderr, "pass_bench: unable to write %s\n", path);
+    return false;
+  }
+
+  fprintf(out, "# size/secret_length op mode | p50 us\n");
+  for (int i = 0; i < result_count; i++) {
+    fprintf(out, "%s|%.3f\n", results[i].name, results[i].p50_us);
+  }
+
+  fclose(out);
+  return true;
+}
+
+/**
+ * Compares the medians with the baseline; measurements missing from either
+ * side are ignored.
+ */
+static bool check_baseline(const char *path, double threshold) {
+  FILE *in = fopen(path, "r");
+  if (!in) {
+    fprintf(stderr, "pass_bench: unable to read %s\n", path);
+    return false;
+  }
+
+  bool ok = true;
+  char line[128];
+  while (fgets(line, sizeof(line), in)) {
+    char *separator = strchr(line, '|');
+    if (line[0] == '#' || !separator) {
+      continue;
+    }
+
+    *separator = '\0';
+    double baseline = atof(separator + 1);
+
+    for (int i = 0; i < result_count; i++) {
+      if (strcmp(results[i].name, line) != 0 ||
+          results[i].p50_us <= baseline * (1 + threshold)) {
+        continue;
+      }
+
+      fprintf(stderr, "regression: %s p50 %.3f us, baseline %.3f us\n",
+              results[i].name, results[i].p50_us, baseline);
+      ok = false;
+    }
+  }
+
+  fclose(in);
+  return ok;
+}
+
+static char *option_value(char *arg, const char *name) {
+  size_t name_len = strlen(name);
+  return strncmp(arg, name, name_len) == 0 && arg[name_len] == '='
+             ? arg + name_len + 1
+             : NULL;
+}
+
+int main(int argc, char **argv) {
+  bool quick = false;
+  char *baseline = NULL, *write_to = NULL;
+  double threshold = 0.5;
+
+  for (int i = 1; i < argc; i++) {
+    char *value;
+    if (strcmp(argv[i], "--quick") == 0) {
+      quick = true;
+    } else if ((value = option_value(argv[i], "--baseline"))) {
+      baseline = value;
+    } else if ((value = option_value(argv[i], "--write-baseline"))) {
+      write_to = value;
+    } else if ((value = option_value(argv[i], "--threshold"))) {
+      threshold = atof(value);
+    } else {
+      fprintf(stderr, "usage: pass_bench [--quick] [--baseline=file] "
+                      "[--threshold=ratio] [--write-baseline=file]\n");
+      return EXIT_FAILURE;
+    }
+  }
+
+  // baseline paths are relative to where the benchmark was started
+  char cwd[FS_MAX_PATH_LENGTH];
+  char baseline_path[2 * FS_MAX_PATH_LENGTH], write_path[2 * FS_MAX_PATH_LENGTH];
+  if (!getcwd(cwd, sizeof(cwd))) {
+    fail("getcwd");
+  }
+  if (baseline) {
+    snprintf(baseline_path, sizeof(baseline_path), "%s%s%s",
+             baseline[0] == '/' ? "" : cwd, baseline[0] == '/' ? "" : "/",
+             baseline);
+  }
+  if (write_to) {
+    snprintf(write_path, sizeof(write_path), "%s%s%s",
+             write_to[0] == '/' ? "" : cwd, write_to[0] == '/' ? "" : "/",
+             write_to);
+  }
+
+  char *tmp = getenv("TMPDIR");
+  snprintf(bench_dir, sizeof(bench_dir), "%s/pass_bench.XXXXXX",
+           tmp ? tmp : "/tmp");
+  if (!mkdtemp(bench_dir) || chdir(bench_dir) != 0 ||
+      setenv("HOME", bench_dir, 1) != 0) {
+    fail("creating the benchmark directory");
+  }
+
+  srand(1);
+  const BenchVault *vaults = quick ? quick_vaults : full_vaults;
+  int vault_count = quick ? sizeof(quick_vaults) / sizeof(BenchVault)
+                          : sizeof(full_vaults) / sizeof(BenchVault);
+
+  printf("search scanner: %s\n", search_scanner());
+  printf("%-28s %8s %12s %12s %12s\n", "size/secret op mode", "samples",
+         "p50 us", "p99 us", "ops/s");
+  bench_generate(quick ? 20 : 100);
+  for (int i = 0; i < vault_count; i++) {
+    run_vault(&vaults[i]);
+  }
+  bench_compression(quick ? &quick_notes : &full_notes);
+
+  chdir(cwd);
+  rmdir(bench_dir);
+
+  if (write_to && !write_baseline(write_path)) {
+    return EXIT_FAILURE;
+  }
+
+  if (baseline && !check_baseline(baseline_path, threshold)) {
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,236 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/**
+ * Runs concurrent writers against one vault and checks that none of their
+ * changes got lost. Every writer is a separate `pass batch` process with a
+ * single put or del, started all at once; the vault lives in a temporary
+ * directory, which is also used as the home directory.
+ *
+ * usage: pass_stress <pass executable>
+ *
+ * The processes run in a session of their own, without a controlling
+ * terminal, so that the master password prompt reads from stdin. The first
+ * round puts all entries, the second deletes half of them and overwrites the
+ * other half, both spanning a compaction of the journal. Afterwards the vault
+ * has to open and hold exactly the entries and passwords of the last round.
+ */
+
+#define STRESS_MASTER_PWD "stress master password"
+#define STRESS_WRITERS 40
+
+static char stress_dir[1024];
+static const char *pass_path;
+
+static void fail(const char *what) {
+  fprintf(stderr, "pass_stress: %s\n", what);
+  exit(EXIT_FAILURE);
+}
+
+/**
+ * Starts pass with the given arguments, writing input to its stdin and its
+ * stdout into the output file, if given.
+ */
+static pid_t start_pass(const char *input, const char *output, char *arg1,
+                        char *arg2) {
+  int in[2];
+  if (pipe(in) != 0) {
+    fail("pipe failed");
+  }
+
+  pid_t pid = fork();
+  if (pid < 0) {
+    fail("fork failed");
+  }
+
+  if (pid == 0) {
+    setsid();
+    dup2(in[0], STDIN_FILENO);
+    close(in[0]);
+    close(in[1]);
+
+    if (output && !freopen(output, "w", stdout)) {
+      _exit(EXIT_FAILURE);
+    }
+
+    execl(pass_path, pass_path, arg1, arg2, (char *)NULL);
+    _exit(EXIT_FAILURE);
+  }
+
+  close(in[0]);
+  // the prompt may not come, when the key is cached
+  size_t length = strlen(input);
+  if (write(in[1], input, length) != (ssize_t)length) {
+    fail("writing the master password failed");
+  }
+  close(in[1]);
+
+  return pid;
+}
+
+static bool finished(pid_t pid) {
+  int status;
+  return waitpid(pid, &status, 0) == pid && WIFEXITED(status) &&
+         WEXITSTATUS(status) == EXIT_SUCCESS;
+}
+
+static void write_batch(const char *path, const char *line) {
+  FILE *out = fopen(path, "w");
+  if (!out || fprintf(out, "%s\n", line) < 0 || fclose(out) != 0) {
+    fail("writing a batch file failed");
+  }
+}
+
+/**
+ * Runs one writer per line at once and waits for all of them.
+ */
+static void run_writers(char lines[][64], int count) {
+  pid_t pids[STRESS_WRITERS];
+  char path[32];
+
+  for (int i = 0; i < count; i++) {
+    snprintf(path, sizeof(path), "batch-%d", i);
+    write_batch(path, lines[i]);
+  }
+
+  for (int i = 0; i < count; i++) {
+    snprintf(path, sizeof(path), "batch-%d", i);
+    pids[i] = start_pass(STRESS_MASTER_PWD "\n", "/dev/null", "batch", path);
+  }
+
+  bool ok = true;
+  for (int i = 0; i < count; i++) {
+    if (!finished(pids[i])) {
+      fprintf(stderr, "pass_stress: writer \"%s\" failed\n", lines[i]);
+      ok = false;
+    }
+  }
+
+  if (!ok) {
+    fail("concurrent writers failed");
+  }
+}
+
+/**
+ * Looks up every entry in a single batch and compares the results with what
+ * the second round left behind.
+ */
+static bool check_vault() {
+  FILE *batch = fopen("check", "w");
+  if (!batch) {
+    fail("writing the check batch failed");
+  }
+  for (int i = 0; i < STRESS_WRITERS; i++) {
+    fprintf(batch, "get entry-%d\n", i);
+  }
+  fclose(batch);
+
+  pid_t pid = start_pass(STRESS_MASTER_PWD "\n", "results", "batch", "check");
+  if (!finished(pid)) {
+    fail("opening the vault failed");
+  }
+
+  FILE *in = fopen("results", "r");
+  if (!in) {
+    fail("reading the results failed");
+  }
+
+  bool ok = true;
+  char line[256];
+  for (int i = 0; i < STRESS_WRITERS; i++) {
+    char expected[128];
+    if (i % 2 == 0) {
+      snprintf(expected, sizeof(expected), "not_found\tget\tentry-%d\n", i);
+    } else {
+      snprintf(expected, sizeof(expected), "ok\tget\tentry-%d\tsecond-%d\n",
+               i, i);
+    }
+
+    if (!fgets(line, sizeof(line), in) || strcmp(line, expected) != 0) {
+      fprintf(stderr, "pass_stress: expected %s", expected);
+      ok = false;
+    }
+  }
+
+  fclose(in);
+  return ok;
+}
+
+static void remove_stress_dir() {
+  // the key cache and identifier index are keyed by the vault's directory
+  static const int project_ids[] = {'p', 'i'};
+  for (int i = 0; i < 2; i++) {
+    key_t key = ftok(stress_dir, project_ids[i]);
+    int id = key < 0 ? -1 : shmget(key, 0, 0600);
+    if (id >= 0) {
+      shmctl(id, IPC_RMID, NULL);
+    }
+  }
+
+  char command[sizeof(stress_dir) + 16];
+  snprintf(command, sizeof(command), "rm -rf '%s'", stress_dir);
+  if (system(command) != 0) {
+    fprintf(stderr, "pass_stress: unable to remove %s\n", stress_dir);
+  }
+}
+
+int main(int argc, char **argv) {
+  if (argc != 2) {
+    fprintf(stderr, "usage: pass_stress <pass executable>\n");
+    return EXIT_FAILURE;
+  }
+
+  pass_path = argv[1];
+  if (pass_path[0] != '/') {
+    fail("the pass executable has to be given by its absolute path");
+  }
+
+  char *tmp = getenv("TMPDIR");
+  snprintf(stress_dir, sizeof(stress_dir), "%s/pass_stress.XXXXXX",
+           tmp ? tmp : "/tmp");
+  if (!mkdtemp(stress_dir) || chdir(stress_dir) != 0 ||
+      setenv("HOME", stress_dir, 1) != 0) {
+    fail("creating the stress directory failed");
+  }
+
+  // the master password is asked for twice when the vault is created
+  write_batch("create", "put initial initial");
+  if (!finished(start_pass(STRESS_MASTER_PWD "\n" STRESS_MASTER_PWD "\n",
+                           "/dev/null", "batch", "create"))) {
+    remove_stress_dir();
+    fail("creating the vault failed");
+  }
+
+  char lines[STRESS_WRITERS][64];
+  for (int i = 0; i < STRESS_WRITERS; i++) {
+    snprintf(lines[i], sizeof(lines[i]), "put entry-%d first-%d", i, i);
+  }
+  run_writers(lines, STRESS_WRITERS);
+
+  for (int i = 0; i < STRESS_WRITERS; i++) {
+    if (i % 2 == 0) {
+      snprintf(lines[i], sizeof(lines[i]), "del entry-%d", i);
+    } else {
+      snprintf(lines[i], sizeof(lines[i]), "put entry-%d second-%d", i, i);
+    }
+  }
+  run_writers(lines, STRESS_WRITERS);
+
+  bool ok = check_vault();
+  chdir("/");
+  remove_stress_dir();
+
+  if (!ok) {
+    fail("committed changes are missing from the vault");
+  }
+
+  printf("pass_stress: %d concurrent writers, twice, all changes kept\n",
+         STRESS_WRITERS);
+  return EXIT_SUCCESS;
+}
@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #ifdef _WIN32
@@ -10,15 +11,16 @@
 
 #include "error.h"
 #include "password.h"
-
-// should not clash with base64 characters or user provided passwords
-#define IDENT_PASSWD_DELIMITER "|"
+#include "trace.h"
 
 #ifdef _WIN32
+// maximum characters accepted at a password prompt
+#define PROMPT_MAX_LENGTH 1024
+
 char *getpass(const char *prompt) {
   printf(prompt);
 
-  static char password[PASSWD_MAX_LENGTH];
+  static char password[PROMPT_MAX_LENGTH];
   memset(password, '\0', sizeof(password));
 
   int count = 0;
@@ -40,7 +42,7 @@ char *getpass(const char *prompt) {
       password[count++] = in;
     }
 
-    if (count >= PASSWD_MAX_LENGTH - 1) {
+    if (count >= PROMPT_MAX_LENGTH - 1) {
       // cannot store any more, stop here
       break;
     }
@@ -53,53 +55,63 @@ char *getpass(const char *prompt) {
 }
 #endif
 
-void obtain_master_password(char *master_pwd, bool confirm) {
-  char *pass = getpass("Master password: ");
-  strcpy(master_pwd, pass);
+// passwords typed at a prompt, released once all of them were freed
+static Arena prompted;
+static int prompted_count;
 
-  // wait for matching password
-  while (confirm && strcmp(master_pwd, getpass("Repeat password: ")) != 0)
-    ;
+/**
+ * Copies the password out of getpass' static buffer into the locked arena,
+ * wiping the former.
+ */
+static char *take_password(char *pass) {
+  char *password = arena_strndup(&prompted, pass, strlen(pass));
+  memset(pass, 0, strlen(pass));
+
+  if (password) {
+    prompted_count++;
+  }
+
+  return password;
 }
 
-bool obtain_user_password(char *password) {
-  // ensure user provided password does not clash with delimiter
-  char *pass = getpass("Secret: ");
-  strcpy(password, pass);
+static bool passwords_match(char *password, char *prompt) {
+  char *repeated = getpass(prompt);
+  bool match = strcmp(password, repeated) == 0;
+  memset(repeated, 0, strlen(repeated));
+  return match;
+}
 
-  if (strstr(password, IDENT_PASSWD_DELIMITER) != NULL) {
-    last_error = ERR_PASSWD_INVALID;
-    return false;
-  }
+char *obtain_master_password(const char *prompt, bool confirm) {
+  char *master_pwd = take_password(getpass(prompt));
 
   // wait for matching password
-  while (strcmp(password, getpass("Repeat secret: ")) != 0)
+  while (master_pwd && confirm &&
+         !passwords_match(master_pwd, "Repeat password: "))
     ;
 
-  return true;
+  return master_pwd;
 }
 
-bool generate_random_password(char *password, int byte_count) {
-  char command[50];
-  sprintf(command, "openssl rand -base64 %d", byte_count);
-
-  FILE *gen = popen(command, "r");
-  if (!gen) {
-    last_error = ERR_PASSWD_GENERATION;
-    return false;
+char *obtain_user_password() {
+  char *password = take_password(getpass("Secret: "));
+  if (!password) {
+    return NULL;
   }
 
-  // read until new line is consumed and then remove the new line
-  char *res = fgets(password, PASSWD_MAX_LENGTH, gen);
-  strtok(password, "\n");
-  pclose(gen);
+  // wait for matching password
+  while (!passwords_match(password, "Repeat secret: "))
+    ;
 
-  if (!res) {
-    last_error = ERR_PASSWD_GENERATION;
-    return false;
-  }
+  return password;
+}
 
-  return true;
+void free_password(char *password) {
+  if (password) {
+    memset(password, 0, strlen(password));
+    if (--prompted_count == 0) {
+      arena_free(&prompted);
+    }
+  }
 }
 
 bool check_password_identifier(char *identifier) {
@@ -122,37 +134,137 @@ bool check_password_identifier(char *identifier) {
   return true;
 }
 
-int find_password_entry(Lines entries, int num_entries, char *identifier) {
-  for (int i = 0; i < num_entries; i++) {
-    Line temp;
-    memcpy(temp, entries[i], sizeof(Line));
+int find_password_entry(Entries *entries, char *identifier) {
+  uint64_t trace = trace_begin();
+  int entry_idx = entries_find(entries, identifier);
+  trace_end("find", trace);
+  return entry_idx;
+}
+
+/**
+ * Stores the password under the identifier, either replacing the password of
+ * the existing entry at entry_idx, or appending a new entry if entry_idx < 0.
+ * Passwords generated into the entries arena are kept as they are. Returns
+ * the index of the entry, or -1 on failure.
+ */
+int create_entry(Entries *entries, int entry_idx, char *identifier,
+                 char *password) {
+  char *password_copy =
+      arena_contains(&entries->arena, password)
+          ? password
+          : arena_strndup(&entries->arena, password, strlen(password));
+  if (!password_copy) {
+    return -1;
+  }
 
-    char *current_identifier = strtok(temp, IDENT_PASSWD_DELIMITER);
-    if (strcmp(current_identifier, identifier) == 0) {
-      return i;
+  EntryChange change = {NULL, password_copy, (uint32_t)time(NULL), 0};
+  if (entry_idx >= 0) {
+    Entry *entry = &entries->items[entry_idx];
+    change.identifier = entry->identifier;
+    if (!entries_log_change(entries, &change)) {
+      return -1;
     }
+
+    entry->password = password_copy;
+    entry->sealed = false;
+    entry->modified = change.time;
+    return entry_idx;
+  }
+
+  change.identifier =
+      arena_strndup(&entries->arena, identifier, strlen(identifier));
+  if (!change.identifier || !entries_log_change(entries, &change) ||
+      !entries_append(entries, change.identifier, password_copy)) {
+    return -1;
   }
 
-  return -1;
+  Entry *entry = &entries->items[entries->count - 1];
+  entry->created = change.time;
+  entry->modified = change.time;
+  return entries->count - 1;
 }
 
-void password_from_entry(Line password, Line entry) {
-  memcpy(password, entry, sizeof(Line));
-  strtok(password, IDENT_PASSWD_DELIMITER);
-  char *second = strtok(NULL, IDENT_PASSWD_DELIMITER);
-  memcpy(password, second, PASSWD_MAX_LENGTH);
+bool delete_entry(Entries *entries, int entry_idx) {
+  EntryChange change = {entries->items[entry_idx].identifier, NULL,
+                        (uint32_t)time(NULL), 0};
+  if (!entries_log_change(entries, &change)) {
+    return false;
+  }
+
+  entries_remove(entries, entry_idx);
+  return true;
+}
+
+/**
+ * Records that the password of the entry was used count times, the last one
+ * at the given time; the accesses are saved along with the next change, or in
+ * the journal, never by rewriting the database.
+ */
+bool touch_entry(Entries *entries, int entry_idx, uint32_t time,
+                 uint32_t count) {
+  Entry *entry = &entries->items[entry_idx];
+  EntryChange change = {entry->identifier, NULL, time, count};
+  if (!entries_log_change(entries, &change)) {
+    return false;
+  }
+
+  entry->accessed = time > entry->accessed ? time : entry->accessed;
+  entry->access_count += count;
+  return true;
 }
 
-void entries_to_identifiers(Lines identifiers, Lines entries, int num_entries) {
-  for (int i = 0; i < num_entries; i++) {
-    Line temp;
-    memcpy(temp, entries[i], sizeof(Line));
+// most recently used first, then most frequently used, then by name
+static int compare_recent(const void *a, const void *b) {
+  const Entry *first = *(const Entry **)a;
+  const Entry *second = *(const Entry **)b;
+  if (first->accessed != second->accessed) {
+    return first->accessed > second->accessed ? -1 : 1;
+  }
+  if (first->access_count != second->access_count) {
+    return first->access_count > second->access_count ? -1 : 1;
+  }
+
+  return strcmp(first->identifier, second->identifier);
+}
 
-    char *identifier = strtok(temp, IDENT_PASSWD_DELIMITER);
-    memcpy(identifiers[i], identifier, sizeof(Line));
+// most frequently used first, then most recently used, then by name
+static int compare_frequent(const void *a, const void *b) {
+  const Entry *first = *(const Entry **)a;
+  const Entry *second = *(const Entry **)b;
+  if (first->access_count != second->access_count) {
+    return first->access_count > second->access_count ? -1 : 1;
   }
+
+  return compare_recent(a, b);
 }
 
-void create_entry(Line entry, char *identifier, char *password) {
-  sprintf(entry, "%s%s%s", identifier, IDENT_PASSWD_DELIMITER, password);
+/**
+ * Identifiers of all entries in the given order; the list has to be freed,
+ * but the identifiers belong to the entries.
+ */
+char **ordered_identifiers(Entries *entries, EntryOrder order) {
+  Entry **sorted = malloc(entries->count * sizeof(Entry *) + 1);
+  char **identifiers = malloc(entries->count * sizeof(char *) + 1);
+  if (!sorted || !identifiers) {
+    free(sorted);
+    free(identifiers);
+    last_error = ERR_OUT_OF_MEMORY;
+    return NULL;
+  }
+
+  for (int i = 0; i < entries->count; i++) {
+    sorted[i] = &entries->items[i];
+  }
+
+  if (order != ORDER_STORED) {
+    qsort(sorted, entries->count, sizeof(Entry *),
+          order == ORDER_RECENT ? compare_recent : compare_frequent);
+  }
+
+  for (int i = 0; i < entries->count; i++) {
+    identifiers[i] = sorted[i]->identifier;
+  }
+
+  free(sorted);
+  return identifiers;
 }
@@ -1,12 +1,23 @@
 #include <stdbool.h>
 
 #include "common.h"
+#include "entries.h"
 
-void obtain_master_password(char *master_pwd, bool confirm);
-bool obtain_user_password(char *password);
-bool generate_random_password(char *password, int byte_count);
+// orders in which entries are listed
+typedef enum EntryOrder {
+  ORDER_STORED,
+  ORDER_RECENT,
+  ORDER_FREQUENT,
+} EntryOrder;
+
+char *obtain_master_password(const char *prompt, bool confirm);
+char *obtain_user_password();
+void free_password(char *password);
 bool check_password_identifier(char *identifier);
-int find_password_entry(Lines entries, int num_entries, char *identifier);
-void password_from_entry(Line password, Line entry);
-void entries_to_identifiers(Lines identifiers, Lines entries, int num_entries);
-void create_entry(Line entry, char *identifier, char *password);
+int find_password_entry(Entries *entries, char *identifier);
+int create_entry(Entries *entries, int entry_idx, char *identifier,
+                 char *password);
+bool delete_entry(Entries *entries, int entry_idx);
+bool touch_entry(Entries *entries, int entry_idx, uint32_t time,
+                 uint32_t count);
+char **ordered_identifiers(Entries *entries, EntryOrder order);
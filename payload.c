@@ -0,0 +1,475 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "error.h"
+#include "payload.h"
+
+/**
+ * Binary payload layout, all integers are little-endian uint32 unless noted:
+ *
+ *   "PASSDB" version:u16 count
+ *   offsets[count]                  record positions within the payload
+ *   records[count]                  sorted by identifier
+ *
+ * where a version 1 record is identifier_len, identifier, '\0', password_len,
+ * password, '\0', as stored inside legacy databases. A version 2 record is
+ * identifier_len, identifier, '\0', record_offset:u64, record_length and
+ * locates the sealed password record; version 2 payloads are the index of the
+ * current database format. The terminators are part of the format, so that
+ * parsed entries can point straight into the payload.
+ *
+ * Version 3 payloads are journal transactions, a list of changes without an
+ * offset table: identifier_len, identifier, '\0', password_len, password,
+ * '\0', with a password_len of UINT32_MAX and no password marking deletions.
+ *
+ * Versions 4 and 5 are written instead of 2 and 3, and add the usage of each
+ * entry: version 4 records end in created, modified, accessed and
+ * access_count, and version 5 changes in time and accesses, where a
+ * password_len of UINT32_MAX - 1 and no password mark accesses to the entry.
+ */
+#define PAYLOAD_MAGIC "PASSDB"
+#define PAYLOAD_MAGIC_LENGTH 6
+#define PAYLOAD_VERSION_PASSWORDS 1
+#define PAYLOAD_VERSION_INDEX 2
+#define PAYLOAD_VERSION_CHANGES 3
+#define PAYLOAD_VERSION_USAGE_INDEX 4
+#define PAYLOAD_VERSION_USAGE_CHANGES 5
+#define CHANGE_DELETED UINT32_MAX
+#define CHANGE_ACCESSED (UINT32_MAX - 1)
+#define PAYLOAD_HEADER_LENGTH (PAYLOAD_MAGIC_LENGTH + 2 + 4)
+#define INDEX_LOCATOR_LENGTH (8 + 4)
+#define INDEX_USAGE_LENGTH (4 * 4)
+#define CHANGE_USAGE_LENGTH (4 + 4)
+
+// delimiter of the text format used by earlier versions, one
+// identifier|password entry per line
+#define LEGACY_DELIMITER '|'
+
+static uint32_t read_u32(const unsigned char *ptr) {
+  return (uint32_t)ptr[0] | (uint32_t)ptr[1] << 8 | (uint32_t)ptr[2] << 16 |
+         (uint32_t)ptr[3] << 24;
+}
+
+static unsigned char *write_u32(unsigned char *ptr, uint32_t value) {
+  ptr[0] = value;
+  ptr[1] = value >> 8;
+  ptr[2] = value >> 16;
+  ptr[3] = value >> 24;
+  return ptr + 4;
+}
+
+/**
+ * Reads a length-prefixed, terminated string at offset, advancing offset
+ * past it and storing its length. Returns NULL if the string does not fit
+ * the payload.
+ */
+static char *read_string(unsigned char *payload, size_t payload_len,
+                         size_t *offset, size_t *length) {
+  if (payload_len < *offset || payload_len - *offset < 4) {
+    return NULL;
+  }
+
+  *length = read_u32(payload + *offset);
+  size_t start = *offset + 4;
+  if (payload_len - start < *length + 1 ||
+      payload[start + *length] != '\0') {
+    return NULL;
+  }
+
+  *offset = start + *length + 1;
+  return (char *)payload + start;
+}
+
+static uint64_t read_u64(const unsigned char *ptr) {
+  return (uint64_t)read_u32(ptr) | (uint64_t)read_u32(ptr + 4) << 32;
+}
+
+static unsigned char *write_u64(unsigned char *ptr, uint64_t value) {
+  write_u32(ptr, value);
+  return write_u32(ptr + 4, value >> 32);
+}
+
+/**
+ * Reads the locator of a sealed record at offset, advancing offset past it.
+ */
+static bool read_locator(unsigned char *payload, size_t payload_len,
+                         size_t *offset, Entry *entry) {
+  if (payload_len - *offset < INDEX_LOCATOR_LENGTH) {
+    return false;
+  }
+
+  entry->record_offset = read_u64(payload + *offset);
+  entry->record_length = read_u32(payload + *offset + 8);
+  *offset += INDEX_LOCATOR_LENGTH;
+  return true;
+}
+
+/**
+ * Appends the record at offset to the entries. A record which does not fit
+ * the available bytes is left out, setting incomplete.
+ */
+static bool parse_record(Entries *entries, int version, unsigned char *payload,
+                         size_t available, size_t offset, bool *incomplete) {
+  size_t identifier_len, password_len;
+  char *identifier =
+      read_string(payload, available, &offset, &identifier_len);
+  *incomplete = !identifier;
+  if (*incomplete) {
+    return false;
+  }
+
+  if (version == PAYLOAD_VERSION_PASSWORDS) {
+    char *password = read_string(payload, available, &offset, &password_len);
+    *incomplete = !password;
+    return !*incomplete &&
+           entries_append_view(entries, identifier, identifier_len, password);
+  }
+
+  Entry locator;
+  bool usage = version == PAYLOAD_VERSION_USAGE_INDEX;
+  *incomplete = !read_locator(payload, available, &offset, &locator) ||
+                (usage && available - offset < INDEX_USAGE_LENGTH);
+  if (*incomplete ||
+      !entries_append_view(entries, identifier, identifier_len, NULL)) {
+    return false;
+  }
+
+  Entry *entry = &entries->items[entries->count - 1];
+  entry->sealed = true;
+  entry->record_offset = locator.record_offset;
+  entry->record_length = locator.record_length;
+
+  if (usage) {
+    entry->created = read_u32(payload + offset);
+    entry->modified = read_u32(payload + offset + 4);
+    entry->accessed = read_u32(payload + offset + 8);
+    entry->access_count = read_u32(payload + offset + 12);
+  }
+
+  return true;
+}
+
+/**
+ * Parses as many records of a binary payload as the first available bytes
+ * hold, continuing where the previous call stopped; the stream is done once
+ * all records are parsed. Records cut short are tried again on the next
+ * call, and only count as corrupt once the whole payload is available.
+ */
+bool payload_parse_stream(Entries *entries, PayloadStream *stream,
+                          unsigned char *payload, size_t available,
+                          size_t payload_len) {
+  bool complete = available == payload_len;
+  if (stream->version == 0) {
+    if (available < PAYLOAD_HEADER_LENGTH && !complete) {
+      return true;
+    }
+
+    int version = payload_len >= PAYLOAD_HEADER_LENGTH &&
+                          memcmp(payload, PAYLOAD_MAGIC,
+                                 PAYLOAD_MAGIC_LENGTH) == 0
+                      ? payload[PAYLOAD_MAGIC_LENGTH] |
+                            payload[PAYLOAD_MAGIC_LENGTH + 1] << 8
+                      : 0;
+
+    if (version != PAYLOAD_VERSION_PASSWORDS &&
+        version != PAYLOAD_VERSION_INDEX &&
+        version != PAYLOAD_VERSION_USAGE_INDEX) {
+      last_error = ERR_DB_CORRUPT;
+      return false;
+    }
+
+    size_t count = read_u32(payload + PAYLOAD_MAGIC_LENGTH + 2);
+    if ((payload_len - PAYLOAD_HEADER_LENGTH) / 4 < count) {
+      last_error = ERR_DB_CORRUPT;
+      return false;
+    }
+
+    // the count is known up front, which saves growing the entries
+    // repeatedly
+    if (!entries_reserve(entries, entries->count + (int)count)) {
+      return false;
+    }
+
+    stream->version = version;
+    stream->count = count;
+  }
+
+  unsigned char *offsets = payload + PAYLOAD_HEADER_LENGTH;
+  for (; stream->parsed < stream->count; stream->parsed++) {
+    size_t i = stream->parsed;
+    if ((available - PAYLOAD_HEADER_LENGTH) / 4 <= i) {
+      return true;
+    }
+
+    bool incomplete;
+    if (!parse_record(entries, stream->version, payload, available,
+                      read_u32(offsets + i * 4), &incomplete)) {
+      if (incomplete && complete) {
+        last_error = ERR_DB_CORRUPT;
+      }
+
+      return incomplete && !complete;
+    }
+  }
+
+  entries_rank_hot(entries);
+  stream->done = true;
+  return true;
+}
+
+/**
+ * Delimiters and line breaks of the text format are replaced in place with
+ * string terminators.
+ */
+static bool parse_lines(Entries *entries, char *payload, size_t payload_len) {
+  char *line = payload;
+  char *end = payload + payload_len;
+
+  while (line < end) {
+    char *eol = memchr(line, '\n', end - line);
+    size_t len = (eol ? eol : end) - line;
+    line[len] = '\0';
+
+    if (len > 0) {
+      char *delimiter = memchr(line, LEGACY_DELIMITER, len);
+      char *password = line + len;
+      size_t identifier_len = len;
+
+      if (delimiter) {
+        *delimiter = '\0';
+        password = delimiter + 1;
+        identifier_len = delimiter - line;
+      }
+
+      if (!entries_append_view(entries, line, identifier_len, password)) {
+        return false;
+      }
+    }
+
+    line += len + 1;
+  }
+
+  return true;
+}
+
+/**
+ * Terminated copy of the payload in the entries arena, unless it was
+ * decrypted there to begin with.
+ */
+static char *arena_payload(Entries *entries, unsigned char *plain,
+                           size_t plain_len) {
+  if (arena_contains(&entries->arena, plain)) {
+    plain[plain_len] = '\0';
+    return (char *)plain;
+  }
+
+  return arena_strndup(&entries->arena, (char *)plain, plain_len);
+}
+
+/**
+ * Entries point straight into a single copy of the decrypted payload, kept in
+ * the entries arena. Besides the index, this understands the password lists
+ * stored inside legacy databases, in both the binary and the text format.
+ * Payloads decrypted into the arena already are used in place.
+ */
+bool payload_parse(Entries *entries, unsigned char *plain, size_t plain_len) {
+  char *payload = arena_payload(entries, plain, plain_len);
+  if (!payload) {
+    return false;
+  }
+
+  if (plain_len >= PAYLOAD_MAGIC_LENGTH &&
+      memcmp(payload, PAYLOAD_MAGIC, PAYLOAD_MAGIC_LENGTH) == 0) {
+    PayloadStream stream = {0};
+    return payload_parse_stream(entries, &stream, (unsigned char *)payload,
+                                plain_len, plain_len);
+  }
+
+  return parse_lines(entries, payload, plain_len);
+}
+
+/**
+ * Size of the serialized index, which does not depend on where the records
+ * end up.
+ */
+size_t payload_index_length(Entry **entries, int count) {
+  size_t length = PAYLOAD_HEADER_LENGTH + count * 4;
+  for (int i = 0; i < count; i++) {
+    length += 4 + entries[i]->identifier_length + 1 + INDEX_LOCATOR_LENGTH +
+              INDEX_USAGE_LENGTH;
+  }
+
+  return length;
+}
+
+/**
+ * Serializes the index of the current database format; sorted holds the
+ * entries in identifier order, together with the new location of each sealed
+ * record.
+ */
+bool payload_serialize_index(Entry **sorted, uint64_t *record_offsets,
+                             uint32_t *record_lengths, int count,
+                             unsigned char **plain, size_t *plain_len) {
+  size_t length = PAYLOAD_HEADER_LENGTH + count * 4;
+  for (int i = 0; i < count; i++) {
+    length += 4 + sorted[i]->identifier_length + 1 + INDEX_LOCATOR_LENGTH +
+              INDEX_USAGE_LENGTH;
+  }
+
+  unsigned char *payload = malloc(length);
+  if (!payload) {
+    last_error = ERR_OUT_OF_MEMORY;
+    return false;
+  }
+
+  memcpy(payload, PAYLOAD_MAGIC, PAYLOAD_MAGIC_LENGTH);
+  payload[PAYLOAD_MAGIC_LENGTH] = PAYLOAD_VERSION_USAGE_INDEX;
+  payload[PAYLOAD_MAGIC_LENGTH + 1] = 0;
+  write_u32(payload + PAYLOAD_MAGIC_LENGTH + 2, count);
+
+  unsigned char *offsets = payload + PAYLOAD_HEADER_LENGTH;
+  unsigned char *ptr = offsets + count * 4;
+
+  for (int i = 0; i < count; i++) {
+    write_u32(offsets + i * 4, ptr - payload);
+
+    size_t identifier_len = sorted[i]->identifier_length;
+    ptr = write_u32(ptr, identifier_len);
+    memcpy(ptr, sorted[i]->identifier, identifier_len + 1);
+    ptr += identifier_len + 1;
+
+    ptr = write_u64(ptr, record_offsets[i]);
+    ptr = write_u32(ptr, record_lengths[i]);
+
+    ptr = write_u32(ptr, sorted[i]->created);
+    ptr = write_u32(ptr, sorted[i]->modified);
+    ptr = write_u32(ptr, sorted[i]->accessed);
+    ptr = write_u32(ptr, sorted[i]->access_count);
+  }
+
+  *plain = payload;
+  *plain_len = length;
+  return true;
+}
+
+bool payload_serialize_changes(Entries *entries, unsigned char **plain,
+                               size_t *plain_len) {
+  size_t length = PAYLOAD_HEADER_LENGTH;
+  for (int i = 0; i < entries->change_count; i++) {
+    EntryChange *change = &entries->changes[i];
+    length += 4 + strlen(change->identifier) + 1 + 4 + CHANGE_USAGE_LENGTH;
+    length += change->password ? strlen(change->password) + 1 : 0;
+  }
+
+  unsigned char *payload = malloc(length);
+  if (!payload) {
+    last_error = ERR_OUT_OF_MEMORY;
+    return false;
+  }
+
+  memcpy(payload, PAYLOAD_MAGIC, PAYLOAD_MAGIC_LENGTH);
+  payload[PAYLOAD_MAGIC_LENGTH] = PAYLOAD_VERSION_USAGE_CHANGES;
+  payload[PAYLOAD_MAGIC_LENGTH + 1] = 0;
+  write_u32(payload + PAYLOAD_MAGIC_LENGTH + 2, entries->change_count);
+
+  unsigned char *ptr = payload + PAYLOAD_HEADER_LENGTH;
+  for (int i = 0; i < entries->change_count; i++) {
+    EntryChange *change = &entries->changes[i];
+
+    size_t identifier_len = strlen(change->identifier);
+    ptr = write_u32(ptr, identifier_len);
+    memcpy(ptr, change->identifier, identifier_len + 1);
+    ptr += identifier_len + 1;
+
+    if (change->password) {
+      size_t password_len = strlen(change->password);
+      ptr = write_u32(ptr, password_len);
+      memcpy(ptr, change->password, password_len + 1);
+      ptr += password_len + 1;
+    } else {
+      ptr = write_u32(ptr,
+                      change->accesses > 0 ? CHANGE_ACCESSED : CHANGE_DELETED);
+    }
+
+    ptr = write_u32(ptr, change->time);
+    ptr = write_u32(ptr, change->accesses);
+  }
+
+  *plain = payload;
+  *plain_len = length;
+  return true;
+}
+
+/**
+ * Replays a journal transaction on top of the entries; like the other
+ * payloads, the strings are kept in a single copy in the entries arena.
+ */
+bool payload_apply_changes(Entries *entries, unsigned char *plain,
+                           size_t plain_len) {
+  unsigned char *payload =
+      (unsigned char *)arena_payload(entries, plain, plain_len);
+  if (!payload) {
+    return false;
+  }
+
+  int version = plain_len >= PAYLOAD_HEADER_LENGTH &&
+                        payload[PAYLOAD_MAGIC_LENGTH + 1] == 0
+                    ? payload[PAYLOAD_MAGIC_LENGTH]
+                    : 0;
+  if (plain_len < PAYLOAD_HEADER_LENGTH ||
+      memcmp(payload, PAYLOAD_MAGIC, PAYLOAD_MAGIC_LENGTH) != 0 ||
+      (version != PAYLOAD_VERSION_CHANGES &&
+       version != PAYLOAD_VERSION_USAGE_CHANGES)) {
+    last_error = ERR_DB_CORRUPT;
+    return false;
+  }
+
+  size_t count = read_u32(payload + PAYLOAD_MAGIC_LENGTH + 2);
+  size_t offset = PAYLOAD_HEADER_LENGTH;
+
+  for (size_t i = 0; i < count; i++) {
+    size_t identifier_len, password_len;
+    char *identifier =
+        read_string(payload, plain_len, &offset, &identifier_len);
+    if (!identifier || plain_len - offset < 4) {
+      last_error = ERR_DB_CORRUPT;
+      return false;
+    }
+
+    EntryChange change = {identifier, NULL, 0, 0};
+    uint32_t marker = read_u32(payload + offset);
+    bool accessed =
+        version == PAYLOAD_VERSION_USAGE_CHANGES && marker == CHANGE_ACCESSED;
+    if (marker == CHANGE_DELETED || accessed) {
+      offset += 4;
+    } else if (!(change.password = read_string(payload, plain_len, &offset,
+                                               &password_len))) {
+      last_error = ERR_DB_CORRUPT;
+      return false;
+    }
+
+    if (version == PAYLOAD_VERSION_USAGE_CHANGES) {
+      if (plain_len - offset < CHANGE_USAGE_LENGTH) {
+        last_error = ERR_DB_CORRUPT;
+        return false;
+      }
+
+      change.time = read_u32(payload + offset);
+      change.accesses = accessed ? read_u32(payload + offset + 4) : 0;
+      offset += CHANGE_USAGE_LENGTH;
+    }
+
+    // accesses without a count would read as deletions
+    if (accessed && change.accesses == 0) {
+      last_error = ERR_DB_CORRUPT;
+      return false;
+    }
+
+    if (!entries_apply_change(entries, &change)) {
+      return false;
+    }
+  }
+
+  return true;
+}
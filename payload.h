@@ -0,0 +1,29 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "entries.h"
+
+// progress of parsing a binary payload which becomes available piece by
+// piece, zeroed before the first piece
+typedef struct PayloadStream {
+  int version;
+  size_t count;
+  size_t parsed;
+  bool done;
+} PayloadStream;
+
+bool payload_parse(Entries *entries, unsigned char *plain, size_t plain_len);
+bool payload_parse_stream(Entries *entries, PayloadStream *stream,
+                          unsigned char *payload, size_t available,
+                          size_t payload_len);
+size_t payload_index_length(Entry **entries, int count);
+bool payload_serialize_index(Entry **sorted, uint64_t *record_offsets,
+                             uint32_t *record_lengths, int count,
+                             unsigned char **plain, size_t *plain_len);
+bool payload_serialize_changes(Entries *entries, unsigned char **plain,
+                               size_t *plain_len);
+bool payload_apply_changes(Entries *entries, unsigned char *plain,
+                           size_t plain_len);
@@ -0,0 +1,680 @@
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define SEARCH_X86
+#endif
+
+#include "error.h"
+#include "search.h"
+#include "trace.h"
+
+// upper bound of the ranking penalty for a single property of a match
+#define SEARCH_MAX_PENALTY 100
+
+// scores are clamped to this range for ranking the matches
+#define SEARCH_MAX_SCORE 4096
+
+/**
+ * Returns the position of the first occurrence of needle at or after from,
+ * or length if there is none. Needles are never empty.
+ */
+typedef size_t (*Scanner)(const char *haystack, size_t length,
+                          const char *needle, size_t needle_len, size_t from);
+
+static size_t scan_scalar(const char *haystack, size_t length,
+                          const char *needle, size_t needle_len, size_t from) {
+  while (from + needle_len <= length) {
+    const char *hit =
+        memchr(haystack + from, needle[0], length - needle_len + 1 - from);
+    if (!hit) {
+      break;
+    }
+
+    if (memcmp(hit + 1, needle + 1, needle_len - 1) == 0) {
+      return hit - haystack;
+    }
+
+    from = hit - haystack + 1;
+  }
+
+  return length;
+}
+
+/**
+ * The vectorized scanners compare a whole block of positions against the
+ * first and the last byte of the needle at once, and only compare the rest
+ * of the needle where both of them match.
+ */
+#ifdef SEARCH_X86
+__attribute__((target("sse2"))) static size_t
+scan_sse2(const char *haystack, size_t length, const char *needle,
+          size_t needle_len, size_t from) {
+  const __m128i first = _mm_set1_epi8(needle[0]);
+  const __m128i last = _mm_set1_epi8(needle[needle_len - 1]);
+
+  while (from + needle_len - 1 + 16 <= length) {
+    __m128i block_first = _mm_loadu_si128((const __m128i *)(haystack + from));
+    __m128i block_last =
+        _mm_loadu_si128((const __m128i *)(haystack + from + needle_len - 1));
+    unsigned mask = _mm_movemask_epi8(_mm_and_si128(
+        _mm_cmpeq_epi8(block_first, first), _mm_cmpeq_epi8(block_last, last)));
+
+    while (mask) {
+      size_t pos = from + __builtin_ctz(mask);
+      if (memcmp(haystack + pos + 1, needle + 1, needle_len - 1) == 0) {
+        return pos;
+      }
+
+      mask &= mask - 1;
+    }
+
+    from += 16;
+  }
+
+  return scan_scalar(haystack, length, needle, needle_len, from);
+}
+
+__attribute__((target("avx2"))) static size_t
+scan_avx2(const char *haystack, size_t length, const char *needle,
+          size_t needle_len, size_t from) {
+  const __m256i first = _mm256_set1_epi8(needle[0]);
+  const __m256i last = _mm256_set1_epi8(needle[needle_len - 1]);
+
+  while (from + needle_len - 1 + 32 <= length) {
+    __m256i block_first =
+        _mm256_loadu_si256((const __m256i *)(haystack + from));
+    __m256i block_last =
+        _mm256_loadu_si256((const __m256i *)(haystack + from + needle_len - 1));
+    unsigned mask = (unsigned)_mm256_movemask_epi8(
+        _mm256_and_si256(_mm256_cmpeq_epi8(block_first, first),
+                         _mm256_cmpeq_epi8(block_last, last)));
+
+    while (mask) {
+      size_t pos = from + __builtin_ctz(mask);
+      if (memcmp(haystack + pos + 1, needle + 1, needle_len - 1) == 0) {
+        return pos;
+      }
+
+      mask &= mask - 1;
+    }
+
+    from += 32;
+  }
+
+  return scan_scalar(haystack, length, needle, needle_len, from);
+}
+#endif
+
+static Scanner scanner;
+static const char *scanner_name;
+
+static void select_scanner() {
+  if (scanner) {
+    return;
+  }
+
+  scanner = scan_scalar;
+  scanner_name = "scalar";
+
+#ifdef SEARCH_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    scanner = scan_avx2;
+    scanner_name = "avx2";
+  } else if (__builtin_cpu_supports("sse2")) {
+    scanner = scan_sse2;
+    scanner_name = "sse2";
+  }
+#endif
+}
+
+/**
+ * Name of the scanner used on this machine.
+ */
+const char *search_scanner() {
+  select_scanner();
+  return scanner_name;
+}
+
+static char lower(char c) { return c >= 'A' && c <= 'Z' ? c + 32 : c; }
+
+/**
+ * Every identifier has a mask of the characters it contains, which rules out
+ * most identifiers before they are matched against a glob or fuzzy pattern.
+ */
+static uint64_t char_mask(char c) {
+  if (c >= 'a' && c <= 'z') {
+    return 1ULL << (c - 'a');
+  }
+
+  if (c >= '0' && c <= '9') {
+    return 1ULL << (26 + c - '0');
+  }
+
+  return 1ULL << (36 + (unsigned char)c % 28);
+}
+
+static bool has_wildcards(const char *pattern) {
+  return strpbrk(pattern, "*?[") != NULL;
+}
+
+/**
+ * Parses the --match option; without one, patterns with wildcards are globs
+ * and all others are searched for as substrings.
+ */
+bool search_mode(char *name, char *pattern, SearchMode *mode) {
+  if (!name) {
+    *mode = pattern && has_wildcards(pattern) ? SEARCH_GLOB : SEARCH_SUBSTRING;
+  } else if (strcmp(name, "substring") == 0) {
+    *mode = SEARCH_SUBSTRING;
+  } else if (strcmp(name, "prefix") == 0) {
+    *mode = SEARCH_PREFIX;
+  } else if (strcmp(name, "glob") == 0) {
+    *mode = SEARCH_GLOB;
+  } else if (strcmp(name, "fuzzy") == 0) {
+    *mode = SEARCH_FUZZY;
+  } else {
+    return false;
+  }
+
+  return true;
+}
+
+bool search_index_init(SearchIndex *index, char **identifiers, int count) {
+  memset(index, 0, sizeof(SearchIndex));
+
+  size_t length = 1;
+  for (int i = 0; i < count; i++) {
+    length += strlen(identifiers[i]) + 1;
+  }
+
+  index->packed = length <= UINT32_MAX ? malloc(length + 1) : NULL;
+  index->offsets = malloc((count + 1) * sizeof(uint32_t));
+  index->masks = malloc(count * sizeof(uint64_t) + 1);
+  if (!index->packed || !index->offsets || !index->masks) {
+    search_index_free(index);
+    last_error = ERR_OUT_OF_MEMORY;
+    return false;
+  }
+
+  char *ptr = index->packed;
+  *ptr++ = '\n';
+  for (int i = 0; i < count; i++) {
+    index->offsets[i] = ptr - index->packed;
+    index->masks[i] = 0;
+    for (char *id = identifiers[i]; *id != '\0'; id++) {
+      *ptr = lower(*id);
+      index->masks[i] |= char_mask(*ptr++);
+    }
+    *ptr++ = '\n';
+  }
+
+  *ptr = '\0';
+  index->offsets[count] = length;
+  index->length = length;
+  index->identifiers = identifiers;
+  index->count = count;
+  return true;
+}
+
+void search_index_free(SearchIndex *index) {
+  free(index->packed);
+  free(index->offsets);
+  free(index->masks);
+  memset(index, 0, sizeof(SearchIndex));
+}
+
+static const char *identifier_at(SearchIndex *index, int entry, size_t *len) {
+  *len = index->offsets[entry + 1] - index->offsets[entry] - 1;
+  return index->packed + index->offsets[entry];
+}
+
+static bool word_start(const char *identifier, size_t pos) {
+  return pos == 0 || identifier[pos - 1] == '-' || identifier[pos - 1] == '_';
+}
+
+static int penalty(size_t value) {
+  return value < SEARCH_MAX_PENALTY ? (int)value : SEARCH_MAX_PENALTY;
+}
+
+/**
+ * Collects every identifier containing the needle, at most once each,
+ * scored by where the needle was found first.
+ */
+static int scan_identifiers(SearchIndex *index, const char *needle,
+                            size_t needle_len, SearchMatch *matches) {
+  int found = 0;
+  int entry = 0;
+  size_t from = 0;
+
+  while (true) {
+    size_t pos = scanner(index->packed, index->length, needle, needle_len, from);
+    if (pos >= index->length) {
+      break;
+    }
+
+    while (index->offsets[entry + 1] <= pos) {
+      entry++;
+    }
+
+    size_t id_len;
+    const char *identifier = identifier_at(index, entry, &id_len);
+    size_t offset = pos - index->offsets[entry];
+
+    int score = 1000 - penalty(offset) - penalty(id_len - needle_len);
+    if (id_len == needle_len) {
+      score += 1000;
+    }
+    if (offset == 0) {
+      score += 500;
+    } else if (word_start(identifier, offset)) {
+      score += 250;
+    }
+
+    matches[found].index = entry;
+    matches[found].score = score;
+    found++;
+
+    // the rest of this identifier does not matter any more
+    from = index->offsets[entry + 1];
+  }
+
+  return found;
+}
+
+/**
+ * The needle starts with the new line preceding every identifier in the
+ * packed buffer, so that it only matches at their start.
+ */
+static int search_prefix(SearchIndex *index, const char *needle,
+                         size_t needle_len, SearchMatch *matches) {
+  int found = 0;
+  int entry = 0;
+  size_t from = 0;
+
+  while (true) {
+    size_t pos = scanner(index->packed, index->length, needle, needle_len, from);
+    // the last new line only ends the last identifier
+    if (pos + 1 >= index->length) {
+      break;
+    }
+
+    while (index->offsets[entry] <= pos) {
+      entry++;
+    }
+
+    size_t id_len;
+    identifier_at(index, entry, &id_len);
+
+    matches[found].index = entry;
+    matches[found].score = 1000 - penalty(id_len + 1 - needle_len);
+    found++;
+
+    from = index->offsets[entry];
+  }
+
+  return found;
+}
+
+/**
+ * Returns the closing bracket of the character class starting at pattern,
+ * or NULL if the bracket is to be taken literally.
+ */
+static const char *class_end(const char *pattern) {
+  const char *ptr = pattern + 1;
+  if (*ptr == '!' || *ptr == '^') {
+    ptr++;
+  }
+
+  // a leading bracket is part of the class
+  if (*ptr == ']') {
+    ptr++;
+  }
+
+  return strchr(ptr, ']');
+}
+
+/**
+ * Matches c against the next token of the pattern other than '*', and
+ * advances the pattern past it.
+ */
+static bool glob_char(const char **pattern, char c) {
+  const char *ptr = *pattern;
+  const char *end = *ptr == '[' ? class_end(ptr) : NULL;
+
+  if (*ptr == '?') {
+    *pattern = ptr + 1;
+    return true;
+  }
+
+  if (!end) {
+    *pattern = ptr + 1;
+    return *ptr == c;
+  }
+
+  bool negate = ptr[1] == '!' || ptr[1] == '^';
+  bool matched = false;
+  for (ptr += 1 + negate; ptr < end; ptr++) {
+    if (ptr + 2 < end && ptr[1] == '-') {
+      matched |= c >= ptr[0] && c <= ptr[2];
+      ptr += 2;
+    } else {
+      matched |= *ptr == c;
+    }
+  }
+
+  *pattern = end + 1;
+  return matched != negate;
+}
+
+/**
+ * Counts the characters matched by a pattern without stars.
+ */
+static size_t glob_length(const char *pattern) {
+  size_t length = 0;
+  for (const char *ptr = pattern; *ptr != '\0'; ptr++) {
+    const char *end = *ptr == '[' ? class_end(ptr) : NULL;
+    ptr = end ? end : ptr;
+    length++;
+  }
+
+  return length;
+}
+
+static bool glob_match(const char *pattern, const char *text,
+                       size_t text_len) {
+  // position to return to after a mismatch, past the last star
+  const char *star = NULL;
+  size_t star_text = 0;
+
+  size_t pos = 0;
+  while (pos < text_len) {
+    if (*pattern == '*') {
+      star = ++pattern;
+      star_text = pos;
+      continue;
+    }
+
+    const char *next = pattern;
+    if (*pattern != '\0' && glob_char(&next, text[pos])) {
+      pattern = next;
+      pos++;
+      continue;
+    }
+
+    if (!star) {
+      return false;
+    }
+
+    pattern = star;
+    pos = ++star_text;
+  }
+
+  while (*pattern == '*') {
+    pattern++;
+  }
+
+  return *pattern == '\0';
+}
+
+/**
+ * Finds the longest run of the pattern which every match has to contain.
+ */
+static size_t glob_literal(const char *pattern, const char **literal) {
+  size_t longest = 0;
+  const char *run = pattern;
+
+  for (const char *ptr = pattern;; ptr++) {
+    const char *end = *ptr == '[' ? class_end(ptr) : NULL;
+    bool wildcard = *ptr == '*' || *ptr == '?' || end;
+
+    if (wildcard || *ptr == '\0') {
+      if ((size_t)(ptr - run) > longest) {
+        longest = ptr - run;
+        *literal = run;
+      }
+
+      if (*ptr == '\0') {
+        break;
+      }
+
+      ptr = end ? end : ptr;
+      run = ptr + 1;
+    }
+  }
+
+  return longest;
+}
+
+/**
+ * Mask of the characters outside of wildcards, which every match contains.
+ */
+static uint64_t glob_mask(const char *pattern) {
+  uint64_t mask = 0;
+  for (const char *ptr = pattern; *ptr != '\0'; ptr++) {
+    const char *end = *ptr == '[' ? class_end(ptr) : NULL;
+    if (end) {
+      ptr = end;
+    } else if (*ptr != '*' && *ptr != '?') {
+      mask |= char_mask(*ptr);
+    }
+  }
+
+  return mask;
+}
+
+/**
+ * Only identifiers containing the longest literal part of the pattern are
+ * matched against the whole pattern.
+ */
+static int search_glob(SearchIndex *index, const char *pattern,
+                       SearchMatch *matches) {
+  const char *literal = NULL;
+  size_t literal_len = glob_literal(pattern, &literal);
+  uint64_t mask = glob_mask(pattern);
+
+  // whatever follows the last star has to match the end of the identifier
+  const char *tail = strrchr(pattern, '*');
+  tail = tail ? tail + 1 : NULL;
+  size_t tail_len = tail ? glob_length(tail) : 0;
+
+  // a single character is better left to the mask
+  int candidates = index->count;
+  if (literal_len > 1) {
+    candidates = scan_identifiers(index, literal, literal_len, matches);
+  } else {
+    for (int i = 0; i < index->count; i++) {
+      matches[i].index = i;
+    }
+  }
+
+  int found = 0;
+  for (int i = 0; i < candidates; i++) {
+    if ((index->masks[matches[i].index] & mask) != mask) {
+      continue;
+    }
+
+    size_t id_len;
+    const char *identifier = identifier_at(index, matches[i].index, &id_len);
+    if (tail && (id_len < tail_len ||
+                 !glob_match(tail, identifier + id_len - tail_len, tail_len))) {
+      continue;
+    }
+
+    if (!glob_match(pattern, identifier, id_len)) {
+      continue;
+    }
+
+    matches[found].index = matches[i].index;
+    matches[found].score = 1000 - penalty(id_len);
+    found++;
+  }
+
+  return found;
+}
+
+/**
+ * Scores the needle as a subsequence of the identifier, or returns -1 if it
+ * is not one. The shortest window ending at the first complete match is
+ * scored, favouring consecutive characters and the starts of words.
+ */
+static int fuzzy_score(const char *identifier, size_t id_len,
+                       const char *needle, size_t needle_len) {
+  size_t end = 0;
+  for (size_t i = 0; i < needle_len; i++) {
+    const char *hit = memchr(identifier + end, needle[i], id_len - end);
+    if (!hit) {
+      return -1;
+    }
+
+    end = hit - identifier + 1;
+  }
+
+  size_t start = end;
+  for (size_t remaining = needle_len; remaining > 0;) {
+    start--;
+    if (identifier[start] == needle[remaining - 1]) {
+      remaining--;
+    }
+  }
+
+  int score = 0;
+  int run = 0;
+  size_t matched = 0;
+  for (size_t pos = start; pos < end; pos++) {
+    if (identifier[pos] != needle[matched]) {
+      run = 0;
+      score -= 2;
+      continue;
+    }
+
+    score += 16 + 8 * run;
+    if (word_start(identifier, pos)) {
+      score += 12;
+    }
+
+    run = run < 4 ? run + 1 : run;
+    matched++;
+  }
+
+  return 1000 + score - penalty(start) - penalty(id_len - needle_len) / 4;
+}
+
+static int search_fuzzy(SearchIndex *index, const char *needle,
+                        size_t needle_len, SearchMatch *matches) {
+  uint64_t mask = 0;
+  for (size_t i = 0; i < needle_len; i++) {
+    mask |= char_mask(needle[i]);
+  }
+
+  int found = 0;
+  for (int i = 0; i < index->count; i++) {
+    if ((index->masks[i] & mask) != mask) {
+      continue;
+    }
+
+    size_t id_len;
+    const char *identifier = identifier_at(index, i, &id_len);
+    int score = fuzzy_score(identifier, id_len, needle, needle_len);
+    if (score < 0) {
+      continue;
+    }
+
+    matches[found].index = i;
+    matches[found].score = score;
+    found++;
+  }
+
+  return found;
+}
+
+/**
+ * Sorts the matches by their score, best first, with a counting sort; equally
+ * good matches keep the order of the identifiers.
+ */
+static bool rank_matches(SearchMatch *matches, int found) {
+  int *counts = calloc(SEARCH_MAX_SCORE + 1, sizeof(int));
+  SearchMatch *ranked = malloc(found * sizeof(SearchMatch) + 1);
+  if (!counts || !ranked) {
+    free(counts);
+    free(ranked);
+    return false;
+  }
+
+  for (int i = 0; i < found; i++) {
+    int score = matches[i].score;
+    score = score < 0 ? 0 : score;
+    score = score >= SEARCH_MAX_SCORE ? SEARCH_MAX_SCORE - 1 : score;
+    matches[i].score = score;
+    counts[SEARCH_MAX_SCORE - score]++;
+  }
+
+  // start of each score in the ranking, the best one first
+  for (int i = 1; i <= SEARCH_MAX_SCORE; i++) {
+    counts[i] += counts[i - 1];
+  }
+
+  for (int i = 0; i < found; i++) {
+    int rank = SEARCH_MAX_SCORE - 1 - matches[i].score;
+    ranked[counts[rank]++] = matches[i];
+  }
+
+  memcpy(matches, ranked, found * sizeof(SearchMatch));
+  free(ranked);
+  free(counts);
+  return true;
+}
+
+/**
+ * Matches the pattern against all identifiers, case insensitively, and
+ * returns the number of matches, best ones first, or -1 on failure. The
+ * matches are to be freed by the caller.
+ */
+int search_identifiers(SearchIndex *index, const char *pattern,
+                       SearchMode mode, SearchMatch **matches) {
+  uint64_t trace = trace_begin();
+  select_scanner();
+
+  // the lower case pattern follows a new line, for prefix searches
+  size_t needle_len = strlen(pattern);
+  char *anchored = malloc(needle_len + 2);
+  char *needle = anchored + 1;
+  *matches = malloc(index->count * sizeof(SearchMatch) + 1);
+  if (!anchored || !*matches) {
+    free(anchored);
+    free(*matches);
+    last_error = ERR_OUT_OF_MEMORY;
+    return -1;
+  }
+
+  anchored[0] = '\n';
+  for (size_t i = 0; i <= needle_len; i++) {
+    needle[i] = lower(pattern[i]);
+  }
+
+  int found = 0;
+  if (strchr(needle, '\n')) {
+    // identifiers never span lines of the packed buffer
+  } else if (mode == SEARCH_GLOB) {
+    found = search_glob(index, needle, *matches);
+  } else if (mode == SEARCH_PREFIX || needle_len == 0) {
+    found = search_prefix(index, anchored, needle_len + 1, *matches);
+  } else if (mode == SEARCH_SUBSTRING) {
+    found = scan_identifiers(index, needle, needle_len, *matches);
+  } else {
+    found = search_fuzzy(index, needle, needle_len, *matches);
+  }
+
+  free(anchored);
+
+  if (!rank_matches(*matches, found)) {
+    free(*matches);
+    last_error = ERR_OUT_OF_MEMORY;
+    return -1;
+  }
+
+  trace_end("search", trace);
+  return found;
+}
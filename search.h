@@ -0,0 +1,37 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef enum SearchMode {
+  SEARCH_SUBSTRING,
+  SEARCH_PREFIX,
+  SEARCH_GLOB,
+  SEARCH_FUZZY,
+} SearchMode;
+
+// identifiers packed into one contiguous buffer for scanning; the buffer
+// holds lower case copies, each preceded and followed by a new line
+typedef struct SearchIndex {
+  char *packed;
+  size_t length;
+  // start of each identifier within the packed buffer, plus its end
+  uint32_t *offsets;
+  // characters contained in each identifier
+  uint64_t *masks;
+  char **identifiers;
+  int count;
+} SearchIndex;
+
+typedef struct SearchMatch {
+  int index;
+  int score;
+} SearchMatch;
+
+bool search_mode(char *name, char *pattern, SearchMode *mode);
+const char *search_scanner();
+bool search_index_init(SearchIndex *index, char **identifiers, int count);
+int search_identifiers(SearchIndex *index, const char *pattern,
+                       SearchMode mode, SearchMatch **matches);
+void search_index_free(SearchIndex *index);
@@ -0,0 +1,140 @@
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#include <unistd.h>
+#endif
+
+#include "trace.h"
+
+/**
+ * Time spent in each phase of a run is summed up per phase name. With
+ * PASS_TRACE=1 the totals are printed to stderr when the process exits, with
+ * PASS_TRACE=json as a single JSON object instead.
+ */
+#define TRACE_MAX_PHASES 32
+
+typedef struct TracePhase {
+  const char *name;
+  int calls;
+  uint64_t total_ns;
+} TracePhase;
+
+typedef enum TraceOutput {
+  TRACE_OFF,
+  TRACE_TEXT,
+  TRACE_JSON,
+} TraceOutput;
+
+static TracePhase phases[TRACE_MAX_PHASES];
+static int phase_count;
+static TraceOutput output;
+static uint64_t started_at;
+// phases may end on several threads at once
+static atomic_flag phases_busy = ATOMIC_FLAG_INIT;
+#ifndef _WIN32
+// daemons forked off the main process must not report
+static pid_t traced_pid;
+#endif
+
+uint64_t trace_clock() {
+#ifdef _WIN32
+  LARGE_INTEGER counter, frequency;
+  QueryPerformanceCounter(&counter);
+  QueryPerformanceFrequency(&frequency);
+  return (uint64_t)(counter.QuadPart * 1000000000.0 / frequency.QuadPart);
+#else
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000u + now.tv_nsec;
+#endif
+}
+
+static TracePhase *find_phase(const char *name) {
+  for (int i = 0; i < phase_count; i++) {
+    if (strcmp(phases[i].name, name) == 0) {
+      return &phases[i];
+    }
+  }
+
+  return NULL;
+}
+
+static void report() {
+#ifndef _WIN32
+  if (getpid() != traced_pid) {
+    return;
+  }
+#endif
+
+  trace_end("total", started_at);
+
+  if (output == TRACE_JSON) {
+    fprintf(stderr, "{\"phases\": [");
+    for (int i = 0; i < phase_count; i++) {
+      fprintf(stderr, "%s{\"name\": \"%s\", \"calls\": %d, \"ms\": %.3f}",
+              i > 0 ? ", " : "", phases[i].name, phases[i].calls,
+              phases[i].total_ns / 1e6);
+    }
+    fprintf(stderr, "]}\n");
+    return;
+  }
+
+  fprintf(stderr, "%-16s %8s %12s\n", "phase", "calls", "total ms");
+  for (int i = 0; i < phase_count; i++) {
+    fprintf(stderr, "%-16s %8d %12.3f\n", phases[i].name, phases[i].calls,
+            phases[i].total_ns / 1e6);
+  }
+}
+
+void trace_init() {
+  started_at = trace_clock();
+
+  char *setting = getenv("PASS_TRACE");
+  if (!setting || *setting == '\0' || strcmp(setting, "0") == 0) {
+    return;
+  }
+
+  output = strcmp(setting, "json") == 0 ? TRACE_JSON : TRACE_TEXT;
+#ifndef _WIN32
+  traced_pid = getpid();
+#endif
+  atexit(report);
+}
+
+uint64_t trace_begin() { return trace_clock(); }
+
+/**
+ * Adds the time since start to the phase; phases are recorded even without
+ * PASS_TRACE, so that `pass stats` can report them.
+ */
+void trace_end(const char *phase, uint64_t start) {
+  uint64_t elapsed = trace_clock() - start;
+
+  while (atomic_flag_test_and_set_explicit(&phases_busy, memory_order_acquire))
+    ;
+
+  TracePhase *entry = find_phase(phase);
+  if (!entry && phase_count < TRACE_MAX_PHASES) {
+    entry = &phases[phase_count++];
+    entry->name = phase;
+  }
+
+  if (entry) {
+    entry->calls++;
+    entry->total_ns += elapsed;
+  }
+
+  atomic_flag_clear_explicit(&phases_busy, memory_order_release);
+}
+
+uint64_t trace_total(const char *phase) {
+  TracePhase *entry = find_phase(phase);
+  return entry ? entry->total_ns : 0;
+}
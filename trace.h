@@ -0,0 +1,9 @@
+#pragma once
+
+#include <stdint.h>
+
+void trace_init();
+uint64_t trace_clock();
+uint64_t trace_begin();
+void trace_end(const char *phase, uint64_t start);
+uint64_t trace_total(const char *phase);
@@ -0,0 +1,710 @@
+#include <openssl/crypto.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "database.h"
+#include "error.h"
+#include "password.h"
+#include "transfer.h"
+
+/**
+ * Import and export of plain entries. Both formats are processed one record
+ * at a time through fixed buffers, so memory use does not depend on the size
+ * of the file:
+ *
+ *   CSV   identifier,password per line, quoted as in RFC 4180; a header line
+ *         naming the identifier (or name, title) and password columns selects
+ *         them among any others
+ *   JSON  array of objects with "identifier" and "password" strings, other
+ *         members are ignored
+ */
+#define TRANSFER_MAX_FIELD_LENGTH (64 * 1024)
+#define CSV_MAX_FIELDS 32
+#define JSON_MAX_KEY_LENGTH 32
+#define JSON_MAX_DEPTH 16
+
+typedef struct Importer {
+  FILE *in;
+  TransferFormat format;
+  // CSV fields are stored back to back in the record buffer
+  char *record;
+  char *fields[CSV_MAX_FIELDS];
+  int field_count;
+  int identifier_column;
+  int password_column;
+  // JSON strings of the current object
+  char *identifier;
+  char *password;
+  bool json_started;
+} Importer;
+
+bool transfer_format(char *name, char *path, TransferFormat *format) {
+  if (!name) {
+    char *extension = path ? strrchr(path, '.') : NULL;
+    *format = extension && strcmp(extension, ".json") == 0 ? FORMAT_JSON
+                                                            : FORMAT_CSV;
+    return true;
+  }
+
+  if (strcmp(name, "csv") == 0) {
+    *format = FORMAT_CSV;
+  } else if (strcmp(name, "json") == 0) {
+    *format = FORMAT_JSON;
+  } else {
+    return false;
+  }
+
+  return true;
+}
+
+bool conflict_policy(char *name, ConflictPolicy *policy) {
+  if (!name || strcmp(name, "skip") == 0) {
+    *policy = CONFLICT_SKIP;
+  } else if (strcmp(name, "overwrite") == 0) {
+    *policy = CONFLICT_OVERWRITE;
+  } else if (strcmp(name, "fail") == 0) {
+    *policy = CONFLICT_FAIL;
+  } else {
+    return false;
+  }
+
+  return true;
+}
+
+/**
+ * Exported passwords are in plain text, so the file is only readable by the
+ * user.
+ */
+FILE *open_export_file(char *path) {
+#ifdef _WIN32
+  FILE *out = fopen(path, "w");
+#else
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  FILE *out = fd >= 0 ? fdopen(fd, "w") : NULL;
+  if (fd >= 0 && !out) {
+    close(fd);
+  }
+#endif
+
+  if (!out) {
+    last_error = ERR_TRANSFER_FILE;
+  }
+
+  return out;
+}
+
+/**
+ * Reads the next CSV record into the record buffer. Returns 1 for a record, 0
+ * at the end of the input and -1 for malformed input.
+ */
+static int read_csv_record(Importer *importer) {
+  FILE *in = importer->in;
+  size_t length = 0;
+  importer->field_count = 0;
+
+  int c = getc(in);
+  if (c == EOF) {
+    return 0;
+  }
+
+  for (;;) {
+    if (importer->field_count == CSV_MAX_FIELDS) {
+      return -1;
+    }
+
+    importer->fields[importer->field_count++] = importer->record + length;
+
+    bool quoted = c == '"';
+    if (quoted) {
+      c = getc(in);
+    }
+
+    for (;;) {
+      if (quoted && c == '"') {
+        // either an escaped quote or the end of the quoted part
+        c = getc(in);
+        if (c != '"') {
+          quoted = false;
+          continue;
+        }
+      } else if (quoted && c == EOF) {
+        return -1;
+      } else if (!quoted && (c == ',' || c == '\n' || c == EOF)) {
+        break;
+      } else if (!quoted && c == '\r') {
+        c = getc(in);
+        if (c != '\n') {
+          return -1;
+        }
+        break;
+      }
+
+      // keep room for the terminator
+      if (length + 1 >= TRANSFER_MAX_FIELD_LENGTH) {
+        return -1;
+      }
+
+      importer->record[length++] = c;
+      c = getc(in);
+    }
+
+    importer->record[length++] = '\0';
+    if (c != ',') {
+      return 1;
+    }
+
+    c = getc(in);
+  }
+}
+
+static int find_column(Importer *importer, const char **names) {
+  for (int i = 0; i < importer->field_count; i++) {
+    for (const char **name = names; *name; name++) {
+      if (strcmp(importer->fields[i], *name) == 0) {
+        return i;
+      }
+    }
+  }
+
+  return -1;
+}
+
+/**
+ * Picks up the column layout from a header line, if the first record is one;
+ * otherwise the first two columns are identifier and password.
+ */
+static bool read_csv_header(Importer *importer) {
+  static const char *identifier_names[] = {"identifier", "name", "title", NULL};
+  static const char *password_names[] = {"password", NULL};
+
+  importer->identifier_column = find_column(importer, identifier_names);
+  importer->password_column = find_column(importer, password_names);
+
+  if (importer->identifier_column >= 0 && importer->password_column >= 0) {
+    return true;
+  }
+
+  importer->identifier_column = 0;
+  importer->password_column = 1;
+  return false;
+}
+
+static int next_csv_entry(Importer *importer, char **identifier,
+                          char **password) {
+  for (;;) {
+    int result = read_csv_record(importer);
+    if (result <= 0) {
+      return result;
+    }
+
+    if (importer->identifier_column < 0 && read_csv_header(importer)) {
+      continue;
+    }
+
+    // blank lines
+    if (importer->field_count == 1 && importer->fields[0][0] == '\0') {
+      continue;
+    }
+
+    if (importer->identifier_column >= importer->field_count ||
+        importer->password_column >= importer->field_count) {
+      return -1;
+    }
+
+    *identifier = importer->fields[importer->identifier_column];
+    *password = importer->fields[importer->password_column];
+    return 1;
+  }
+}
+
+static int skip_json_space(FILE *in) {
+  int c;
+  do {
+    c = getc(in);
+  } while (c == ' ' || c == '\t' || c == '\n' || c == '\r');
+
+  return c;
+}
+
+static int hex_value(int c) {
+  if (c >= '0' && c <= '9') {
+    return c - '0';
+  }
+  if (c >= 'a' && c <= 'f') {
+    return c - 'a' + 10;
+  }
+  if (c >= 'A' && c <= 'F') {
+    return c - 'A' + 10;
+  }
+
+  return -1;
+}
+
+static long read_json_hex(FILE *in) {
+  long value = 0;
+  for (int i = 0; i < 4; i++) {
+    int digit = hex_value(getc(in));
+    if (digit < 0) {
+      return -1;
+    }
+
+    value = value << 4 | digit;
+  }
+
+  return value;
+}
+
+/**
+ * Decodes an escaped \u code point, including surrogate pairs, into UTF-8.
+ * \u0000 is malformed input, as the strings end at the first NUL byte.
+ */
+static int read_json_code_point(FILE *in, unsigned char *utf8) {
+  long code = read_json_hex(in);
+  if (code >= 0xD800 && code <= 0xDBFF) {
+    long low = getc(in) == '\\' && getc(in) == 'u' ? read_json_hex(in) : -1;
+    if (low < 0xDC00 || low > 0xDFFF) {
+      return -1;
+    }
+
+    code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+  } else if (code <= 0 || (code >= 0xDC00 && code <= 0xDFFF)) {
+    return -1;
+  }
+
+  if (code < 0x80) {
+    utf8[0] = code;
+    return 1;
+  }
+  if (code < 0x800) {
+    utf8[0] = 0xC0 | code >> 6;
+    utf8[1] = 0x80 | (code & 0x3F);
+    return 2;
+  }
+  if (code < 0x10000) {
+    utf8[0] = 0xE0 | code >> 12;
+    utf8[1] = 0x80 | (code >> 6 & 0x3F);
+    utf8[2] = 0x80 | (code & 0x3F);
+    return 3;
+  }
+
+  utf8[0] = 0xF0 | code >> 18;
+  utf8[1] = 0x80 | (code >> 12 & 0x3F);
+  utf8[2] = 0x80 | (code >> 6 & 0x3F);
+  utf8[3] = 0x80 | (code & 0x3F);
+  return 4;
+}
+
+/**
+ * Reads a string whose opening quote has been consumed already. Strings not
+ * fitting into the buffer are malformed input; a NULL buffer discards the
+ * string.
+ */
+static bool read_json_string(FILE *in, char *buffer, size_t capacity) {
+  size_t length = 0;
+
+  for (;;) {
+    unsigned char decoded[4];
+    int decoded_len = 1;
+
+    int c = getc(in);
+    if (c == EOF || (c >= 0 && c < 0x20)) {
+      return false;
+    }
+
+    if (c == '"') {
+      break;
+    }
+
+    decoded[0] = c;
+    if (c == '\\') {
+      switch (c = getc(in)) {
+      case '"':
+      case '\\':
+      case '/':
+        decoded[0] = c;
+        break;
+      case 'b':
+        decoded[0] = '\b';
+        break;
+      case 'f':
+        decoded[0] = '\f';
+        break;
+      case 'n':
+        decoded[0] = '\n';
+        break;
+      case 'r':
+        decoded[0] = '\r';
+        break;
+      case 't':
+        decoded[0] = '\t';
+        break;
+      case 'u':
+        decoded_len = read_json_code_point(in, decoded);
+        break;
+      default:
+        return false;
+      }
+    }
+
+    if (decoded_len < 0) {
+      return false;
+    }
+
+    if (buffer) {
+      if (length + decoded_len >= capacity) {
+        return false;
+      }
+
+      memcpy(buffer + length, decoded, decoded_len);
+      length += decoded_len;
+    }
+  }
+
+  if (buffer) {
+    buffer[length] = '\0';
+  }
+
+  return true;
+}
+
+/**
+ * Skips a value of any kind; c is its first character. Returns the first
+ * character after it, or EOF on malformed input.
+ */
+static int skip_json_value(FILE *in, int c, int depth) {
+  if (depth > JSON_MAX_DEPTH) {
+    return EOF;
+  }
+
+  if (c == '"') {
+    return read_json_string(in, NULL, 0) ? skip_json_space(in) : EOF;
+  }
+
+  if (c == '[' || c == '{') {
+    int close = c == '[' ? ']' : '}';
+    c = skip_json_space(in);
+
+    while (c != close) {
+      if (close == '}') {
+        if (c != '"' || !read_json_string(in, NULL, 0) ||
+            skip_json_space(in) != ':') {
+          return EOF;
+        }
+
+        c = skip_json_space(in);
+      }
+
+      c = skip_json_value(in, c, depth + 1);
+      if (c == ',') {
+        c = skip_json_space(in);
+      } else if (c != close) {
+        return EOF;
+      }
+    }
+
+    return skip_json_space(in);
+  }
+
+  // numbers and literals
+  bool empty = true;
+  while (c != EOF && (strchr("+-.0123456789", c) || (c >= 'a' && c <= 'z') ||
+                      c == 'E')) {
+    c = getc(in);
+    empty = false;
+  }
+
+  if (empty) {
+    return EOF;
+  }
+
+  if (c == ' ' || c == '\t' || c == '\n' || c == '\r') {
+    c = skip_json_space(in);
+  }
+
+  return c;
+}
+
+/**
+ * Reads the members of an object whose opening brace has been consumed
+ * already, keeping the identifier and password strings.
+ */
+static bool read_json_object(Importer *importer) {
+  FILE *in = importer->in;
+  bool has_identifier = false, has_password = false;
+
+  int c = skip_json_space(in);
+  while (c != '}') {
+    char key[JSON_MAX_KEY_LENGTH];
+    if (c != '"' || !read_json_string(in, key, JSON_MAX_KEY_LENGTH) ||
+        skip_json_space(in) != ':') {
+      return false;
+    }
+
+    char *target = NULL;
+    if (strcmp(key, "identifier") == 0) {
+      target = importer->identifier;
+      has_identifier = true;
+    } else if (strcmp(key, "password") == 0) {
+      target = importer->password;
+      has_password = true;
+    }
+
+    c = skip_json_space(in);
+    if (target && c != '"') {
+      return false;
+    }
+
+    if (target) {
+      if (!read_json_string(in, target, TRANSFER_MAX_FIELD_LENGTH)) {
+        return false;
+      }
+
+      c = skip_json_space(in);
+    } else {
+      c = skip_json_value(in, c, 1);
+    }
+
+    if (c == ',') {
+      c = skip_json_space(in);
+    } else if (c != '}') {
+      return false;
+    }
+  }
+
+  return has_identifier && has_password;
+}
+
+static int next_json_entry(Importer *importer, char **identifier,
+                           char **password) {
+  int c = skip_json_space(importer->in);
+
+  if (!importer->json_started) {
+    importer->json_started = true;
+    if (c != '[') {
+      return -1;
+    }
+
+    c = skip_json_space(importer->in);
+    if (c == ']') {
+      return 0;
+    }
+  } else if (c == ']') {
+    return 0;
+  } else if (c != ',') {
+    return -1;
+  } else {
+    c = skip_json_space(importer->in);
+  }
+
+  if (c != '{' || !read_json_object(importer)) {
+    return -1;
+  }
+
+  *identifier = importer->identifier;
+  *password = importer->password;
+  return 1;
+}
+
+static bool add_imported_entry(Entries *entries, char *identifier,
+                               char *password, ConflictPolicy policy,
+                               ImportStats *stats) {
+  if (!check_password_identifier(identifier)) {
+    return false;
+  }
+
+  if (*password == '\0') {
+    last_error = ERR_IMPORT_FORMAT;
+    return false;
+  }
+
+  int entry_idx = find_password_entry(entries, identifier);
+  if (entry_idx >= 0 && policy == CONFLICT_FAIL) {
+    last_error = ERR_IMPORT_CONFLICT;
+    return false;
+  }
+
+  if (entry_idx >= 0 && policy == CONFLICT_SKIP) {
+    stats->skipped++;
+    return true;
+  }
+
+  if (create_entry(entries, entry_idx, identifier, password) < 0) {
+    return false;
+  }
+
+  stats->imported++;
+  return true;
+}
+
+/**
+ * Adds all records of the input to the entries, stopping at the first one
+ * that can not be imported; stats->records then tells which one it was.
+ */
+bool import_entries(Entries *entries, FILE *in, TransferFormat format,
+                    ConflictPolicy policy, ImportStats *stats) {
+  Importer importer = {0};
+  importer.in = in;
+  importer.format = format;
+  importer.identifier_column = -1;
+
+  size_t buffer_length = format == FORMAT_CSV ? TRANSFER_MAX_FIELD_LENGTH
+                                              : 2 * TRANSFER_MAX_FIELD_LENGTH;
+  char *buffer = malloc(buffer_length);
+  if (!buffer) {
+    last_error = ERR_OUT_OF_MEMORY;
+    return false;
+  }
+
+  importer.record = buffer;
+  importer.identifier = buffer;
+  importer.password = buffer + TRANSFER_MAX_FIELD_LENGTH;
+
+  memset(stats, 0, sizeof(ImportStats));
+  bool ok = true;
+
+  while (ok) {
+    char *identifier, *password;
+    int result = format == FORMAT_CSV
+                     ? next_csv_entry(&importer, &identifier, &password)
+                     : next_json_entry(&importer, &identifier, &password);
+    if (result == 0) {
+      break;
+    }
+
+    stats->records++;
+    if (result < 0) {
+      last_error = ferror(in) ? ERR_TRANSFER_FILE : ERR_IMPORT_FORMAT;
+      ok = false;
+    } else {
+      ok = add_imported_entry(entries, identifier, password, policy, stats);
+    }
+  }
+
+  OPENSSL_cleanse(buffer, buffer_length);
+  free(buffer);
+  return ok;
+}
+
+static bool csv_needs_quotes(const char *field) {
+  size_t length = strlen(field);
+  return strpbrk(field, ",\"\r\n") != NULL ||
+         (length > 0 && (field[0] == ' ' || field[length - 1] == ' '));
+}
+
+static void write_csv_field(FILE *out, const char *field) {
+  if (!csv_needs_quotes(field)) {
+    fputs(field, out);
+    return;
+  }
+
+  putc('"', out);
+  for (const char *ptr = field; *ptr; ptr++) {
+    if (*ptr == '"') {
+      putc('"', out);
+    }
+
+    putc(*ptr, out);
+  }
+  putc('"', out);
+}
+
+static void write_json_string(FILE *out, const char *string) {
+  putc('"', out);
+  for (const unsigned char *ptr = (const unsigned char *)string; *ptr; ptr++) {
+    switch (*ptr) {
+    case '"':
+      fputs("\\\"", out);
+      break;
+    case '\\':
+      fputs("\\\\", out);
+      break;
+    case '\n':
+      fputs("\\n", out);
+      break;
+    case '\r':
+      fputs("\\r", out);
+      break;
+    case '\t':
+      fputs("\\t", out);
+      break;
+    default:
+      if (*ptr < 0x20) {
+        fprintf(out, "\\u%04x", *ptr);
+      } else {
+        putc(*ptr, out);
+      }
+    }
+  }
+  putc('"', out);
+}
+
+static int compare_identifiers(const void *a, const void *b) {
+  const Entry *first = *(const Entry **)a;
+  const Entry *second = *(const Entry **)b;
+  return strcmp(first->identifier, second->identifier);
+}
+
+/**
+ * Writes all entries in identifier order, opening one sealed record at a
+ * time.
+ */
+bool export_entries(VaultKey *key, Entries *entries, FILE *out,
+                    TransferFormat format) {
+  Entry **sorted = malloc(entries->count * sizeof(Entry *) + 1);
+  if (!sorted) {
+    last_error = ERR_OUT_OF_MEMORY;
+    return false;
+  }
+
+  for (int i = 0; i < entries->count; i++) {
+    sorted[i] = &entries->items[i];
+  }
+
+  qsort(sorted, entries->count, sizeof(Entry *), compare_identifiers);
+
+  if (format == FORMAT_CSV) {
+    fputs("identifier,password\n", out);
+  } else {
+    fputs("[", out);
+  }
+
+  bool ok = true;
+  for (int i = 0; ok && i < entries->count; i++) {
+    Entry *entry = sorted[i];
+    ok = read_entry(key, entries, entry - entries->items);
+    if (!ok) {
+      break;
+    }
+
+    if (format == FORMAT_CSV) {
+      write_csv_field(out, entry->identifier);
+      putc(',', out);
+      write_csv_field(out, entry->password);
+      putc('\n', out);
+    } else {
+      fputs(i > 0 ? ",\n  {\"identifier\": " : "\n  {\"identifier\": ", out);
+      write_json_string(out, entry->identifier);
+      fputs(", \"password\": ", out);
+      write_json_string(out, entry->password);
+      putc('}', out);
+    }
+  }
+
+  if (format == FORMAT_JSON) {
+    fputs(entries->count > 0 ? "\n]\n" : "]\n", out);
+  }
+
+  if (ok && (fflush(out) != 0 || ferror(out))) {
+    last_error = ERR_TRANSFER_FILE;
+    ok = false;
+  }
+
+  free(sorted);
+  return ok;
+}
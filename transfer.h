@@ -0,0 +1,33 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "crypto.h"
+#include "entries.h"
+
+typedef enum TransferFormat {
+  FORMAT_CSV,
+  FORMAT_JSON,
+} TransferFormat;
+
+// what to do with imported entries whose identifier is already taken
+typedef enum ConflictPolicy {
+  CONFLICT_SKIP,
+  CONFLICT_OVERWRITE,
+  CONFLICT_FAIL,
+} ConflictPolicy;
+
+typedef struct ImportStats {
+  int records;
+  int imported;
+  int skipped;
+} ImportStats;
+
+bool transfer_format(char *name, char *path, TransferFormat *format);
+bool conflict_policy(char *name, ConflictPolicy *policy);
+FILE *open_export_file(char *path);
+bool import_entries(Entries *entries, FILE *in, TransferFormat format,
+                    ConflictPolicy policy, ImportStats *stats);
+bool export_entries(VaultKey *key, Entries *entries, FILE *out,
+                    TransferFormat format);